@@ -15,10 +15,12 @@
 #include <reservoir/ams_select.hpp>
 #include <reservoir/ams_select_multi.hpp>
 #include <reservoir/btree_multiset.hpp>
+#include <reservoir/fr_select.hpp>
 #include <reservoir/generators/select.hpp>
 #include <reservoir/logger.hpp>
 #include <reservoir/reservoir.hpp>
 #include <reservoir/reservoir_gather.hpp>
+#include <reservoir/reservoir_replacement.hpp>
 #include <reservoir/timer.hpp>
 
 #include <tlx/cmdline_parser.hpp>
@@ -50,12 +52,30 @@ template <typename T>
 using res_gather =
     reservoir::reservoir_gather<T, reservoir::generators::select_t>;
 
+template <typename T>
+using res_gather_tree =
+    reservoir::reservoir_gather<T, reservoir::generators::select_t, true>;
+
+template <typename T>
+using res_replacement =
+    reservoir::reservoir_replacement<T, reservoir::generators::select_t>;
+
+struct ams_wrapper {
+    template <typename T>
+    using type = reservoir::ams_select<T>;
+};
+
 template <int d>
 struct amm_wrapper {
     template <typename T>
     using type = reservoir::ams_select_multi<T, d>;
 };
 
+struct fr_wrapper {
+    template <typename T>
+    using type = reservoir::fr_select<T>;
+};
+
 struct arguments {
     size_t batch_size;
     size_t sample_size;
@@ -67,13 +87,49 @@ struct arguments {
     int iterations;
     int warmup_its;
     bool verbose;
+    // PE 0's batch is `skew` times as large as that of the other PEs
+    double skew;
+    // balance skewed batches over the PEs with insert_balanced
+    bool balance;
+
+    // batch size of PE `rank`
+    size_t local_batch_size(int rank) const {
+        if (rank > 0)
+            return batch_size;
+        return static_cast<size_t>(skew * static_cast<double>(batch_size));
+    }
+
+    // average batch size of the PEs, for throughput computations
+    double mean_batch_size(int nprocs) const {
+        return static_cast<double>(batch_size) * (nprocs - 1 + skew) / nprocs;
+    }
 
     friend std::ostream &operator<<(std::ostream &os, const arguments &args) {
         return os << "batch_size=" << args.batch_size
-                  << " sample_size=" << args.sample_size << " seed=" << args.seed;
+                  << " sample_size=" << args.sample_size << " seed=" << args.seed
+                  << " skew=" << args.skew << " balance=" << args.balance;
     }
 };
 
+// Insert a batch, balancing it over the PEs first if requested and supported
+// by the reservoir
+template <typename reservoir_t, typename Iterator>
+auto insert_batch(reservoir_t &res, Iterator begin, Iterator end, bool balance,
+                  int /* prefer this overload */)
+    -> decltype(res.insert_balanced(begin, end)) {
+    if (balance) {
+        res.insert_balanced(begin, end);
+    } else {
+        res.insert(begin, end);
+    }
+}
+
+template <typename reservoir_t, typename Iterator>
+void insert_batch(reservoir_t &res, Iterator begin, Iterator end,
+                  bool /* balance */, long /* fallback */) {
+    res.insert(begin, end);
+}
+
 template <typename res_stats_t, typename sel_stats_t>
 struct stats_pack {
     res_stats_t res_stats;
@@ -129,7 +185,8 @@ auto run(const arguments &args, input_gen_t &&input_gen,
         args.seed + static_cast<size_t>(2 * comm_.size() + comm_.rank()));
     LOGR << "Using " << decltype(rng)::name << " random generator";
 
-    std::vector<std::pair<double, int>> input(args.batch_size);
+    const size_t local_batch_size = args.local_batch_size(comm_.rank());
+    std::vector<std::pair<double, int>> input(local_batch_size);
     tlx::Aggregate<double> gen_stats, batch_stats;
 
     reservoir::timer t_batch, t_total;
@@ -164,11 +221,11 @@ auto run(const arguments &args, input_gen_t &&input_gen,
         t_batch.reset(); // don't measure initial barrier (why?)
 
         reservoir::timer t_gen;
-        input_gen(rng, input, args.batch_size, round, comm_.rank());
+        input_gen(rng, input, local_batch_size, round, comm_.rank());
         gen_stats.add(t_gen.get());
         comm_.barrier(); // todo remove?
 
-        res.insert(input.begin(), input.end());
+        insert_batch(res, input.begin(), input.end(), args.balance, 0);
 
         res.sample([&](const auto &) { /* just discard it */ });
         batch_stats.add(t_batch.get_and_reset());
@@ -206,10 +263,11 @@ auto run(const arguments &args, input_gen_t &&input_gen,
                 LOG << "";
             } else {
                 const double tp = stats.res_stats.get_throughput();
+                const double batch_size = args.mean_batch_size(comm_.size());
 
                 LOG << "RESULT type=it np=" << comm_.size()
-                    << " tpp=" << tp * args.batch_size
-                    << " tpt=" << tp * args.batch_size * comm_.size()
+                    << " tpp=" << tp * batch_size
+                    << " tpt=" << tp * batch_size * comm_.size()
                     << PRINT_RESSTAT(total, total) << PRINT_RESSTAT(tins, insert)
                     << PRINT_RESSTAT(tsel, select) << PRINT_RESSTAT(tsplit, split)
                     << PRINT_RESSTAT(tthresh, threshold)
@@ -226,8 +284,8 @@ auto run(const arguments &args, input_gen_t &&input_gen,
                 LOG << "Global res stats using "
                     << reservoir_t::select_type::name() << " selection:";
                 sLOG << "\tThroughput:" << tp
-                     << "batches/s =" << tp * args.batch_size << "items/s per PE,"
-                     << tp * args.batch_size * comm_.size() << "items/s total";
+                     << "batches/s =" << tp * batch_size << "items/s per PE,"
+                     << tp * batch_size * comm_.size() << "items/s total";
                 LOG << stats.res_stats;
 
                 LOG << "Global sel stats:";
@@ -291,7 +349,8 @@ void benchmark(arguments args, input_gen_t &&input_gen,
     }
 
     if (comm_.rank() == 0) {
-        double tp = stats.res_stats.get_throughput() * args.batch_size;
+        double tp = stats.res_stats.get_throughput() *
+                    args.mean_batch_size(comm_.size());
 
         LOG1 << "RESULT type=agg np=" << comm_.size() << " tpp=" << tp
              << " tpt=" << tp * comm_.size() << PRINT_RESSTAT(total, total)
@@ -311,8 +370,9 @@ void benchmark(arguments args, input_gen_t &&input_gen,
              << reservoir_t::select_type::name() << " selection, " << input_name
              << " input:";
         double tp = stats.res_stats.get_throughput();
-        sLOG1 << "\tThroughput:" << tp << "batches/s =" << tp * args.batch_size
-              << "items/s per PE," << tp * args.batch_size * comm_.size()
+        const double batch_size = args.mean_batch_size(comm_.size());
+        sLOG1 << "\tThroughput:" << tp << "batches/s =" << tp * batch_size
+              << "items/s per PE," << tp * batch_size * comm_.size()
               << "items/s total";
         LOG1 << stats.res_stats;
         LOG1 << "Overall selection statistics for "
@@ -339,13 +399,19 @@ int main(int argc, char *argv[]) {
            max_batches = -1, seed = 0;
     int iterations = 1;
     double min_time = -1, max_time = 600, mean_offset = 0.0, batch_weight = 1.0,
-           rank_weight = 0.0, stdev_offset = 10.0, np_weight = 0.0;
-    bool verbose = false, no_warmup = false, no_ams = false, no_amm8 = false,
-         no_amm16 = false, no_amm32 = false, no_amm64 = false,
-         no_gather = false, no_uniform = false, no_gauss = false;
+           rank_weight = 0.0, stdev_offset = 10.0, np_weight = 0.0, skew = 1.0;
+    bool verbose = false, no_warmup = false, balance = false, no_ams = false,
+         no_amm8 = false, no_amm16 = false, no_amm32 = false, no_amm64 = false,
+         no_fr = false, no_gather = false, no_gather_tree = false,
+         no_replacement = false,
+         no_uniform = false, no_gauss = false;
     // bool no_mss_naive = false;
     clp.add_size_t('n', "batchsize", batch_size, "batch size");
     clp.add_size_t('k', "samples", sample_size, "number of samples");
+    clp.add_double('S', "skew", skew,
+                   "batch size of PE 0 relative to the other PEs");
+    clp.add_bool('L', "balance", balance,
+                 "balance skewed batches over the PEs before inserting them");
     clp.add_int('i', "iterations", iterations, "number of iterations");
 
     clp.add_size_t('b', "minbatches", min_batches, "number of batches");
@@ -371,8 +437,13 @@ int main(int argc, char *argv[]) {
     clp.add_bool('6', "no-amm64", no_amm64, "don't run ams-multi64");
 
     clp.add_bool('A', "no-ams", no_ams, "don't run ams-select");
+    clp.add_bool('F', "no-fr", no_fr, "don't run fr-select");
     clp.add_bool('X', "no-gather", no_gather,
                  "don't run naive gathering algorithm");
+    clp.add_bool('R', "no-gather-tree", no_gather_tree,
+                 "don't run naive algorithm with tree reduction");
+    clp.add_bool('P', "no-replacement", no_replacement,
+                 "don't run sampling with replacement");
 
     clp.add_bool('U', "no-uniform", no_uniform, "don't run uniform input");
     clp.add_bool('G', "no-gauss", no_gauss, "don't run gauss");
@@ -387,11 +458,15 @@ int main(int argc, char *argv[]) {
     }
     if (comm_.rank() == 0)
         clp.print_result();
+    if (skew < 0) {
+        sLOGC(comm_.rank() == 0) << "skew must not be negative";
+        return -1;
+    }
 
     int warmup_its = no_warmup ? 0 : 1;
     const arguments args = {batch_size, sample_size, min_batches, max_batches,
                             seed,       min_time,    max_time,    iterations,
-                            warmup_its, verbose};
+                            warmup_its, verbose,     skew,        balance};
 
     std::vector<double> aux;
     auto uniform_gen = [&aux](auto &rng, auto &input, size_t count,
@@ -428,11 +503,11 @@ int main(int argc, char *argv[]) {
 
     if (!no_ams) {
         if (!no_uniform)
-            benchmark<res<int, reservoir::ams_select>>(args, uniform_gen, "uni",
-                                                       comm_);
+            benchmark<res<int, ams_wrapper::type>>(args, uniform_gen, "uni",
+                                                   comm_);
         if (!no_gauss)
-            benchmark<res<int, reservoir::ams_select>>(args, gauss_gen,
-                                                       gauss_name, comm_);
+            benchmark<res<int, ams_wrapper::type>>(args, gauss_gen, gauss_name,
+                                                   comm_);
     }
 
     if (!no_amm8) {
@@ -471,10 +546,35 @@ int main(int argc, char *argv[]) {
                                                        gauss_name, comm_);
     }
 
+    if (!no_fr) {
+        if (!no_uniform)
+            benchmark<res<int, fr_wrapper::type>>(args, uniform_gen, "uni",
+                                                  comm_);
+        if (!no_gauss)
+            benchmark<res<int, fr_wrapper::type>>(args, gauss_gen, gauss_name,
+                                                  comm_);
+    }
+
     if (!no_gather) {
         if (!no_uniform)
             benchmark<res_gather<int>>(args, uniform_gen, "uni", comm_);
         if (!no_gauss)
             benchmark<res_gather<int>>(args, gauss_gen, gauss_name, comm_);
     }
+
+    if (!no_gather_tree) {
+        if (!no_uniform)
+            benchmark<res_gather_tree<int>>(args, uniform_gen, "uni", comm_);
+        if (!no_gauss)
+            benchmark<res_gather_tree<int>>(args, gauss_gen, gauss_name,
+                                            comm_);
+    }
+
+    if (!no_replacement) {
+        if (!no_uniform)
+            benchmark<res_replacement<int>>(args, uniform_gen, "uni", comm_);
+        if (!no_gauss)
+            benchmark<res_replacement<int>>(args, gauss_gen, gauss_name,
+                                            comm_);
+    }
 }
@@ -13,6 +13,7 @@
 #define RESERVOIR_AMS_SELECT_HEADER
 
 #include <reservoir/aggregate.hpp>
+#include <reservoir/generators/select.hpp>
 #include <reservoir/logger.hpp>
 #include <reservoir/select_helpers.hpp>
 #include <reservoir/timer.hpp>
@@ -27,7 +28,7 @@
 #include <functional>
 #include <limits>
 #include <ostream>
-#include <random>
+#include <tuple>
 #include <utility>
 #include <vector>
 
@@ -35,7 +36,7 @@ namespace mpi = boost::mpi;
 
 namespace reservoir {
 
-template <typename Seq>
+template <typename Seq, typename RNG = generators::select_t>
 class ams_select {
 public:
     static constexpr const char *short_name = "[ams]";
@@ -128,150 +129,167 @@ public:
     }
 
 protected:
-    Result select(const Seq &seq, const ssize_t kmin, const ssize_t kmax,
-                  const ssize_t min_idx, const ssize_t max_idx,
-                  const ssize_t global_size) {
-        stats_.next_level(); // debug timings
-        if (comm_.rank() == 0)
-            stats_.record_size(global_size);
-        timer_.reset();
-
-        tlx_die_verbose_unless(max_idx >= min_idx,
-                               "Expected max_idx >= min_idx, got max_idx = "
-                                   << max_idx << " min_idx = " << min_idx);
-        tlx_die_unless(kmin <= kmax && kmin <= global_size);
-
-        const ssize_t local_size = max_idx - min_idx;
-        spLOG << "kmin =" << kmin << "kmax =" << kmax
-              << "global_size =" << global_size << "local range:" << min_idx
-              << max_idx << "size" << local_size;
-
-        Key pivot;
-
-        if (kmin == 1 || kmax == 1) {
-            pivot = std::numeric_limits<Key>::max();
-            if (local_size > 0) {
-                pivot = get_key(seq.find_rank(min_idx));
+    // Iterative selection.  Every level narrows the local range [min_idx,
+    // max_idx) and carries its boundary iterators forward, so the only tree
+    // descents per level are the ones for the pivot.
+    Result select(const Seq &seq, ssize_t kmin, ssize_t kmax, ssize_t min_idx,
+                  ssize_t max_idx, ssize_t global_size) {
+        Iterator min_it, max_it;
+        std::tie(min_it, max_it) =
+            _detail::find_rank_range(seq, min_idx, max_idx);
+        while (true) {
+            stats_.next_level(); // debug timings
+            if (comm_.rank() == 0)
+                stats_.record_size(global_size);
+            timer_.reset();
+
+            tlx_die_verbose_unless(max_idx >= min_idx,
+                                   "Expected max_idx >= min_idx, got max_idx = "
+                                       << max_idx << " min_idx = " << min_idx);
+            tlx_die_unless(kmin <= kmax && kmin <= global_size);
+
+            const ssize_t local_size = max_idx - min_idx;
+            spLOG << "kmin =" << kmin << "kmax =" << kmax
+                  << "global_size =" << global_size << "local range:" << min_idx
+                  << max_idx << "size" << local_size;
+
+            Key pivot;
+
+            if (kmin == 1 || kmax == 1) {
+                pivot = std::numeric_limits<Key>::max();
+                if (local_size > 0) {
+                    pivot = get_key(min_it);
+                }
+                pLOG << "Aborting at level " << stats_.level
+                     << " with kmin = " << kmin << " kmax = " << kmax
+                     << " local minimum: " << pivot;
+                mpi::all_reduce(comm_, mpi::inplace(pivot),
+                                mpi::minimum<Key>());
+
+                auto [ub_pos, ub_it] = seq.rank_of_upper_bound(pivot);
+                // slightly cheaty, normally we subtract min_idx from ub_pos
+                if (static_cast<ssize_t>(ub_pos) < min_idx) {
+                    ub_pos = min_idx;
+                    ub_it = min_it;
+                }
+                pLOG << "pivot = " << pivot << " pos " << ub_pos;
+
+                stats_.record(timer_.get());
+                return std::make_pair(ub_it, ub_pos);
             }
-            pLOG << "Aborting at level " << stats_.level << " with kmin = " << kmin
-                 << " kmax = " << kmax << " local minimum: " << pivot;
-            mpi::all_reduce(comm_, mpi::inplace(pivot), mpi::minimum<Key>());
-
-            auto [ub_pos, ub_it] = seq.rank_of_upper_bound(pivot);
-            // slightly cheaty, normally we subtract min_idx from ub_pos
-            if (static_cast<ssize_t>(ub_pos) < min_idx) {
-                ub_pos = min_idx;
-                ub_it = seq.find_rank(min_idx);
+
+            if (kmin < global_size - kmax) {
+                stats_.kcase.add(0);
+                double p = 1.0 - std::pow((kmin - 1.0) / kmax,
+                                          1.0 / (kmax - kmin + 1));
+                sLOGR << "Case 1, p =" << p << "base" << (kmin - 1.0) / kmax
+                      << "exponent" << 1.0 / (kmax - kmin + 1);
+                tlx_die_unless(0 <= p && p <= 1);
+
+                int pivot_idx;
+                rng_.generate_geometric_block(p, &pivot_idx, 1);
+                tlx_die_unless(pivot_idx >= 0);
+
+                if (pivot_idx < local_size) {
+                    pivot = get_key(seq.find_rank(min_idx + pivot_idx));
+                } else {
+                    pivot = std::numeric_limits<Key>::max();
+                    stats_.pidx_oob++;
+                }
+                spLOG << "chose pivot index" << pivot_idx << "value" << pivot
+                      << "for local size" << local_size;
+                // use smallest local pivot as global pivot
+                mpi::all_reduce(comm_, mpi::inplace(pivot),
+                                mpi::minimum<Key>());
+            } else {
+                stats_.kcase.add(1);
+                double p = 1.0 - std::pow((global_size - kmax) /
+                                              (global_size - kmin + 1.0),
+                                          1.0 / (kmax - kmin + 1));
+                sLOGR << "Case 2, p =" << p << "base"
+                      << (global_size - kmax) / (global_size - kmin + 1.0)
+                      << "exponent" << 1.0 / (kmax - kmin + 1);
+                tlx_die_unless(0 <= p && p <= 1);
+
+                int pivot_idx;
+                rng_.generate_geometric_block(p, &pivot_idx, 1);
+                tlx_die_unless(pivot_idx >= 0);
+
+                if (pivot_idx < local_size) {
+                    pivot = get_key(seq.find_rank(max_idx - pivot_idx - 1));
+                } else {
+                    pLOG << "pivot idx " << pivot_idx
+                         << " OOB, >= " << local_size;
+                    pivot = std::numeric_limits<Key>::min();
+                    stats_.pidx_oob++;
+                }
+                spLOG << "chose pivot index" << pivot_idx << "value" << pivot
+                      << "for local size" << local_size;
+                // use largest local pivot as global pivot
+                mpi::all_reduce(comm_, mpi::inplace(pivot),
+                                mpi::maximum<Key>());
             }
-            pLOG << "pivot = " << pivot << " pos " << ub_pos;
+            LOGR << "pivot value = " << pivot;
 
-            stats_.record(timer_.get());
-            return std::make_pair(ub_it, ub_pos);
-        }
+            auto [ub_pos, lb_pos, ub_it, lb_it] = _detail::get_bounds<true>(
+                seq, stats_, pivot, min_idx, max_idx, min_it, max_it, comm_,
+                short_name, debug);
+            auto [global_ub, global_lb] =
+                _detail::global_bound(ub_pos, lb_pos, global_size, comm_);
 
-        if (kmin < global_size - kmax) {
-            stats_.kcase.add(0);
-            double p =
-                1.0 - std::pow((kmin - 1.0) / kmax, 1.0 / (kmax - kmin + 1));
-            sLOGR << "Case 1, p =" << p << "base" << (kmin - 1.0) / kmax
-                  << "exponent" << 1.0 / (kmax - kmin + 1);
-            tlx_die_unless(0 <= p && p <= 1);
+            sLOGRC(debug || global_ub > global_lb + 1)
+                << "have" << global_lb << "smaller than," << global_ub
+                << "leq to pivot of" << global_size << "want" << kmin << "to"
+                << kmax;
 
-            std::geometric_distribution<ssize_t> pidx_dist(p);
-            ssize_t pivot_idx = pidx_dist(rng_);
-            tlx_die_unless(pivot_idx >= 0);
+            stats_.record(timer_.get());
 
-            if (pivot_idx < local_size) {
-                pivot = get_key(seq.find_rank(min_idx + pivot_idx));
+            if (global_ub < kmin) {
+                // continue on elements larger than pivot
+                stats_.right();
+                sLOGR << "recursion: right; global_ub =" << global_ub
+                      << "lb =" << global_lb << "; ub <" << kmin
+                      << "= kmin for pivot =" << pivot;
+                if (global_ub == 0)
+                    stats_.size_unchanged++;
+                else if (global_ub * 50 <= global_size || global_ub <= 5)
+                    stats_.tinychange++;
+                kmin -= global_ub;
+                kmax -= global_ub;
+                min_idx += ub_pos;
+                min_it = ub_it;
+                global_size -= global_ub;
+            } else if (global_lb > kmax) {
+                // continue on elements smaller than pivot
+                stats_.left();
+                sLOGR << "recursion: left; global_ub =" << global_ub
+                      << "lb = " << global_lb << "; lb > " << kmax
+                      << "= kmax for pivot =" << pivot;
+                if (global_lb == global_size)
+                    stats_.size_unchanged++;
+                else if ((global_size - global_lb) * 50 <= global_size ||
+                         (global_size - global_lb) <= 5)
+                    stats_.tinychange++;
+                max_idx = min_idx + lb_pos;
+                max_it = lb_it;
+                global_size = global_lb;
             } else {
-                pivot = std::numeric_limits<Key>::max();
-                stats_.pidx_oob++;
-            }
-            spLOG << "chose pivot index" << pivot_idx << "value" << pivot
-                  << "for local size" << local_size;
-            // use smallest local pivot as global pivot
-            mpi::all_reduce(comm_, mpi::inplace(pivot), mpi::minimum<Key>());
-        } else {
-            stats_.kcase.add(1);
-            double p =
-                1.0 - std::pow((global_size - kmax) / (global_size - kmin + 1.0),
-                               1.0 / (kmax - kmin + 1));
-            sLOGR << "Case 2, p =" << p << "base"
-                  << (global_size - kmax) / (global_size - kmin + 1.0)
-                  << "exponent" << 1.0 / (kmax - kmin + 1);
-            tlx_die_unless(0 <= p && p <= 1);
-
-            std::geometric_distribution<ssize_t> pidx_dist(p);
-            ssize_t pivot_idx = pidx_dist(rng_);
-            tlx_die_unless(pivot_idx >= 0);
-
-            if (pivot_idx < local_size) {
-                pivot = get_key(seq.find_rank(max_idx - pivot_idx - 1));
-            } else {
-                pLOG << "pivot idx " << pivot_idx << " OOB, >= " << local_size;
-                pivot = std::numeric_limits<Key>::min();
-                stats_.pidx_oob++;
+                // Nearly done; result key is equal to pivot, but exact split
+                // is tbd
+                return _detail::find_eq_pos(global_ub, ub_pos, ub_it,
+                                            global_lb, lb_pos, lb_it, min_idx,
+                                            kmin - global_lb, comm_, debug,
+                                            short_name);
             }
-            spLOG << "chose pivot index" << pivot_idx << "value" << pivot
-                  << "for local size" << local_size;
-            // use largest local pivot as global pivot
-            mpi::all_reduce(comm_, mpi::inplace(pivot), mpi::maximum<Key>());
-        }
-        LOGR << "pivot value = " << pivot;
-
-        auto [ub_pos, lb_pos, ub_it, lb_it] = _detail::get_bounds(
-            seq, stats_, pivot, min_idx, max_idx, comm_, short_name, debug);
-        auto [global_ub, global_lb] =
-            _detail::global_bound(ub_pos, lb_pos, global_size, comm_);
-
-        sLOGRC(debug || global_ub > global_lb + 1)
-            << "have" << global_lb << "smaller than," << global_ub
-            << "leq to pivot of" << global_size << "want" << kmin << "to" << kmax;
-
-        stats_.record(timer_.get());
-
-        if (global_ub < kmin) {
-            // recurse on elements larger than pivot
-            stats_.right();
-            sLOGR << "recursion: right; global_ub =" << global_ub
-                  << "lb =" << global_lb << "; ub <" << kmin
-                  << "= kmin for pivot =" << pivot;
-            if (global_ub == 0)
-                stats_.size_unchanged++;
-            else if (global_ub * 50 <= global_size || global_ub <= 5)
-                stats_.tinychange++;
-            return select(seq, kmin - global_ub, kmax - global_ub,
-                          min_idx + ub_pos, max_idx, global_size - global_ub);
-        } else if (global_lb > kmax) {
-            // recurse on elements smaller than pivot
-            stats_.left();
-            sLOGR << "recursion: left; global_ub =" << global_ub
-                  << "lb = " << global_lb << "; lb > " << kmax
-                  << "= kmax for pivot =" << pivot;
-            if (global_lb == global_size)
-                stats_.size_unchanged++;
-            else if ((global_size - global_lb) * 50 <= global_size ||
-                     (global_size - global_lb) <= 5)
-                stats_.tinychange++;
-            return select(seq, kmin, kmax, min_idx, min_idx + lb_pos, global_lb);
-        } else {
-            // Nearly done; result key is equal to pivot, but exact split is tbd
-            return _detail::find_eq_pos(global_ub, ub_pos, ub_it, global_lb,
-                                        lb_pos, lb_it, min_idx, kmin - global_lb,
-                                        comm_, debug, short_name);
         }
     }
 
     constexpr Key get_key(const Iterator &it) {
-        if constexpr (std::is_same_v<Key, Elem>) {
-            return *it;
-        } else {
-            return it->first;
-        }
+        return Seq::key_of_value::get(*it);
     }
 
     mpi::communicator &comm_;
-    std::mt19937_64 rng_;
+    RNG rng_;
     mutable _detail::select_stats<time> stats_;
     mutable timer timer_;
 };
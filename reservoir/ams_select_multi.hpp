@@ -13,6 +13,7 @@
 #define RESERVOIR_AMS_SELECT_MULTI_HEADER
 
 #include <reservoir/aggregate.hpp>
+#include <reservoir/generators/select.hpp>
 #include <reservoir/logger.hpp>
 #include <reservoir/select_helpers.hpp>
 #include <reservoir/timer.hpp>
@@ -27,7 +28,6 @@
 #include <functional>
 #include <limits>
 #include <ostream>
-#include <random>
 #include <tuple>
 #include <utility>
 #include <vector>
@@ -36,7 +36,7 @@ namespace mpi = boost::mpi;
 
 namespace reservoir {
 
-template <typename Seq, int d = 16>
+template <typename Seq, int d = 16, typename RNG = generators::select_t>
 class ams_select_multi {
 public:
     static constexpr const char short_name[] = "[amm]";
@@ -111,6 +111,7 @@ public:
         // clang-format on
 
         // allocate space for pivots
+        pivot_idxs_.resize(d);
         pivots_.resize(d);
         bounds_.resize(d);
         gbounds_.resize(2 * d);
@@ -151,207 +152,229 @@ public:
     }
 
 protected:
-    Result select(const Seq &seq, const ssize_t kmin, const ssize_t kmax,
-                  const ssize_t min_idx, const ssize_t max_idx,
-                  const ssize_t global_size) {
-        stats_.next_level(); // debug timings
-        if (comm_.rank() == 0)
-            stats_.record_size(global_size);
-        timer_.reset();
-
-        tlx_die_verbose_unless(max_idx >= min_idx,
-                               "Expected max_idx >= min_idx, got max_idx = "
-                                   << max_idx << " min_idx = " << min_idx);
-        tlx_die_unless(kmin <= kmax && kmin <= global_size);
-
-        const ssize_t local_size = max_idx - min_idx;
-        spLOG << "kmin =" << kmin << "kmax =" << kmax
-              << "global_size =" << global_size << "local range:" << min_idx
-              << max_idx << "size" << local_size;
-
-        Iterator min_it = seq.find_rank(min_idx), max_it = seq.find_rank(max_idx);
-
-        if (kmin == 1 || kmax == 1) {
-            Key pivot = std::numeric_limits<Key>::max();
-            if (local_size > 0) {
-                pivot = get_key(min_it);
-            }
-            pLOG << "Aborting at level " << stats_.level << " with kmin = " << kmin
-                 << " kmax = " << kmax << " local minimum: " << pivot;
-            mpi::all_reduce(comm_, mpi::inplace(pivot), mpi::minimum<Key>());
-
-            auto [ub_pos, ub_it] = seq.rank_of_upper_bound(pivot);
-            // slightly cheaty, normally we subtract min_idx from ub_pos
-            if (static_cast<ssize_t>(ub_pos) < min_idx) {
-                ub_pos = min_idx;
-                ub_it = min_it;
-            }
-            pLOG << "pivot = " << pivot << " pos " << ub_pos;
-
-            stats_.record(timer_.get());
-            return std::make_pair(ub_it, ub_pos);
-        }
+    // Iterative selection.  Every level narrows the local range [min_idx,
+    // max_idx) and carries its boundary iterators forward, so the only tree
+    // descents per level are the ones for the pivots.
+    Result select(const Seq &seq, ssize_t kmin, ssize_t kmax, ssize_t min_idx,
+                  ssize_t max_idx, ssize_t global_size) {
+        Iterator min_it, max_it;
+        std::tie(min_it, max_it) =
+            _detail::find_rank_range(seq, min_idx, max_idx);
+        while (true) {
+            stats_.next_level(); // debug timings
+            if (comm_.rank() == 0)
+                stats_.record_size(global_size);
+            timer_.reset();
+
+            tlx_die_verbose_unless(max_idx >= min_idx,
+                                   "Expected max_idx >= min_idx, got max_idx = "
+                                       << max_idx << " min_idx = " << min_idx);
+            tlx_die_unless(kmin <= kmax && kmin <= global_size);
+
+            const ssize_t local_size = max_idx - min_idx;
+            spLOG << "kmin =" << kmin << "kmax =" << kmax
+                  << "global_size =" << global_size << "local range:" << min_idx
+                  << max_idx << "size" << local_size;
+
+            if (kmin == 1 || kmax == 1) {
+                Key pivot = std::numeric_limits<Key>::max();
+                if (local_size > 0) {
+                    pivot = get_key(min_it);
+                }
+                pLOG << "Aborting at level " << stats_.level
+                     << " with kmin = " << kmin << " kmax = " << kmax
+                     << " local minimum: " << pivot;
+                mpi::all_reduce(comm_, mpi::inplace(pivot),
+                                mpi::minimum<Key>());
+
+                auto [ub_pos, ub_it] = seq.rank_of_upper_bound(pivot);
+                // slightly cheaty, normally we subtract min_idx from ub_pos
+                if (static_cast<ssize_t>(ub_pos) < min_idx) {
+                    ub_pos = min_idx;
+                    ub_it = min_it;
+                }
+                pLOG << "pivot = " << pivot << " pos " << ub_pos;
 
-        if (kmin < global_size - kmax) {
-            stats_.kcase.add(0);
-            double p =
-                1.0 - std::pow((kmin - 1.0) / kmax, 1.0 / (kmax - kmin + 1));
-            sLOGR << "Case 1, p =" << p << "base" << (kmin - 1.0) / kmax
-                  << "exponent" << 1.0 / (kmax - kmin + 1);
-            tlx_die_unless(0 <= p && p <= 1);
+                stats_.record(timer_.get());
+                return std::make_pair(ub_it, ub_pos);
+            }
 
-            std::geometric_distribution<ssize_t> pidx_dist(p);
-            for (int i = 0; i < d; i++) {
-                ssize_t pivot_idx = pidx_dist(rng_);
-                tlx_die_unless(pivot_idx >= 0);
-
-                if (pivot_idx < local_size) {
-                    pivots_[i] = get_key(seq.find_rank(min_idx + pivot_idx));
-                } else {
-                    pivots_[i] = std::numeric_limits<Key>::max();
-                    stats_.pidx_oob++;
+            if (kmin < global_size - kmax) {
+                stats_.kcase.add(0);
+                double p = 1.0 - std::pow((kmin - 1.0) / kmax,
+                                          1.0 / (kmax - kmin + 1));
+                sLOGR << "Case 1, p =" << p << "base" << (kmin - 1.0) / kmax
+                      << "exponent" << 1.0 / (kmax - kmin + 1);
+                tlx_die_unless(0 <= p && p <= 1);
+
+                // draw all pivot indices at once
+                rng_.generate_geometric_block(p, pivot_idxs_.data(), d);
+                pivot_ranks_.clear();
+                for (int i = 0; i < d; i++) {
+                    const ssize_t pivot_idx = pivot_idxs_[i];
+                    tlx_die_unless(pivot_idx >= 0);
+
+                    if (pivot_idx < local_size) {
+                        pivot_ranks_.emplace_back(min_idx + pivot_idx, i);
+                    } else {
+                        pivots_[i] = std::numeric_limits<Key>::max();
+                        stats_.pidx_oob++;
+                    }
+                    spLOG << "chose pivot index" << pivot_idx
+                          << "for local size" << local_size << "pivot" << i;
                 }
-                spLOG << "chose pivot index" << pivot_idx << "value" << pivots_[i]
-                      << "for local size" << local_size << "pivot" << i;
+                find_pivots(seq);
+                // use smallest of local pivots as global pivots
+                mpi::all_reduce(comm_, mpi::inplace(pivots_.data()), d,
+                                mpi::minimum<Key>());
+            } else {
+                stats_.kcase.add(1);
+                double p = 1.0 - std::pow((global_size - kmax) /
+                                              (global_size - kmin + 1.0),
+                                          1.0 / (kmax - kmin + 1));
+                sLOGR << "Case 2, p =" << p << "base"
+                      << (global_size - kmax) / (global_size - kmin + 1.0)
+                      << "exponent" << 1.0 / (kmax - kmin + 1);
+                tlx_die_unless(0 <= p && p <= 1);
+
+                // draw all pivot indices at once
+                rng_.generate_geometric_block(p, pivot_idxs_.data(), d);
+                pivot_ranks_.clear();
+                for (int i = 0; i < d; i++) {
+                    const ssize_t pivot_idx = pivot_idxs_[i];
+                    tlx_die_unless(pivot_idx >= 0);
+
+                    if (pivot_idx < local_size) {
+                        pivot_ranks_.emplace_back(max_idx - pivot_idx - 1, i);
+                    } else {
+                        pivots_[i] = std::numeric_limits<Key>::min();
+                        stats_.pidx_oob++;
+                    }
+                    spLOG << "chose pivot index" << pivot_idx
+                          << "for local size" << local_size << "pivot" << i;
+                }
+                find_pivots(seq);
+
+                // use largest of local pivots as global pivots
+                mpi::all_reduce(comm_, mpi::inplace(pivots_.data()), d,
+                                mpi::maximum<Key>());
             }
-            // use smallest of local pivots as global pivots
-            mpi::all_reduce(comm_, mpi::inplace(pivots_.data()), d,
-                            mpi::minimum<Key>());
-        } else {
-            stats_.kcase.add(1);
-            double p =
-                1.0 - std::pow((global_size - kmax) / (global_size - kmin + 1.0),
-                               1.0 / (kmax - kmin + 1));
-            sLOGR << "Case 2, p =" << p << "base"
-                  << (global_size - kmax) / (global_size - kmin + 1.0)
-                  << "exponent" << 1.0 / (kmax - kmin + 1);
-            tlx_die_unless(0 <= p && p <= 1);
-
-            std::geometric_distribution<ssize_t> pidx_dist(p);
+            LOGR << "pivot values = " << pivots_;
+
             for (int i = 0; i < d; i++) {
-                ssize_t pivot_idx = pidx_dist(rng_);
-                tlx_die_unless(pivot_idx >= 0);
-
-                if (pivot_idx < local_size) {
-                    pivots_[i] = get_key(seq.find_rank(max_idx - pivot_idx - 1));
-                } else {
-                    pivots_[i] = std::numeric_limits<Key>::min();
-                    stats_.pidx_oob++;
-                }
-                spLOG << "chose pivot index" << pivot_idx << "value" << pivots_[i]
-                      << "for local size" << local_size << "pivot" << i;
+                bounds_[i] = _detail::get_bounds<false>(
+                    seq, stats_, pivots_[i], min_idx, max_idx, min_it, max_it,
+                    comm_, short_name, debug);
+                gbounds_[ubidx(i)] = bounds_[i].ub_pos;
+                gbounds_[lbidx(i)] = bounds_[i].lb_pos;
             }
 
-            // use largest of local pivots as global pivots
-            mpi::all_reduce(comm_, mpi::inplace(pivots_.data()), d,
-                            mpi::maximum<Key>());
-        }
-        LOGR << "pivot values = " << pivots_;
-
-        for (int i = 0; i < d; i++) {
-            bounds_[i] = _detail::get_bounds<false>(
-                seq, stats_, pivots_[i], min_idx, max_idx, min_it, max_it,
-                comm_, short_name, debug);
-            gbounds_[ubidx(i)] = bounds_[i].ub_pos;
-            gbounds_[lbidx(i)] = bounds_[i].lb_pos;
-        }
+            mpi::all_reduce(comm_, mpi::inplace(gbounds_.data()), 2 * d,
+                            std::plus<>());
+
+            sLOGR << "global_size =" << global_size << "want" << kmin << "to"
+                  << kmax << "got bounds (ub,lb)" << gbounds_;
+
+            // dummy
+            int best_ub_idx = -1, best_lb_idx = -1;
+            ssize_t best_ub_diff = std::numeric_limits<ssize_t>::max(),
+                    best_lb_diff = best_ub_diff;
+
+            for (int i = 0; i < d; i++) {
+                ssize_t global_ub = gbounds_[ubidx(i)],
+                        global_lb = gbounds_[lbidx(i)];
+                if (global_ub >= kmin && global_lb <= kmax) {
+                    // we're good, just figure out the duplicates
+                    sLOGR << "Success! Bound" << i << "is perfect:"
+                          << global_lb << "ub" << global_ub << "kmin" << kmin
+                          << "kmax" << kmax;
+                    Result result = _detail::find_eq_pos(
+                        global_ub, bounds_[i].ub_pos, bounds_[i].ub_it,
+                        global_lb, bounds_[i].lb_pos, bounds_[i].lb_it,
+                        min_idx, kmin - global_lb, comm_, debug, short_name);
 
-        mpi::all_reduce(comm_, mpi::inplace(gbounds_.data()), 2 * d, std::plus<>());
-
-        sLOGR << "global_size =" << global_size << "want" << kmin << "to"
-              << kmax << "got bounds (ub,lb)" << gbounds_;
-
-        // dummy
-        int best_ub_idx = -1, best_lb_idx = -1;
-        ssize_t best_ub_diff = std::numeric_limits<ssize_t>::max(),
-                best_lb_diff = best_ub_diff;
-
-        for (int i = 0; i < d; i++) {
-            ssize_t global_ub = gbounds_[ubidx(i)], global_lb = gbounds_[lbidx(i)];
-            if (global_ub >= kmin && global_lb <= kmax) {
-                // we're good, just figure out the duplicates
-                sLOGR << "Success! Bound" << i << "is perfect:" << global_lb
-                      << "ub" << global_ub << "kmin" << kmin << "kmax" << kmax;
-                if (global_lb < kmin) {
-                    // Discard all items equal to the pivot
-                    // XXX TODO sure we don't need find_eq_pos for this?
                     stats_.record(timer_.get());
-                    return std::make_pair(bounds_[i].ub_it,
-                                          min_idx + bounds_[i].ub_pos);
+                    return result;
                 }
 
-                Result result = _detail::find_eq_pos(
-                    global_ub, bounds_[i].ub_pos, bounds_[i].ub_it, global_lb,
-                    bounds_[i].lb_pos, bounds_[i].lb_it, min_idx,
-                    kmin - global_lb, comm_, debug, short_name);
-
-                stats_.record(timer_.get());
-                return result;
-            }
+                if (global_ub < kmin) {
+                    ssize_t diff = kmin - global_ub;
+                    if (diff < best_ub_diff) {
+                        sLOGR << "Pair" << i << "improves UB:" << global_ub
+                              << "<" << kmin << "diff" << diff << "<"
+                              << best_ub_diff;
+                        best_ub_diff = diff;
+                        best_ub_idx = i;
+                    }
+                }
 
-            if (global_ub < kmin) {
-                ssize_t diff = kmin - global_ub;
-                if (diff < best_ub_diff) {
-                    sLOGR << "Pair" << i << "improves UB:" << global_ub << "<"
-                          << kmin << "diff" << diff << "<" << best_ub_diff;
-                    best_ub_diff = diff;
-                    best_ub_idx = i;
+                if (global_lb > kmax) {
+                    ssize_t diff = global_lb - kmax;
+                    if (diff < best_lb_diff) {
+                        sLOGR << "Pair" << i << "improves LB:" << global_lb
+                              << ">" << kmax << "diff" << diff << "<"
+                              << best_lb_diff;
+                        best_lb_diff = diff;
+                        best_lb_idx = i;
+                    }
                 }
             }
 
-            if (global_lb > kmax) {
-                ssize_t diff = global_lb - kmax;
-                if (diff < best_lb_diff) {
-                    sLOGR << "Pair" << i << "improves LB:" << global_lb << ">"
-                          << kmax << "diff" << diff << "<" << best_lb_diff;
-                    best_lb_diff = diff;
-                    best_lb_idx = i;
-                }
+            sLOGR << "Narrowed it to within" << best_ub_diff
+                  << "of kmin with pivot" << best_ub_idx << "and"
+                  << best_lb_diff << "of kmax with" << best_lb_idx;
+
+            ssize_t new_global_size = global_size;
+            if (best_lb_idx >= 0) {
+                // do this first, it's relative to the old min_idx
+                max_idx = min_idx + bounds_[best_lb_idx].lb_pos;
+                max_it = bounds_[best_lb_idx].lb_it;
+                ssize_t global_lb = gbounds_[lbidx(best_lb_idx)];
+                new_global_size -= (global_size - global_lb);
+            }
+            if (best_ub_idx >= 0) {
+                min_idx += bounds_[best_ub_idx].ub_pos;
+                min_it = bounds_[best_ub_idx].ub_it;
+                ssize_t global_ub = gbounds_[ubidx(best_ub_idx)];
+                kmin -= global_ub;
+                kmax -= global_ub;
+                new_global_size -= global_ub;
             }
+            tlx_die_unless(new_global_size > 0);
+            tlx_die_unless(new_global_size <= global_size);
+
+            sLOGR << "New kmin:" << kmin << "kmax:" << kmax
+                  << "size:" << new_global_size;
+
+            // Record magnitude of size change in statistics
+            if (new_global_size == global_size)
+                stats_.size_unchanged++;
+            else if ((global_size - new_global_size) * 50 <= global_size ||
+                     (global_size - new_global_size) <= 5)
+                stats_.tinychange++;
+            global_size = new_global_size;
+
+            stats_.record(timer_.get());
         }
+    }
 
-        sLOGR << "Narrowed it to within" << best_ub_diff << "of kmin with pivot"
-              << best_ub_idx << "and" << best_lb_diff << "of kmax with"
-              << best_lb_idx;
-
-        ssize_t new_min_idx = min_idx, new_max_idx = max_idx, new_kmin = kmin,
-                new_kmax = kmax, new_global_size = global_size;
-        if (best_ub_idx >= 0) {
-            new_min_idx += bounds_[best_ub_idx].ub_pos;
-            ssize_t global_ub = gbounds_[ubidx(best_ub_idx)];
-            new_kmin -= global_ub;
-            new_kmax -= global_ub;
-            new_global_size -= global_ub;
+    // Look up the keys of the pivots in pivot_ranks_, a list of (local rank,
+    // pivot number) pairs, with a single descent of seq
+    void find_pivots(const Seq &seq) {
+        std::sort(pivot_ranks_.begin(), pivot_ranks_.end());
+        ranks_.clear();
+        for (const auto &pr : pivot_ranks_) {
+            ranks_.push_back(static_cast<size_t>(pr.first));
         }
-        if (best_lb_idx >= 0) {
-            new_max_idx = min_idx + bounds_[best_lb_idx].lb_pos;
-            ssize_t global_lb = gbounds_[lbidx(best_lb_idx)];
-            new_global_size -= (global_size - global_lb);
+        pivot_its_.resize(ranks_.size());
+        seq.find_ranks(ranks_.begin(), ranks_.end(), pivot_its_.begin());
+        for (size_t j = 0; j < pivot_ranks_.size(); j++) {
+            pivots_[pivot_ranks_[j].second] = get_key(pivot_its_[j]);
         }
-        tlx_die_unless(new_global_size > 0);
-        tlx_die_unless(new_global_size <= global_size);
-
-        sLOGR << "New kmin:" << new_kmin << "kmax:" << new_kmax
-              << "size:" << new_global_size;
-
-        // Record magnitude of size change in statistics
-        if (new_global_size == global_size)
-            stats_.size_unchanged++;
-        else if ((global_size - new_global_size) * 50 <= global_size ||
-                 (global_size - new_global_size) <= 5)
-            stats_.tinychange++;
-
-        stats_.record(timer_.get());
-        return select(seq, new_kmin, new_kmax, new_min_idx, new_max_idx,
-                      new_global_size);
     }
 
     constexpr Key get_key(const Iterator &it) {
-        if constexpr (std::is_same_v<Key, Elem>) {
-            return *it;
-        } else {
-            return it->first;
-        }
+        return Seq::key_of_value::get(*it);
     }
 
     constexpr ssize_t ubidx(int i) {
@@ -362,7 +385,12 @@ protected:
     }
 
     mpi::communicator &comm_;
-    std::mt19937_64 rng_;
+    RNG rng_;
+    std::vector<int> pivot_idxs_;
+    // for find_pivots
+    std::vector<std::pair<ssize_t, int>> pivot_ranks_;
+    std::vector<size_t> ranks_;
+    std::vector<Iterator> pivot_its_;
     std::vector<Key> pivots_;
     std::vector<Bound> bounds_;
     std::vector<ssize_t> gbounds_;
@@ -15,11 +15,14 @@
 #ifndef RESERVOIR_BTREE_HEADER
 #define RESERVOIR_BTREE_HEADER
 
+#include <reservoir/btree_simd.hpp>
+
 #include <tlx/die/core.hpp>
 
 // *** Required Headers from the STL
 
 #include <algorithm>
+#include <array>
 #include <cassert>
 #include <cstddef>
 #include <functional>
@@ -27,7 +30,10 @@
 #include <memory>
 #include <numeric>
 #include <ostream>
+#include <thread>
+#include <type_traits>
 #include <utility>
+#include <vector>
 
 namespace reservoir {
 
@@ -94,15 +100,27 @@ struct btree_default_traits {
     static const uint16_t leaf_slots = TLX_BTREE_MAX(8, 256 / (sizeof(Value)));
 
     //! Number of slots in each inner node of the tree. Estimated so that each
-    //! node has a size of about 256 bytes.
+    //! node has a size of about 256 bytes, including the child counts.
     static const uint16_t inner_slots =
-        TLX_BTREE_MAX(8, 256 / (sizeof(Key) + sizeof(void*)));
+        TLX_BTREE_MAX(8, 256 / (sizeof(Key) + sizeof(void*) + sizeof(size_t)));
 
     //! As of stx-btree-0.9, the code does linear search in find_lower() and
     //! find_upper() instead of binary_search, unless the node size is larger
     //! than this threshold. See notes at
     //! http://panthema.net/2013/0504-STX-B+Tree-Binary-vs-Linear-Search
     static const size_t binsearch_threshold = 256;
+
+    //! If true, find_lower() and find_upper() compare all keys of a node with
+    //! AVX2 / AVX-512 instead of the linear or binary search when the keys are
+    //! doubles ordered by std::less and stored contiguously, i.e., in inner
+    //! nodes and in the leaves of sets. This ignores binsearch_threshold.
+    static const bool simd_search = true;
+
+    //! If true, the leaves of maps and multimaps store the keys and the data
+    //! in two separate arrays instead of an array of (key, data) pairs.
+    //! Searching a leaf then only touches the keys. Iterators return a proxy
+    //! with references first and second instead of a value_type&.
+    static const bool split_leaves = false;
 };
 
 /*!
@@ -210,6 +228,89 @@ public:
     //! with TLX_BTREE_DEBUG and the key type must be std::ostream printable.
     static const bool debug = traits::debug;
 
+private:
+    //! Extracts Data from a value_type of std::pair<key_type, Data>
+    template <typename V>
+    struct pair_data {
+        static constexpr bool is_pair = false;
+        using type = V;
+    };
+
+    template <typename Data>
+    struct pair_data<std::pair<key_type, Data>> {
+        static constexpr bool is_pair = true;
+        using type = Data;
+    };
+
+public:
+    //! Layout parameter: The leaves store keys and data in separate arrays.
+    //! Only possible if the value_type is a std::pair of key and data.
+    static constexpr bool split_leaves =
+        traits::split_leaves && pair_data<value_type>::is_pair;
+
+    //! \}
+
+public:
+    //! \name Slot References of Split Leaves
+    //! \{
+
+    //! The data type stored next to the keys in split leaves
+    using leaf_data_type = typename pair_data<value_type>::type;
+
+    //! Reference to a slot of a split leaf. Replaces value_type& as the result
+    //! of dereferencing an iterator, with the same members first and second.
+    template <typename Data>
+    struct slot_reference {
+        const key_type& first;
+        Data& second;
+
+        //! Copy the slot into a (key, data) pair
+        operator value_type() const {
+            return value_type(first, second);
+        }
+
+        friend bool operator==(const slot_reference& a,
+                               const slot_reference& b) {
+            return a.first == b.first && a.second == b.second;
+        }
+
+        friend bool operator<(const slot_reference& a,
+                              const slot_reference& b) {
+            return a.first < b.first ||
+                   (!(b.first < a.first) && a.second < b.second);
+        }
+    };
+
+    //! Result of operator->() on iterators of split leaves
+    template <typename Reference>
+    struct slot_pointer {
+        Reference ref;
+
+        const Reference* operator->() const noexcept {
+            return &ref;
+        }
+    };
+
+    //! Result of dereferencing a mutable iterator
+    using leaf_reference =
+        std::conditional_t<split_leaves, slot_reference<leaf_data_type>,
+                           value_type&>;
+
+    //! Result of dereferencing a const iterator
+    using leaf_const_reference =
+        std::conditional_t<split_leaves, slot_reference<const leaf_data_type>,
+                           const value_type&>;
+
+    //! Result of operator->() on a mutable iterator
+    using leaf_pointer =
+        std::conditional_t<split_leaves, slot_pointer<leaf_reference>,
+                           value_type*>;
+
+    //! Result of operator->() on a const iterator
+    using leaf_const_pointer =
+        std::conditional_t<split_leaves, slot_pointer<leaf_const_reference>,
+                           const value_type*>;
+
     //! \}
 
 private:
@@ -250,9 +351,21 @@ private:
         //! Pointers to children
         node* childid[inner_slotmax + 1]; // NOLINT
 
+        //! Number of elements in the subtree of each child, kept next to the
+        //! keys so that rank queries don't have to dereference the children
+        size_type childcount[inner_slotmax + 1]; // NOLINT
+
         //! Sum of the number of elements in leafs below this node
         size_type subtree_size;
 
+        //! The keys are stored contiguously in slotkey
+        static constexpr bool contiguous_keys = true;
+
+        //! Array of the keys, for the vectorized search
+        const key_type* keys() const noexcept {
+            return slotkey;
+        }
+
         //! Set variables to initial values.
         void initialize(const LevelType l) noexcept {
             node::initialize(l);
@@ -282,6 +395,7 @@ private:
         void copy_slots_from(const InnerNode& n) noexcept {
             std::copy(n.slotkey, n.slotkey + n.slotuse, slotkey);
             std::copy(n.childid, n.childid + n.slotuse + 1, childid);
+            std::copy(n.childcount, n.childcount + n.slotuse + 1, childcount);
             node::slotuse = n.slotuse;
             subtree_size = n.subtree_size;
         }
@@ -300,9 +414,186 @@ private:
         }
     };
 
+    //! Slot arrays of a leaf: an array of (key, data) pairs. All accesses to
+    //! the slots of a leaf go through these functions, so that the layout can
+    //! be switched with split_leaves.
+    template <bool Split, typename Dummy = void>
+    struct LeafSlots {
+        //! Array of (key, data) pairs
+        value_type slotdata[leaf_slotmax]; // NOLINT
+
+        //! The keys are stored contiguously in slotdata only for sets
+        static constexpr bool contiguous_keys =
+            std::is_same_v<value_type, key_type>;
+
+        //! Return key in slot s.
+        const key_type& key(size_t s) const noexcept {
+            return key_of_value::get(slotdata[s]);
+        }
+
+        //! Return modifiable key in slot s, for transform_keys()
+        key_type& mutable_key(size_t s) noexcept {
+            // the key is part of the (non-const) value in the slot
+            return const_cast<key_type&>(key_of_value::get(slotdata[s]));
+        }
+
+        //! Array of the keys, for the vectorized search. Only valid if
+        //! contiguous_keys is set.
+        const key_type* keys() const noexcept {
+            return slotdata;
+        }
+
+        //! Reference to the value in slot s
+        leaf_reference slot(size_t s) noexcept {
+            return slotdata[s];
+        }
+
+        //! Reference to the value in slot s
+        leaf_const_reference slot(size_t s) const noexcept {
+            return slotdata[s];
+        }
+
+        //! Pointer to the value in slot s
+        leaf_pointer slot_ptr(size_t s) noexcept {
+            return &slotdata[s];
+        }
+
+        //! Pointer to the value in slot s
+        leaf_const_pointer slot_ptr(size_t s) const noexcept {
+            return &slotdata[s];
+        }
+
+        //! Assign a value to slot s
+        template <typename ValueType>
+        void set_slot(size_t s, ValueType&& value) noexcept {
+            slotdata[s] = std::forward<ValueType>(value);
+        }
+
+        //! Move the slots [first, last) to dst, starting at slot d_first
+        void move_slots(size_t first, size_t last, LeafSlots& dst,
+                        size_t d_first) noexcept {
+            std::move(slotdata + first, slotdata + last,
+                      dst.slotdata + d_first);
+        }
+
+        //! Move the slots [first, last) to dst, ending before slot d_last
+        void move_slots_backward(size_t first, size_t last, LeafSlots& dst,
+                                 size_t d_last) noexcept {
+            std::move_backward(slotdata + first, slotdata + last,
+                               dst.slotdata + d_last);
+        }
+
+        //! Copy the slots [first, last) to dst, starting at slot d_first
+        void copy_slots(size_t first, size_t last, LeafSlots& dst,
+                        size_t d_first) const noexcept {
+            std::copy(slotdata + first, slotdata + last,
+                      dst.slotdata + d_first);
+        }
+
+        //! Release the resources held by the values in slots [first, last)
+        void reset_slots(size_t first, size_t last) noexcept {
+            if constexpr (!std::is_trivially_destructible_v<value_type>) {
+                for (size_t s = first; s < last; ++s)
+                    slotdata[s] = value_type();
+            }
+        }
+    };
+
+    //! Slot arrays of a split leaf: separate arrays of keys and data, so that
+    //! searches only touch the keys and moves are contiguous per array.
+    template <typename Dummy>
+    struct LeafSlots<true, Dummy> {
+        //! Array of keys
+        key_type slotkey[leaf_slotmax]; // NOLINT
+
+        //! Array of data, slotval[s] belongs to slotkey[s]
+        leaf_data_type slotval[leaf_slotmax]; // NOLINT
+
+        //! The keys are always stored contiguously in slotkey
+        static constexpr bool contiguous_keys = true;
+
+        //! Return key in slot s.
+        const key_type& key(size_t s) const noexcept {
+            return slotkey[s];
+        }
+
+        //! Return modifiable key in slot s, for transform_keys()
+        key_type& mutable_key(size_t s) noexcept {
+            return slotkey[s];
+        }
+
+        //! Array of the keys, for the vectorized search
+        const key_type* keys() const noexcept {
+            return slotkey;
+        }
+
+        //! Reference to the key and data in slot s
+        leaf_reference slot(size_t s) noexcept {
+            return leaf_reference{slotkey[s], slotval[s]};
+        }
+
+        //! Reference to the key and data in slot s
+        leaf_const_reference slot(size_t s) const noexcept {
+            return leaf_const_reference{slotkey[s], slotval[s]};
+        }
+
+        //! Pointer to the key and data in slot s
+        leaf_pointer slot_ptr(size_t s) noexcept {
+            return leaf_pointer{slot(s)};
+        }
+
+        //! Pointer to the key and data in slot s
+        leaf_const_pointer slot_ptr(size_t s) const noexcept {
+            return leaf_const_pointer{slot(s)};
+        }
+
+        //! Assign a (key, data) pair to slot s
+        template <typename ValueType>
+        void set_slot(size_t s, ValueType&& value) noexcept {
+            slotkey[s] = value.first;
+            slotval[s] = std::forward<ValueType>(value).second;
+        }
+
+        //! Move the slots [first, last) to dst, starting at slot d_first
+        void move_slots(size_t first, size_t last, LeafSlots& dst,
+                        size_t d_first) noexcept {
+            std::copy(slotkey + first, slotkey + last, dst.slotkey + d_first);
+            std::move(slotval + first, slotval + last, dst.slotval + d_first);
+        }
+
+        //! Move the slots [first, last) to dst, ending before slot d_last
+        void move_slots_backward(size_t first, size_t last, LeafSlots& dst,
+                                 size_t d_last) noexcept {
+            std::copy_backward(slotkey + first, slotkey + last,
+                               dst.slotkey + d_last);
+            std::move_backward(slotval + first, slotval + last,
+                               dst.slotval + d_last);
+        }
+
+        //! Copy the slots [first, last) to dst, starting at slot d_first
+        void copy_slots(size_t first, size_t last, LeafSlots& dst,
+                        size_t d_first) const noexcept {
+            std::copy(slotkey + first, slotkey + last, dst.slotkey + d_first);
+            std::copy(slotval + first, slotval + last, dst.slotval + d_first);
+        }
+
+        //! Release the resources held by the slots [first, last)
+        void reset_slots(size_t first, size_t last) noexcept {
+            if constexpr (!std::is_trivially_destructible_v<key_type>) {
+                for (size_t s = first; s < last; ++s)
+                    slotkey[s] = key_type();
+            }
+            if constexpr (!std::is_trivially_destructible_v<leaf_data_type>) {
+                for (size_t s = first; s < last; ++s)
+                    slotval[s] = leaf_data_type();
+            }
+        }
+    };
+
     //! Extended structure of a leaf node in memory. Contains pairs of keys and
-    //! data items. Key and data slots are kept together in value_type.
-    struct LeafNode : public node {
+    //! data items, either together in value_type or in separate arrays, see
+    //! LeafSlots.
+    struct LeafNode : public node, public LeafSlots<split_leaves> {
         //! Define an related allocator for the LeafNode structs.
         using alloc_type = typename Allocator::template rebind<LeafNode>::other;
 
@@ -312,20 +603,12 @@ private:
         //! Double linked list pointers to traverse the leaves
         LeafNode* next_leaf;
 
-        //! Array of (key, data) pairs
-        value_type slotdata[leaf_slotmax]; // NOLINT
-
         //! Set variables to initial values
         void initialize() noexcept {
             node::initialize(0);
             prev_leaf = next_leaf = nullptr;
         }
 
-        //! Return key in slot s.
-        const key_type& key(size_t s) const noexcept {
-            return key_of_value::get(slotdata[s]);
-        }
-
         //! True if the node's slots are full.
         bool is_full() const noexcept {
             return (node::slotuse == leaf_slotmax);
@@ -340,13 +623,6 @@ private:
         bool is_underflow() const noexcept {
             return (node::slotuse < leaf_slotmin);
         }
-
-        //! Set the (key,data) pair in slot. Overloaded function used by
-        //! bulk_load().
-        void set_slot(SlotIndexType slot, const value_type& value) noexcept {
-            TLX_BTREE_ASSERT(slot < node::slotuse);
-            slotdata[slot] = value;
-        }
     };
 
     //! \}
@@ -373,10 +649,10 @@ public:
         using value_type = typename BTree::value_type;
 
         //! Reference to the value_type. STL required.
-        using reference = value_type&;
+        using reference = typename BTree::leaf_reference;
 
         //! Pointer to the value_type. STL required.
-        using pointer = value_type*;
+        using pointer = typename BTree::leaf_pointer;
 
         //! STL-magic iterator category
         using iterator_category = std::bidirectional_iterator_tag;
@@ -434,12 +710,12 @@ public:
 
         //! Dereference the iterator.
         reference operator*() const noexcept {
-            return curr_leaf->slotdata[curr_slot];
+            return curr_leaf->slot(curr_slot);
         }
 
         //! Dereference the iterator.
         pointer operator->() const noexcept {
-            return &curr_leaf->slotdata[curr_slot];
+            return curr_leaf->slot_ptr(curr_slot);
         }
 
         //! Key of the current slot.
@@ -537,10 +813,10 @@ public:
         using value_type = typename BTree::value_type;
 
         //! Reference to the value_type. STL required.
-        using reference = const value_type&;
+        using reference = typename BTree::leaf_const_reference;
 
         //! Pointer to the value_type. STL required.
-        using pointer = const value_type*;
+        using pointer = typename BTree::leaf_const_pointer;
 
         //! STL-magic iterator category
         using iterator_category = std::bidirectional_iterator_tag;
@@ -593,12 +869,12 @@ public:
 
         //! Dereference the iterator.
         reference operator*() const noexcept {
-            return curr_leaf->slotdata[curr_slot];
+            return curr_leaf->slot(curr_slot);
         }
 
         //! Dereference the iterator.
         pointer operator->() const noexcept {
-            return &curr_leaf->slotdata[curr_slot];
+            return curr_leaf->slot_ptr(curr_slot);
         }
 
         //! Key of the current slot.
@@ -700,10 +976,10 @@ public:
         using value_type = typename BTree::value_type;
 
         //! Reference to the value_type. STL required.
-        using reference = value_type&;
+        using reference = typename BTree::leaf_reference;
 
         //! Pointer to the value_type. STL required.
-        using pointer = value_type*;
+        using pointer = typename BTree::leaf_pointer;
 
         //! STL-magic iterator category
         using iterator_category = std::bidirectional_iterator_tag;
@@ -757,13 +1033,13 @@ public:
         //! Dereference the iterator.
         reference operator*() const noexcept {
             TLX_BTREE_ASSERT(curr_slot > 0);
-            return curr_leaf->slotdata[curr_slot - 1];
+            return curr_leaf->slot(curr_slot - 1);
         }
 
         //! Dereference the iterator.
         pointer operator->() const noexcept {
             TLX_BTREE_ASSERT(curr_slot > 0);
-            return &curr_leaf->slotdata[curr_slot - 1];
+            return curr_leaf->slot_ptr(curr_slot - 1);
         }
 
         //! Key of the current slot.
@@ -864,10 +1140,10 @@ public:
         using value_type = typename BTree::value_type;
 
         //! Reference to the value_type. STL required.
-        using reference = const value_type&;
+        using reference = typename BTree::leaf_const_reference;
 
         //! Pointer to the value_type. STL required.
-        using pointer = const value_type*;
+        using pointer = typename BTree::leaf_const_pointer;
 
         //! STL-magic iterator category
         using iterator_category = std::bidirectional_iterator_tag;
@@ -922,13 +1198,13 @@ public:
         //! Dereference the iterator.
         reference operator*() const noexcept {
             TLX_BTREE_ASSERT(curr_slot > 0);
-            return curr_leaf->slotdata[curr_slot - 1];
+            return curr_leaf->slot(curr_slot - 1);
         }
 
         //! Dereference the iterator.
         pointer operator->() const noexcept {
             TLX_BTREE_ASSERT(curr_slot > 0);
-            return &curr_leaf->slotdata[curr_slot - 1];
+            return curr_leaf->slot_ptr(curr_slot - 1);
         }
 
         //! Key of the current slot.
@@ -1219,13 +1495,9 @@ private:
         newroot->childid[1] = newchild;
 
         newroot->slotuse = 1;
-        if (newroot->level > 1) {
-            newroot->subtree_size =
-                static_cast<InnerNode*>(newchild)->subtree_size +
-                static_cast<InnerNode*>(root_)->subtree_size;
-        } else {
-            newroot->subtree_size = newchild->slotuse + root_->slotuse;
-        }
+        newroot->childcount[0] = child_size(root_);
+        newroot->childcount[1] = child_size(newchild);
+        newroot->subtree_size = newroot->childcount[0] + newroot->childcount[1];
 
         TLX_BTREE_PRINT("BTree::new_root: root changed from " << root_ << " to "
                                                               << newroot);
@@ -1235,19 +1507,35 @@ private:
     //! Correctly free either inner or leaf node, destructs all contained key
     //! and value objects.
     void free_node(node* n) noexcept {
+        free_node(n, allocator_);
+    }
+
+    //! Free either inner or leaf node with an allocator rebound from alloc
+    static void free_node(node* n, const allocator_type& alloc) noexcept {
         if (n->is_leafnode()) {
             LeafNode* ln = static_cast<LeafNode*>(n);
-            typename LeafNode::alloc_type a(leaf_node_allocator());
+            typename LeafNode::alloc_type a(alloc);
             a.destroy(ln);
             a.deallocate(ln, 1);
         } else {
             InnerNode* in = static_cast<InnerNode*>(n);
-            typename InnerNode::alloc_type a(inner_node_allocator());
+            typename InnerNode::alloc_type a(alloc);
             a.destroy(in);
             a.deallocate(in, 1);
         }
     }
 
+    //! Free the subtree rooted at n, including n itself
+    static void free_subtree(node* n, const allocator_type& alloc) noexcept {
+        if (!n->is_leafnode()) {
+            InnerNode* inner = static_cast<InnerNode*>(n);
+            for (NumSlotType slot = 0; slot < inner->slotuse + 1; ++slot) {
+                free_subtree(inner->childid[slot], alloc);
+            }
+        }
+        free_node(n, alloc);
+    }
+
     //! \}
 
 public:
@@ -1266,6 +1554,77 @@ public:
         TLX_BTREE_ASSERT(size() == 0);
     }
 
+    //! Subtrees that truncate() cut off a tree. They aren't reachable from the
+    //! tree anymore and are only freed by clear() or the destructor, so that
+    //! freeing them can be deferred or moved off the critical path. A single
+    //! object can collect the subtrees of several truncate() calls.
+    class detached_subtrees {
+    public:
+        detached_subtrees() = default;
+
+        //! Non-copyable: the subtrees are owned by exactly one object
+        detached_subtrees(const detached_subtrees&) = delete;
+        detached_subtrees& operator=(const detached_subtrees&) = delete;
+
+        detached_subtrees(detached_subtrees&& other) noexcept
+            : roots_(std::move(other.roots_)), allocator_(other.allocator_) {
+            other.roots_.clear();
+        }
+
+        detached_subtrees& operator=(detached_subtrees&& other) noexcept {
+            if (this != &other) {
+                clear();
+                roots_.swap(other.roots_);
+                allocator_ = other.allocator_;
+            }
+            return *this;
+        }
+
+        ~detached_subtrees() noexcept {
+            clear();
+        }
+
+        //! Number of subtrees held
+        size_t num_subtrees() const noexcept {
+            return roots_.size();
+        }
+
+        //! True if no subtrees are held
+        bool empty() const noexcept {
+            return roots_.empty();
+        }
+
+        //! Free all subtrees. Keeps the capacity of the list of subtrees, so
+        //! that reusing the object for the next truncate() doesn't allocate.
+        void clear() noexcept {
+            for (node* n : roots_) {
+                free_subtree(n, allocator_);
+            }
+            roots_.clear();
+        }
+
+        //! Take over the subtrees of other, together with the allocator that
+        //! frees them. All subtrees held by one object are freed with the same
+        //! allocator, so if both hold subtrees, the allocators must be equal.
+        void splice(detached_subtrees& other) {
+            if (other.roots_.empty())
+                return;
+            TLX_BTREE_ASSERT(roots_.empty() || allocator_ == other.allocator_);
+            allocator_ = other.allocator_;
+            roots_.insert(roots_.end(), other.roots_.begin(), other.roots_.end());
+            other.roots_.clear();
+        }
+
+    private:
+        friend class BTree;
+
+        //! Roots of the detached subtrees
+        std::vector<node*> roots_;
+
+        //! Allocator of the tree the subtrees were cut from
+        allocator_type allocator_;
+    };
+
 private:
     //! Recursively free up nodes.
     void clear_recursive(node* n) noexcept {
@@ -1345,6 +1704,18 @@ private:
     //! \name B+ Tree Node Binary Search Functions
     //! \{
 
+    //! True if key_compare orders keys like operator<
+    static constexpr bool key_compare_is_less =
+        std::is_same_v<key_compare, std::less<key_type>> ||
+        std::is_same_v<key_compare, std::less<>>;
+
+    //! True if the keys of node_type can be searched with simd_count_less()
+    template <typename node_type>
+    static constexpr bool use_simd_search =
+        traits::simd_search && simd_search_supported &&
+        std::is_same_v<key_type, double> && key_compare_is_less &&
+        node_type::contiguous_keys;
+
     //! Searches for the first key in the node n greater or equal to key. Uses
     //! binary search with an optional linear self-verification. This is a
     //! template function, because the slotkey array is located at different
@@ -1352,7 +1723,9 @@ private:
     template <typename node_type>
     SlotIndexType find_lower(const node_type* n, const key_type& key) const
         noexcept {
-        if constexpr (sizeof(*n) > traits::binsearch_threshold) {
+        if constexpr (use_simd_search<node_type>) {
+            return simd_count_less<false>(n->keys(), n->slotuse, key);
+        } else if constexpr (sizeof(*n) > traits::binsearch_threshold) {
             if (n->slotuse == 0)
                 return 0;
 
@@ -1398,7 +1771,9 @@ private:
     template <typename node_type>
     SlotIndexType find_upper(const node_type* n, const key_type& key) const
         noexcept {
-        if (sizeof(*n) > traits::binsearch_threshold) {
+        if constexpr (use_simd_search<node_type>) {
+            return simd_count_less<true>(n->keys(), n->slotuse, key);
+        } else if constexpr (sizeof(*n) > traits::binsearch_threshold) {
             if (n->slotuse == 0)
                 return 0;
 
@@ -1771,8 +2146,7 @@ private:
             LeafNode* newleaf = allocate_leaf();
 
             newleaf->slotuse = leaf->slotuse;
-            std::copy(leaf->slotdata, leaf->slotdata + leaf->slotuse,
-                      newleaf->slotdata);
+            leaf->copy_slots(0, leaf->slotuse, *newleaf, 0);
 
             if (head_leaf_ == nullptr) {
                 head_leaf_ = tail_leaf_ = newleaf;
@@ -1792,6 +2166,8 @@ private:
             newinner->slotuse = inner->slotuse;
             std::copy(inner->slotkey, inner->slotkey + inner->slotuse,
                       newinner->slotkey);
+            std::copy(inner->childcount, inner->childcount + inner->slotuse + 1,
+                      newinner->childcount);
 
             for (NumSlotType slot = 0; slot <= inner->slotuse; ++slot) {
                 newinner->childid[slot] = copy_recursive(inner->childid[slot]);
@@ -1804,29 +2180,36 @@ private:
     //! \}
 
 private:
+    //! Number of elements in the subtree of node n
+    static size_type child_size(const node* n) noexcept {
+        if (n->is_leafnode())
+            return n->slotuse;
+        return static_cast<const InnerNode*>(n)->subtree_size;
+    }
+
+    //! Recompute the child counts and the subtree size of inner from its
+    //! children. Only needed after structural changes, insertions and
+    //! deletions update the counts along their path.
+    static void update_childcount(InnerNode* inner) noexcept {
+        update_childcount(inner, 0, inner->slotuse + 1);
+        inner->subtree_size = sum_subtree_size(inner);
+    }
+
+    //! Recompute the child counts of inner with index between begin and end
+    static void update_childcount(InnerNode* inner, SlotIndexType begin,
+                                  SlotIndexType end) noexcept {
+        for (SlotIndexType i = begin; i < end; i++) {
+            inner->childcount[i] = child_size(inner->childid[i]);
+        }
+    }
+
     //! Compute the sum of the subtree sizes of children of inner with index
     //! between begin and end
-    // vectorisation disabled because g++ miscompiles this for avx-512 :(
-#if defined(__GNUC__) && !defined(__clang__)
-    __attribute__((optimize("no-tree-vectorize")))
-#endif
     static size_type sum_subtree_size(const InnerNode* inner, SlotIndexType begin,
                                       SlotIndexType end) noexcept {
         size_type result = 0;
-        if (inner->level == 1) {
-            for (SlotIndexType i = begin; i < end; i++) {
-                node* n = inner->childid[i];
-                TLX_BTREE_ASSERT(n->is_leafnode());
-                result += n->slotuse;
-            }
-        } else {
-            for (SlotIndexType i = begin; i < end; i++) {
-                const node* n = inner->childid[i];
-                TLX_BTREE_ASSERT(!n->is_leafnode());
-                // enabling this check causes the miscompilation to go away
-                // tlx_die_unless(!n->is_leafnode());
-                result += reinterpret_cast<const InnerNode*>(n)->subtree_size;
-            }
+        for (SlotIndexType i = begin; i < end; i++) {
+            result += inner->childcount[i];
         }
         return result;
     }
@@ -1860,6 +2243,12 @@ public:
         return insert_start(key_of_value::get(x), x);
     }
 
+    //! Attempt to insert a key/data pair into the B+ tree, moving it into its
+    //! slot. If the pair is not inserted, it is left unchanged.
+    std::pair<iterator, bool> insert(value_type&& x) noexcept {
+        return insert_start(key_of_value::get(x), std::move(x));
+    }
+
     //! Attempt to insert a key/data pair into the B+ tree. The iterator hint is
     //! currently ignored by the B+ tree insertion routine.
     iterator insert(iterator /* hint */, const value_type& x) noexcept {
@@ -1885,9 +2274,11 @@ private:
     //! \{
 
     //! Start the insertion descent at the current root and handle root splits.
-    //! Returns true if the item was inserted
+    //! Returns true if the item was inserted. key may refer to value, so it
+    //! must not be used once value has been moved into its slot.
+    template <typename ValueType>
     std::pair<iterator, bool> insert_start(const key_type& key,
-                                           const value_type& value) noexcept {
+                                           ValueType&& value) noexcept {
         node* newchild = nullptr;
         key_type newkey = key_type();
 
@@ -1896,7 +2287,8 @@ private:
         }
 
         std::pair<iterator, bool> r =
-            insert_descend(root_, key, value, &newkey, &newchild);
+            insert_descend(root_, key, std::forward<ValueType>(value),
+                           &newkey, &newchild);
 
         // insert_descend was called with root_ as first argument, so there is no point in testing of root_ is full now
         if (newchild) {
@@ -1910,7 +2302,7 @@ private:
 
         if (self_verify) {
             verify();
-            TLX_BTREE_ASSERT(exists(key));
+            TLX_BTREE_ASSERT(exists(r.first.key()));
         }
 
         return r;
@@ -1923,8 +2315,9 @@ private:
      * slot. If the node overflows, then it must be split and the new split node
      * inserted into the parent. Unroll / this splitting up to the root.
      */
+    template <typename ValueType>
     std::pair<iterator, bool> insert_descend(node* n, const key_type& key,
-                                             const value_type& value,
+                                             ValueType&& value,
                                              key_type* splitkey,
                                              node** splitnode) noexcept {
         if (!n->is_leafnode()) {
@@ -1938,18 +2331,19 @@ private:
             TLX_BTREE_PRINT("BTree::insert_descend into " << inner->childid[slot]);
 
             std::pair<iterator, bool> r = insert_descend(
-                inner->childid[slot], key, value, &newkey, &newchild);
+                inner->childid[slot], key, std::forward<ValueType>(value),
+                &newkey, &newchild);
+            // the child was just visited, so this doesn't cause a cache miss
+            inner->childcount[slot] = child_size(inner->childid[slot]);
 
             if (newchild) {
                 TLX_BTREE_PRINT("BTree::insert_descend newchild"
                                 << " with key " << newkey << " node "
                                 << newchild << " at slot " << slot);
 
+                size_type new_subtree_size = child_size(newchild);
+
                 if (inner->is_full()) {
-                    size_type new_subtree_size =
-                        newchild->is_leafnode()
-                            ? newchild->slotuse
-                            : static_cast<InnerNode*>(newchild)->subtree_size;
 
                     split_inner_node(inner, splitkey, splitnode, slot);
 
@@ -1980,10 +2374,7 @@ private:
                         InnerNode* split = static_cast<InnerNode*>(*splitnode);
 
                         node* moved = split->childid[0];
-                        size_type moved_subtreesize =
-                            moved->is_leafnode()
-                                ? moved->slotuse
-                                : static_cast<InnerNode*>(moved)->subtree_size;
+                        size_type moved_subtreesize = split->childcount[0];
 
                         TLX_BTREE_PRINT(
                             "BTree::insert_descend: special case! moved: "
@@ -1992,6 +2383,8 @@ private:
                         // move the split key and it's datum into the left node
                         inner->slotkey[inner->slotuse] = *splitkey;
                         inner->childid[inner->slotuse + 1] = moved;
+                        inner->childcount[inner->slotuse + 1] =
+                            moved_subtreesize;
                         inner->slotuse++;
 
                         inner->subtree_size += moved_subtreesize;
@@ -2000,6 +2393,7 @@ private:
                         // set new split key and move corresponding datum into
                         // right node
                         split->childid[0] = newchild;
+                        split->childcount[0] = new_subtree_size;
                         *splitkey = newkey;
 
                         return r;
@@ -2028,9 +2422,13 @@ private:
                 std::copy_backward(inner->childid + slot,
                                    inner->childid + inner->slotuse + 1,
                                    inner->childid + inner->slotuse + 2);
+                std::copy_backward(inner->childcount + slot,
+                                   inner->childcount + inner->slotuse + 1,
+                                   inner->childcount + inner->slotuse + 2);
 
                 inner->slotkey[slot] = newkey;
                 inner->childid[slot + 1] = newchild;
+                inner->childcount[slot + 1] = new_subtree_size;
                 inner->slotuse++;
             } // newchild
             if (r.second) {
@@ -2061,17 +2459,16 @@ private:
             // move items and put data item into correct data slot
             TLX_BTREE_ASSERT(slot >= 0 && slot <= leaf->slotuse);
 
-            std::copy_backward(leaf->slotdata + slot,
-                               leaf->slotdata + leaf->slotuse,
-                               leaf->slotdata + leaf->slotuse + 1);
+            leaf->move_slots_backward(slot, leaf->slotuse, *leaf,
+                                      leaf->slotuse + 1);
 
-            leaf->slotdata[slot] = value;
+            leaf->set_slot(slot, std::forward<ValueType>(value));
             leaf->slotuse++;
 
             if (splitnode && leaf != *splitnode && slot == leaf->slotuse - 1) {
                 // special case: the node was split, and the insert is at the
                 // last slot of the old node. then the splitkey must be updated.
-                *splitkey = key;
+                *splitkey = leaf->key(slot);
             }
 
             return std::pair<iterator, bool>(iterator(leaf, slot), true);
@@ -2100,8 +2497,7 @@ private:
             newleaf->next_leaf->prev_leaf = newleaf;
         }
 
-        std::copy(leaf->slotdata + mid, leaf->slotdata + leaf->slotuse,
-                  newleaf->slotdata);
+        leaf->move_slots(mid, leaf->slotuse, *newleaf, 0);
 
         leaf->slotuse = NumSlotType(mid);
         leaf->next_leaf = newleaf;
@@ -2144,6 +2540,8 @@ private:
                   newinner->slotkey);
         std::copy(inner->childid + mid + 1, inner->childid + inner->slotuse + 1,
                   newinner->childid);
+        std::copy(inner->childcount + mid + 1,
+                  inner->childcount + inner->slotuse + 1, newinner->childcount);
 
         inner->slotuse = NumSlotType(mid);
         newinner->subtree_size = sum_subtree_size(newinner);
@@ -2240,10 +2638,12 @@ public:
             for (NumSlotType s = 0; s < n->slotuse; ++s) {
                 n->slotkey[s] = leaf->key(leaf->slotuse - 1);
                 n->childid[s] = leaf;
+                n->childcount[s] = leaf->slotuse;
                 n->subtree_size += leaf->slotuse;
                 leaf = leaf->next_leaf;
             }
             n->childid[n->slotuse] = leaf;
+            n->childcount[n->slotuse] = leaf->slotuse;
             n->subtree_size += leaf->slotuse;
 
             // track max key of any descendant.
@@ -2284,11 +2684,15 @@ public:
                 for (NumSlotType s = 0; s < n->slotuse; ++s) {
                     n->slotkey[s] = *nextlevel[inner_index].second;
                     n->childid[s] = nextlevel[inner_index].first;
-                    n->subtree_size += nextlevel[inner_index].first->subtree_size;
+                    n->childcount[s] =
+                        nextlevel[inner_index].first->subtree_size;
+                    n->subtree_size += n->childcount[s];
                     ++inner_index;
                 }
                 n->childid[n->slotuse] = nextlevel[inner_index].first;
-                n->subtree_size += nextlevel[inner_index].first->subtree_size;
+                n->childcount[n->slotuse] =
+                    nextlevel[inner_index].first->subtree_size;
+                n->subtree_size += n->childcount[n->slotuse];
 
                 // reuse nextlevel array for parents, because we can overwrite
                 // slots we've already consumed.
@@ -2309,6 +2713,272 @@ public:
             verify();
     }
 
+    //! Bulk load a sorted random-access range like bulk_load(), but with
+    //! num_threads threads: the leaves are filled in parallel chunks, and
+    //! every level of inner nodes is built in parallel from the level below.
+    //! The allocator must be safe to use from several threads. The tree must
+    //! be empty when calling this function.
+    template <typename Iterator>
+    void bulk_load_parallel(Iterator ibegin, Iterator iend,
+                            size_t num_threads) {
+        TLX_BTREE_ASSERT(empty());
+        TLX_BTREE_ASSERT(iend - ibegin >= 0);
+
+        bulk_build_parallel(
+            static_cast<size_t>(iend - ibegin), num_threads,
+            [&](LeafNode** leaf, LeafNode** leaf_end, size_t item_begin,
+                size_t /* item_end */) {
+                Iterator it = ibegin + item_begin;
+                for (; leaf != leaf_end; ++leaf) {
+                    for (SlotIndexType s = 0; s < (*leaf)->slotuse; ++s, ++it)
+                        (*leaf)->set_slot(s, *it);
+                }
+            });
+    }
+
+    //! Bulk load the merge of k sorted runs, given as pairs of random-access
+    //! iterators, with num_threads threads. The output is split into one part
+    //! per thread by a multiway selection in the runs, and every thread
+    //! merges its parts of the runs directly into its leaves. Equal keys from
+    //! different runs are ordered by the index of their run. The tree must be
+    //! empty when calling this function.
+    template <typename Iterator>
+    void bulk_load_runs(const std::vector<std::pair<Iterator, Iterator> >& runs,
+                        size_t num_threads) {
+        TLX_BTREE_ASSERT(empty());
+
+        size_t num_items = 0;
+        for (const auto& run : runs) {
+            TLX_BTREE_ASSERT(run.second - run.first >= 0);
+            num_items += static_cast<size_t>(run.second - run.first);
+        }
+
+        bulk_build_parallel(
+            num_items, num_threads,
+            [&](LeafNode** leaf, LeafNode** leaf_end, size_t item_begin,
+                size_t item_end) {
+                std::vector<size_t> begin_pos, end_pos;
+                multiway_split(runs, item_begin, begin_pos);
+                multiway_split(runs, item_end, end_pos);
+
+                // heap of the current heads of the non-empty runs, the
+                // smallest key (and run index among equal keys) at the front
+                using head_type = std::pair<Iterator, size_t>;
+                std::vector<head_type> heap;
+                for (size_t r = 0; r < runs.size(); ++r) {
+                    if (begin_pos[r] < end_pos[r]) {
+                        heap.emplace_back(runs[r].first + begin_pos[r], r);
+                    }
+                }
+                auto greater = [&](const head_type& a, const head_type& b) {
+                    const key_type& ka = key_of_value::get(*a.first);
+                    const key_type& kb = key_of_value::get(*b.first);
+                    return key_less(kb, ka) ||
+                           (!key_less(ka, kb) && a.second > b.second);
+                };
+                std::make_heap(heap.begin(), heap.end(), greater);
+
+                for (; leaf != leaf_end; ++leaf) {
+                    for (SlotIndexType s = 0; s < (*leaf)->slotuse; ++s) {
+                        TLX_BTREE_ASSERT(!heap.empty());
+                        std::pop_heap(heap.begin(), heap.end(), greater);
+                        head_type& head = heap.back();
+                        (*leaf)->set_slot(s, *head.first);
+                        if (++head.first ==
+                            runs[head.second].first +
+                                static_cast<std::ptrdiff_t>(
+                                    end_pos[head.second])) {
+                            heap.pop_back();
+                        } else {
+                            std::push_heap(heap.begin(), heap.end(), greater);
+                        }
+                    }
+                }
+                TLX_BTREE_ASSERT(heap.empty());
+            });
+    }
+
+private:
+    //! Call f(begin, end) for a partition of [0, n) into num_threads ranges,
+    //! each on its own thread. The calling thread takes the first range. The
+    //! thread body is noexcept like the rest of the tree, which keeps
+    //! std::thread from evaluating noexcept on f.
+    template <typename Function>
+    static void parallel_for(size_t n, size_t num_threads, Function&& f) {
+        num_threads = std::max<size_t>(1, std::min(num_threads, n));
+        std::vector<std::thread> threads;
+        threads.reserve(num_threads - 1);
+        for (size_t t = 1; t < num_threads; ++t) {
+            const size_t begin = t * n / num_threads,
+                         end = (t + 1) * n / num_threads;
+            threads.emplace_back(
+                [&f, begin, end]() noexcept { f(begin, end); });
+        }
+        if (n > 0) {
+            f(0, n / num_threads);
+        }
+        for (std::thread& thread : threads) {
+            thread.join();
+        }
+    }
+
+    //! Build the tree for num_items items in parallel. The leaves are
+    //! allocated and their sizes set on num_threads threads, then every
+    //! thread calls fill(leaf, leaf_end, item_begin, item_end) to fill its
+    //! contiguous range of leaves with the items of ranks [item_begin,
+    //! item_end). The levels of inner nodes are built bottom-up, each one in
+    //! parallel. Items are distributed evenly among the leaves and children
+    //! evenly among the inner nodes, so all nodes are at least half full.
+    template <typename Fill>
+    void bulk_build_parallel(size_t num_items, size_t num_threads,
+                             Fill&& fill) {
+        if (num_items == 0) {
+            return;
+        }
+        const size_t num_leaves =
+            (num_items + leaf_slotmax - 1) / leaf_slotmax;
+        // rank of the first item of leaf i
+        auto leaf_begin = [num_items, num_leaves](size_t i) {
+            return i * num_items / num_leaves;
+        };
+
+        TLX_BTREE_PRINT("BTree::bulk_build_parallel, level 0: "
+                        << num_items << " items into " << num_leaves
+                        << " leaves on " << num_threads << " threads");
+
+        std::vector<LeafNode*> leaves(num_leaves);
+        parallel_for(num_leaves, num_threads, [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; ++i) {
+                leaves[i] = allocate_leaf();
+                leaves[i]->slotuse =
+                    static_cast<NumSlotType>(leaf_begin(i + 1) - leaf_begin(i));
+            }
+            fill(leaves.data() + begin, leaves.data() + end, leaf_begin(begin),
+                 leaf_begin(end));
+        });
+
+        // link the leaves and collect them with their maximum keys as the
+        // children of the first inner level
+        using child_type = std::pair<node*, const key_type*>;
+        std::vector<child_type> children(num_leaves);
+        parallel_for(num_leaves, num_threads, [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; ++i) {
+                LeafNode* leaf = leaves[i];
+                leaf->prev_leaf = (i > 0) ? leaves[i - 1] : nullptr;
+                leaf->next_leaf =
+                    (i + 1 < num_leaves) ? leaves[i + 1] : nullptr;
+                children[i] = child_type(leaf, &leaf->key(leaf->slotuse - 1));
+            }
+        });
+        head_leaf_ = leaves.front();
+        tail_leaf_ = leaves.back();
+
+        std::vector<child_type> parents;
+        for (LevelType level = 1; children.size() > 1; ++level) {
+            const size_t num_children = children.size();
+            const size_t num_parents =
+                (num_children + inner_slotmax) / (inner_slotmax + 1);
+
+            TLX_BTREE_PRINT("BTree::bulk_build_parallel, level "
+                            << level << ": " << num_children << " children in "
+                            << num_parents << " inner nodes");
+
+            parents.resize(num_parents);
+            parallel_for(
+                num_parents, num_threads, [&](size_t begin, size_t end) {
+                    for (size_t i = begin; i < end; ++i) {
+                        const size_t first = i * num_children / num_parents,
+                                     last = (i + 1) * num_children / num_parents;
+                        InnerNode* n = allocate_inner(level);
+                        n->slotuse = static_cast<NumSlotType>(last - first - 1);
+                        n->subtree_size = 0;
+                        for (size_t c = first; c < last; ++c) {
+                            const SlotIndexType s =
+                                static_cast<SlotIndexType>(c - first);
+                            if (c + 1 < last)
+                                n->slotkey[s] = *children[c].second;
+                            n->childid[s] = children[c].first;
+                            n->childcount[s] = child_size(children[c].first);
+                            n->subtree_size += n->childcount[s];
+                        }
+                        parents[i] = child_type(n, children[last - 1].second);
+                    }
+                });
+            children.swap(parents);
+        }
+        root_ = children.front().first;
+
+        if (self_verify)
+            verify();
+    }
+
+    //! Compute the positions in the sorted runs that split their merge at
+    //! the given rank, i.e., the elements before the positions are the rank
+    //! smallest ones, with equal keys ordered by run index. The element of
+    //! that rank is found by binary search in each run, the rank of an
+    //! element being its position plus the number of elements in the other
+    //! runs that precede it.
+    template <typename Iterator>
+    void multiway_split(const std::vector<std::pair<Iterator, Iterator> >& runs,
+                        size_t rank, std::vector<size_t>& pos) const {
+        const size_t k = runs.size();
+        pos.resize(k);
+        // position in run i of the first element after key from run j
+        auto bound = [&](size_t i, size_t j, const key_type& key) {
+            const Iterator begin = runs[i].first, end = runs[i].second;
+            if (i < j) {
+                return static_cast<size_t>(
+                    std::upper_bound(begin, end, key,
+                                     [&](const key_type& a,
+                                         const value_type& b) {
+                                         return key_less(
+                                             a, key_of_value::get(b));
+                                     }) -
+                    begin);
+            }
+            return static_cast<size_t>(
+                std::lower_bound(begin, end, key,
+                                 [&](const value_type& a, const key_type& b) {
+                                     return key_less(key_of_value::get(a), b);
+                                 }) -
+                begin);
+        };
+        auto global_rank = [&](size_t j, size_t q, const key_type& key) {
+            size_t r = q;
+            for (size_t i = 0; i < k; ++i) {
+                if (i != j)
+                    r += bound(i, j, key);
+            }
+            return r;
+        };
+
+        for (size_t j = 0; j < k; ++j) {
+            size_t lo = 0,
+                   hi = static_cast<size_t>(runs[j].second - runs[j].first);
+            while (lo < hi) {
+                const size_t mid = lo + (hi - lo) / 2;
+                const key_type& key = key_of_value::get(
+                    *(runs[j].first + static_cast<std::ptrdiff_t>(mid)));
+                const size_t r = global_rank(j, mid, key);
+                if (r == rank) {
+                    for (size_t i = 0; i < k; ++i)
+                        pos[i] = (i == j) ? mid : bound(i, j, key);
+                    return;
+                }
+                if (r < rank)
+                    lo = mid + 1;
+                else
+                    hi = mid;
+            }
+        }
+
+        // no element has this rank, so it's the total number of elements
+        for (size_t i = 0; i < k; ++i)
+            pos[i] = static_cast<size_t>(runs[i].second - runs[i].first);
+    }
+
+public:
+
     //! \}
 
 private:
@@ -2475,8 +3145,7 @@ private:
 
             TLX_BTREE_PRINT("Found key in leaf " << curr << " at slot " << slot);
 
-            std::copy(leaf->slotdata + slot + 1, leaf->slotdata + leaf->slotuse,
-                      leaf->slotdata + slot);
+            leaf->move_slots(slot + 1, leaf->slotuse, *leaf, slot);
 
             leaf->slotuse--;
 
@@ -2612,6 +3281,10 @@ private:
             }
 
             inner->subtree_size--;
+            // the child and the siblings it may have been balanced with
+            update_childcount(inner, slot > 0 ? slot - 1 : 0,
+                              std::min<SlotIndexType>(slot + 2,
+                                                      inner->slotuse + 1));
 
             if (result.has(btree_update_lastkey)) {
                 if (parent && parentslot < parent->slotuse) {
@@ -2644,6 +3317,9 @@ private:
                 std::copy(inner->childid + slot + 1,
                           inner->childid + inner->slotuse + 1,
                           inner->childid + slot);
+                std::copy(inner->childcount + slot + 1,
+                          inner->childcount + inner->slotuse + 1,
+                          inner->childcount + slot);
 
                 inner->slotuse--;
 
@@ -2768,8 +3444,7 @@ private:
             TLX_BTREE_PRINT("Found iterator in leaf " << curr << " at slot "
                                                       << slot);
 
-            std::copy(leaf->slotdata + slot + 1, leaf->slotdata + leaf->slotuse,
-                      leaf->slotdata + slot);
+            leaf->move_slots(slot + 1, leaf->slotuse, *leaf, slot);
 
             leaf->slotuse--;
 
@@ -2924,6 +3599,10 @@ private:
                 return btree_not_found;
 
             inner->subtree_size--;
+            // the child and the siblings it may have been balanced with
+            update_childcount(inner, slot > 0 ? slot - 1 : 0,
+                              std::min<SlotIndexType>(slot + 2,
+                                                      inner->slotuse + 1));
 
             result_t myres = btree_ok;
 
@@ -2958,6 +3637,9 @@ private:
                 std::copy(inner->childid + slot + 1,
                           inner->childid + inner->slotuse + 1,
                           inner->childid + slot);
+                std::copy(inner->childcount + slot + 1,
+                          inner->childcount + inner->slotuse + 1,
+                          inner->childcount + slot);
 
                 inner->slotuse--;
 
@@ -3060,8 +3742,7 @@ private:
 
         TLX_BTREE_ASSERT(left->slotuse + right->slotuse < leaf_slotmax);
 
-        std::copy(right->slotdata, right->slotdata + right->slotuse,
-                  left->slotdata + left->slotuse);
+        right->move_slots(0, right->slotuse, *left, left->slotuse);
 
         left->slotuse = NumSlotType(left->slotuse + right->slotuse);
 
@@ -3115,6 +3796,8 @@ private:
                   left->slotkey + left->slotuse);
         std::copy(right->childid, right->childid + right->slotuse + 1,
                   left->childid + left->slotuse);
+        std::copy(right->childcount, right->childcount + right->slotuse + 1,
+                  left->childcount + left->slotuse);
 
         left->slotuse = NumSlotType(left->slotuse + right->slotuse);
         right->slotuse = 0;
@@ -3151,15 +3834,13 @@ private:
         // copy the first items from the right node to the last slot in the left
         // node.
 
-        std::copy(right->slotdata, right->slotdata + shiftnum,
-                  left->slotdata + left->slotuse);
+        right->move_slots(0, shiftnum, *left, left->slotuse);
 
         left->slotuse = NumSlotType(left->slotuse + shiftnum);
 
         // shift all slots in the right node to the left
 
-        std::copy(right->slotdata + shiftnum, right->slotdata + right->slotuse,
-                  right->slotdata);
+        right->move_slots(shiftnum, right->slotuse, *right, 0);
 
         right->slotuse = NumSlotType(right->slotuse - shiftnum);
 
@@ -3220,6 +3901,8 @@ private:
                   left->slotkey + left->slotuse);
         std::copy(right->childid, right->childid + shiftnum,
                   left->childid + left->slotuse);
+        std::copy(right->childcount, right->childcount + shiftnum,
+                  left->childcount + left->slotuse);
 
         left->slotuse = NumSlotType(left->slotuse + shiftnum - 1);
 
@@ -3231,6 +3914,8 @@ private:
                   right->slotkey);
         std::copy(right->childid + shiftnum,
                   right->childid + right->slotuse + 1, right->childid);
+        std::copy(right->childcount + shiftnum,
+                  right->childcount + right->slotuse + 1, right->childcount);
 
         right->slotuse = NumSlotType(right->slotuse - shiftnum);
     }
@@ -3272,15 +3957,14 @@ private:
 
         TLX_BTREE_ASSERT(right->slotuse + shiftnum < leaf_slotmax);
 
-        std::copy_backward(right->slotdata, right->slotdata + right->slotuse,
-                           right->slotdata + right->slotuse + shiftnum);
+        right->move_slots_backward(0, right->slotuse, *right,
+                                   right->slotuse + shiftnum);
 
         right->slotuse = NumSlotType(right->slotuse + shiftnum);
 
         // copy the last items from the left node to the first slot in the right
         // node.
-        std::copy(left->slotdata + left->slotuse - shiftnum,
-                  left->slotdata + left->slotuse, right->slotdata);
+        left->move_slots(left->slotuse - shiftnum, left->slotuse, *right, 0);
 
         left->slotuse = NumSlotType(left->slotuse - shiftnum);
 
@@ -3328,6 +4012,9 @@ private:
                            right->slotkey + right->slotuse + shiftnum);
         std::copy_backward(right->childid, right->childid + right->slotuse + 1,
                            right->childid + right->slotuse + 1 + shiftnum);
+        std::copy_backward(right->childcount,
+                           right->childcount + right->slotuse + 1,
+                           right->childcount + right->slotuse + 1 + shiftnum);
 
         right->slotuse = NumSlotType(right->slotuse + shiftnum);
 
@@ -3341,6 +4028,8 @@ private:
                   left->slotkey + left->slotuse, right->slotkey);
         std::copy(left->childid + left->slotuse - shiftnum + 1,
                   left->childid + left->slotuse + 1, right->childid);
+        std::copy(left->childcount + left->slotuse - shiftnum + 1,
+                  left->childcount + left->slotuse + 1, right->childcount);
 
         // copy the first to-be-removed key from the left node to the parent's
         // decision slot
@@ -3413,7 +4102,7 @@ public:
             return;
         }
         --iter; // split() inserts the split iterator into the left tree
-        split(left, key_of_value::get(*iter), right);
+        split(left, iter.key(), right);
         TLX_BTREE_PRINT("split tree of size "
                         << (left.size() + right.size()) << " at " << k
                         << " into trees of size " << left.size() << " and "
@@ -3426,9 +4115,18 @@ public:
                 iterator moved{std::prev(left.end())};
 
                 TLX_BTREE_ASSERT(right.empty() ||
-                                 !key_less(key_of_value::get(*right.begin()),
-                                           key_of_value::get(*moved)));
-                right.insert(*moved);
+                                 !key_less(right.begin().key(), moved.key()));
+                if constexpr (split_leaves) {
+                    // moving only the data leaves the key intact
+                    right.insert(
+                        value_type(moved.key(), std::move(moved->second)));
+                } else if constexpr (std::is_trivially_copyable_v<key_type>) {
+                    // erase() needs the key to find the slot, which moving
+                    // a trivially copyable key leaves intact
+                    right.insert(std::move(*moved));
+                } else {
+                    right.insert(*moved);
+                }
                 left.erase(moved);
                 // TODO: If left.size()-k is too big, use split again (can
                 // find iter by looping over nodes)
@@ -3437,6 +4135,205 @@ public:
         TLX_BTREE_ASSERT(left.size() == k);
     }
 
+    //! Keep only the k smallest elements. Unlike splitAt(), this cuts the
+    //! right spine of the tree in place and doesn't build a tree from the
+    //! removed elements: the subtrees to the right of the spine are moved to
+    //! detached, and only the spine is rebalanced. Complexity O(log n) plus
+    //! destructing the removed elements of the last remaining leaf.
+    void truncate(size_type k, detached_subtrees& detached) noexcept {
+        TLX_BTREE_ASSERT(detached.empty() || detached.allocator_ == allocator_);
+        detached.allocator_ = allocator_;
+        if (k >= size()) {
+            return;
+        }
+        if (k == 0) {
+            detached.roots_.push_back(root_);
+            root_ = nullptr;
+            head_leaf_ = tail_leaf_ = nullptr;
+            return;
+        }
+
+        // cut the spine top-down: every node keeps the children up to the one
+        // containing the element of rank k-1. The path holds the inner nodes
+        // of the spine, which are each the last child of their predecessor.
+        // Inner nodes have at least two children, except for the root after
+        // truncating, so the height is bounded by the bits of size_type.
+        truncate_path_type path;
+        size_t depth = 0;
+        node* n = root_;
+        size_type rank = k;
+        while (!n->is_leafnode()) {
+            InnerNode* inner = static_cast<InnerNode*>(n);
+            SlotIndexType slot = 0;
+            size_type before = 0;
+            while (before + inner->childcount[slot] < rank) {
+                before += inner->childcount[slot];
+                ++slot;
+            }
+            for (SlotIndexType i = slot + 1; i <= inner->slotuse; ++i) {
+                detached.roots_.push_back(inner->childid[i]);
+            }
+            inner->slotuse = slot;
+            rank -= before;
+            inner->childcount[slot] = rank;
+            inner->subtree_size = before + rank;
+            path[depth++] = inner;
+            n = inner->childid[slot];
+        }
+
+        LeafNode* leaf = static_cast<LeafNode*>(n);
+        TLX_BTREE_ASSERT(rank > 0 && rank <= leaf->slotuse);
+        leaf->reset_slots(rank, leaf->slotuse);
+        leaf->slotuse = static_cast<NumSlotType>(rank);
+        leaf->next_leaf = nullptr;
+        tail_leaf_ = leaf;
+
+        truncate_rebalance(path, depth);
+        TLX_BTREE_ASSERT(size() == k);
+        if (self_verify) {
+            verify();
+        }
+    }
+
+    //! Keep only the k smallest elements, see truncate(k, detached). The
+    //! removed elements are freed when the result is destroyed.
+    detached_subtrees truncate(size_type k) noexcept {
+        detached_subtrees detached;
+        truncate(k, detached);
+        return detached;
+    }
+
+    //! Erase all elements with keys in [lo, hi) and return their number. The
+    //! tree is split at the first element not less than hi, the left part is
+    //! truncated, moving whole subtrees to detached, and the parts are joined
+    //! again. Complexity O(log n) plus the elements equal to hi and the
+    //! removed elements of the boundary leaf.
+    size_type erase_range(const key_type& lo, const key_type& hi,
+                          detached_subtrees& detached) noexcept {
+        detached.allocator_ = allocator_;
+        if (!root_ || !key_less(lo, hi)) {
+            return 0;
+        }
+        const size_type first = count_less(root_, lo),
+                        last = count_less(root_, hi);
+        if (first == last) {
+            return 0;
+        }
+        if (last == size()) {
+            truncate(first, detached);
+        } else {
+            BTree left, right;
+            splitAt(left, last, right);
+            left.truncate(first, detached);
+            left.join(right);
+            swap(left);
+        }
+        if (self_verify) {
+            verify();
+        }
+        return last - first;
+    }
+
+    //! Erase all elements with keys in [lo, hi), see erase_range(lo, hi,
+    //! detached), and free them right away
+    size_type erase_range(const key_type& lo, const key_type& hi) noexcept {
+        detached_subtrees detached;
+        return erase_range(lo, hi, detached);
+    }
+
+    //! Erase all elements with keys not less than key by truncating the tree,
+    //! see truncate(k, detached). Returns the number of erased elements.
+    size_type erase_from(const key_type& key,
+                         detached_subtrees& detached) noexcept {
+        if (!root_) {
+            return 0;
+        }
+        const size_type old_size = size();
+        truncate(count_less(root_, key), detached);
+        return old_size - size();
+    }
+
+    size_type erase_from(const key_type& key) noexcept {
+        detached_subtrees detached;
+        return erase_from(key, detached);
+    }
+
+private:
+    //! Inner nodes on the right spine, from the root downwards
+    using truncate_path_type = std::array<InnerNode*, 8 * sizeof(size_type)>;
+
+    //! Fix the underflowing nodes on the right spine after truncate(). A spine
+    //! node is merged with its left sibling or takes slots from it. Because an
+    //! inner node may have been cut down to a single child, whose underflow
+    //! couldn't be fixed in it, every fix continues with the last child of
+    //! the fixed node, and merges continue with the parent.
+    void truncate_rebalance(truncate_path_type& path, size_t height) noexcept {
+        size_t depth = height;
+        while (depth > 0) {
+            InnerNode* parent = path[depth - 1];
+            NumSlotType slot = parent->slotuse;
+            node* child = parent->childid[slot];
+
+            bool underflow =
+                child->is_leafnode()
+                    ? static_cast<LeafNode*>(child)->is_underflow()
+                    : static_cast<InnerNode*>(child)->is_underflow();
+            if (!underflow || slot == 0) {
+                // fine, or can only be fixed once parent got a left sibling
+                --depth;
+                continue;
+            }
+
+            node* left = parent->childid[slot - 1];
+            bool merged = false;
+            if (child->is_leafnode()) {
+                LeafNode* lleaf = static_cast<LeafNode*>(left);
+                LeafNode* cleaf = static_cast<LeafNode*>(child);
+                if (lleaf->slotuse + cleaf->slotuse < leaf_slotmax) {
+                    merge_leaves(lleaf, cleaf, parent);
+                    merged = true;
+                } else {
+                    shift_right_leaf(lleaf, cleaf, parent, slot - 1);
+                }
+            } else {
+                InnerNode* linner = static_cast<InnerNode*>(left);
+                InnerNode* cinner = static_cast<InnerNode*>(child);
+                if (linner->slotuse + cinner->slotuse < inner_slotmax) {
+                    merge_inner(linner, cinner, parent, slot - 1);
+                    merged = true;
+                } else {
+                    shift_right_inner(linner, cinner, parent, slot - 1);
+                }
+            }
+
+            if (merged) {
+                free_node(child);
+                parent->slotuse--;
+                child = left;
+                parent->childcount[parent->slotuse] = child_size(child);
+            } else {
+                update_childcount(parent, slot - 1, slot + 1);
+            }
+
+            if (!child->is_leafnode()) {
+                // the last child of the fixed node may still underflow
+                TLX_BTREE_ASSERT(depth < height);
+                path[depth] = static_cast<InnerNode*>(child);
+                ++depth;
+            } else {
+                --depth;
+            }
+        }
+
+        // remove inner roots that were cut down to a single child
+        while (!root_->is_leafnode() && root_->slotuse == 0) {
+            node* child = static_cast<InnerNode*>(root_)->childid[0];
+            free_node(root_);
+            root_ = child;
+        }
+    }
+
+public:
     //! Delete the k smallest elements using split(). Complexity O(log n + j)
     //! where j is the number of elements with key equal to the key of element
     //! with rank k
@@ -3452,7 +4349,43 @@ public:
         return left;
     }
 
+    //! Replace every key by f(key) in a single pass over all nodes, without
+    //! changing the structure of the tree. f must preserve the order of the
+    //! keys, i.e., if key a is less than key b, f(a) must not be greater than
+    //! f(b) (and must be less if duplicates aren't allowed). For example, the
+    //! positive floating-point keys of a multimap may be multiplied by a
+    //! positive factor.
+    template <typename Function>
+    void transform_keys(Function&& f) noexcept {
+        if (root_) {
+            transform_keys_recursive(root_, f);
+        }
+        if (self_verify) {
+            verify();
+        }
+    }
+
 private:
+    //! Apply f to the keys in the subtree rooted at n
+    template <typename Function>
+    static void transform_keys_recursive(node* n, Function& f) noexcept {
+        if (n->is_leafnode()) {
+            LeafNode* leaf = static_cast<LeafNode*>(n);
+            for (SlotIndexType slot = 0; slot < leaf->slotuse; ++slot) {
+                key_type& key = leaf->mutable_key(slot);
+                key = f(key);
+            }
+        } else {
+            InnerNode* inner = static_cast<InnerNode*>(n);
+            for (SlotIndexType slot = 0; slot < inner->slotuse; ++slot) {
+                inner->slotkey[slot] = f(inner->slotkey[slot]);
+            }
+            for (SlotIndexType slot = 0; slot <= inner->slotuse; ++slot) {
+                transform_keys_recursive(inner->childid[slot], f);
+            }
+        }
+    }
+
     using TPairTreeKey = std::pair<BTree, key_type>;
 
     //! Select a slot and split the node into two subtrees strictly left / right
@@ -3526,6 +4459,8 @@ private:
                 std::copy(n->slotkey, n->slotkey + slot - 1,
                           new_left_root->slotkey);
                 std::copy(n->childid, n->childid + slot, new_left_root->childid);
+                std::copy(n->childcount, n->childcount + slot,
+                          new_left_root->childcount);
             }
             new_left_root->slotuse = slot - 1;
             new_left_root->subtree_size = sum_subtree_size(new_left_root);
@@ -3538,6 +4473,8 @@ private:
                       new_right_root->slotkey);
             std::copy(n->childid + slot + 1, n->childid + slotuse + 1,
                       new_right_root->childid);
+            std::copy(n->childcount + slot + 1, n->childcount + slotuse + 1,
+                      new_right_root->childcount);
 
             new_right_root->slotuse = slotuse - (slot + 1);
             new_right_root->subtree_size = sum_subtree_size(new_right_root);
@@ -3598,14 +4535,13 @@ private:
         NumSlotType slotuse = n->slotuse;
         if (slot > 0) {
             if (n != new_left_root) {
-                std::copy(n->slotdata, n->slotdata + slot, new_left_root->slotdata);
+                n->move_slots(0, slot, *new_left_root, 0);
             }
             new_left_root->slotuse = slot;
         }
 
         if (slot < slotuse) {
-            std::copy(n->slotdata + slot, n->slotdata + slotuse,
-                      new_right_root->slotdata);
+            n->move_slots(slot, slotuse, *new_right_root, 0);
             new_right_root->slotuse = slotuse - slot;
         }
         left.root_ = new_left_root;
@@ -3652,14 +4588,13 @@ public:
         TLX_BTREE_ASSERT(other_tree.head_leaf_);
         tail_leaf_->next_leaf = other_tree.head_leaf_;
         other_tree.head_leaf_->prev_leaf = tail_leaf_;
-        TLX_BTREE_ASSERT(key_lessequal(key_of_value::get(*std::prev(end())),
-                                       key_of_value::get(*(other_tree.begin()))));
+        TLX_BTREE_ASSERT(key_lessequal(std::prev(end()).key(),
+                                       other_tree.begin().key()));
         if (root_->level >= other_tree.root_->level) {
-            join_greater(key_of_value::get(*std::prev(end())), other_tree,
-                         tail_leaf_);
+            join_greater(std::prev(end()).key(), other_tree, tail_leaf_);
         } else {
-            // auto& splitKey = key_of_value::get(*(other_tree.begin()));
-            other_tree.join_less(key_of_value::get(*std::prev(end())), *this,
+            // auto& splitKey = other_tree.begin().key();
+            other_tree.join_less(std::prev(end()).key(), *this,
                                  other_tree.tail_leaf_);
             swap(other_tree);
         }
@@ -3755,9 +4690,7 @@ private:
             // elements of both leaves can be placed in one node
             NumSlotType slot = leaf->slotuse;
 
-            std::copy(other_leaf->slotdata,
-                      other_leaf->slotdata + other_leaf->slotuse,
-                      leaf->slotdata + slot);
+            other_leaf->move_slots(0, other_leaf->slotuse, *leaf, slot);
             leaf->slotuse = leaf->slotuse + other_leaf->slotuse;
 
             leaf->next_leaf = other_leaf->next_leaf;
@@ -3772,16 +4705,14 @@ private:
             // need to redistribute nodes
             if (leaf->slotuse < leaf_slotmin) {
                 TLX_BTREE_PRINT("copy slots from right to left");
-                std::copy(other_leaf->slotdata,
-                          other_leaf->slotdata + (leaf_slotmin - leaf->slotuse),
-                          leaf->slotdata + leaf->slotuse);
+                other_leaf->move_slots(0, leaf_slotmin - leaf->slotuse, *leaf,
+                                       leaf->slotuse);
 
                 *newkey =
                     leaf->key(leaf->slotuse + leaf_slotmin - leaf->slotuse - 1);
 
-                std::copy(other_leaf->slotdata + leaf_slotmin - leaf->slotuse,
-                          other_leaf->slotdata + other_leaf->slotuse,
-                          other_leaf->slotdata);
+                other_leaf->move_slots(leaf_slotmin - leaf->slotuse,
+                                       other_leaf->slotuse, *other_leaf, 0);
 
                 other_leaf->slotuse -= leaf_slotmin - leaf->slotuse;
                 leaf->slotuse = leaf_slotmin;
@@ -3789,15 +4720,13 @@ private:
                 return SPLITED;
             } else if (other_leaf->slotuse < leaf_slotmin) {
                 TLX_BTREE_PRINT("copy slots from left to right");
-                std::copy_backward(other_leaf->slotdata,
-                                   other_leaf->slotdata + other_leaf->slotuse,
-                                   other_leaf->slotdata + leaf_slotmin);
+                other_leaf->move_slots_backward(0, other_leaf->slotuse,
+                                                *other_leaf, leaf_slotmin);
 
-                std::copy_backward(leaf->slotdata + leaf->slotuse -
-                                       (leaf_slotmin - other_leaf->slotuse),
-                                   leaf->slotdata + leaf->slotuse,
-                                   other_leaf->slotdata +
-                                       (leaf_slotmin - other_leaf->slotuse));
+                leaf->move_slots_backward(
+                    leaf->slotuse - (leaf_slotmin - other_leaf->slotuse),
+                    leaf->slotuse, *other_leaf,
+                    leaf_slotmin - other_leaf->slotuse);
 
                 *newkey = leaf->key(leaf->slotuse -
                                     (leaf_slotmin - other_leaf->slotuse) - 1);
@@ -3841,6 +4770,9 @@ private:
             std::copy(other_inner->childid,
                       other_inner->childid + other_inner->slotuse + 1,
                       inner->childid + slot + 1);
+            std::copy(other_inner->childcount,
+                      other_inner->childcount + other_inner->slotuse + 1,
+                      inner->childcount + slot + 1);
 
             inner->subtree_size += other_inner->subtree_size;
 
@@ -3861,6 +4793,10 @@ private:
                 std::copy(other_inner->childid,
                           other_inner->childid + (inner_slotmin - inner->slotuse),
                           inner->childid + inner->slotuse + 1);
+                std::copy(other_inner->childcount,
+                          other_inner->childcount +
+                              (inner_slotmin - inner->slotuse),
+                          inner->childcount + inner->slotuse + 1);
 
                 *newkey = inner->slotkey[inner->slotuse + 1 + inner_slotmin -
                                          inner->slotuse - 1];
@@ -3872,6 +4808,10 @@ private:
                 std::copy(other_inner->childid + (inner_slotmin - inner->slotuse),
                           other_inner->childid + other_inner->slotuse + 1,
                           other_inner->childid);
+                std::copy(other_inner->childcount +
+                              (inner_slotmin - inner->slotuse),
+                          other_inner->childcount + other_inner->slotuse + 1,
+                          other_inner->childcount);
 
                 other_inner->slotuse -= inner_slotmin - inner->slotuse;
                 inner->slotuse = inner_slotmin;
@@ -3890,6 +4830,10 @@ private:
                 std::copy_backward(other_inner->childid,
                                    other_inner->childid + other_inner->slotuse + 1,
                                    other_inner->childid + inner_slotmin + 1);
+                std::copy_backward(other_inner->childcount,
+                                   other_inner->childcount +
+                                       other_inner->slotuse + 1,
+                                   other_inner->childcount + inner_slotmin + 1);
 
                 other_inner->slotkey[inner_slotmin - other_inner->slotuse - 1] =
                     key;
@@ -3905,6 +4849,11 @@ private:
                                    inner->childid + inner->slotuse + 1,
                                    other_inner->childid +
                                        (inner_slotmin - other_inner->slotuse));
+                std::copy_backward(inner->childcount + inner->slotuse + 1 -
+                                       (inner_slotmin - other_inner->slotuse),
+                                   inner->childcount + inner->slotuse + 1,
+                                   other_inner->childcount +
+                                       (inner_slotmin - other_inner->slotuse));
 
                 *newkey = inner->slotkey[inner->slotuse -
                                          (inner_slotmin - other_inner->slotuse)];
@@ -4053,6 +5002,7 @@ private:
                 inner->subtree_size += other_tree.size();
                 join_less_descend(inner->childid[0], key, other_tree, &newkey,
                                   &newchild, leaves_merged, tail);
+                inner->childcount[0] = child_size(inner->childid[0]);
             } else {
                 TLX_BTREE_ASSERT(n->level == other_tree.root_->level);
 
@@ -4076,13 +5026,7 @@ private:
             if (newchild) {
                 if (inner->is_full()) {
                     split_inner_node(inner, splitkey, splitnode, 0);
-
-                    if (newchild->is_leafnode()) {
-                        inner->subtree_size += newchild->slotuse;
-                    } else {
-                        inner->subtree_size +=
-                            static_cast<InnerNode*>(newchild)->subtree_size;
-                    }
+                    inner->subtree_size += child_size(newchild);
 #ifdef BTREE_DEBUG
                     if (debug) {
                         print_node(std::cout, inner);
@@ -4097,9 +5041,13 @@ private:
                 std::copy_backward(inner->childid,
                                    inner->childid + inner->slotuse + 1,
                                    inner->childid + inner->slotuse + 2);
+                std::copy_backward(inner->childcount,
+                                   inner->childcount + inner->slotuse + 1,
+                                   inner->childcount + inner->slotuse + 2);
 
                 inner->slotkey[0] = newkey;
                 inner->childid[1] = newchild;
+                inner->childcount[1] = child_size(newchild);
                 inner->slotuse++;
             }
         } else { // n->is_leafnode()
@@ -4153,6 +5101,8 @@ private:
                 join_greater_descend(inner->childid[inner->slotuse], key,
                                      other_tree, &newkey, &newchild,
                                      leaves_merged, tail);
+                inner->childcount[inner->slotuse] =
+                    child_size(inner->childid[inner->slotuse]);
             } else {
                 // levels of trees equal.Check if duplicates are allowed
                 // and insert new tree as if it was propagated from below
@@ -4169,18 +5119,14 @@ private:
                 if (inner->is_full()) {
                     split_inner_node(inner, splitkey, splitnode, inner->slotuse);
                     inner = static_cast<InnerNode*>(*splitnode);
-                    if (newchild->is_leafnode()) {
-                        inner->subtree_size += newchild->slotuse;
-                    } else {
-                        inner->subtree_size +=
-                            static_cast<InnerNode*>(newchild)->subtree_size;
-                    }
+                    inner->subtree_size += child_size(newchild);
                 }
 
                 // move items and put pointer to child node into correct slot
 
                 inner->slotkey[inner->slotuse] = newkey;
                 inner->childid[inner->slotuse + 1] = newchild;
+                inner->childcount[inner->slotuse + 1] = child_size(newchild);
                 inner->slotuse++;
             }
         } else {
@@ -4244,28 +5190,17 @@ public:
             return end();
         }
 
-        while (n->level > 1) {
-            const InnerNode* inner = static_cast<const InnerNode*>(n);
-            for (SlotIndexType i = 0; i <= inner->slotuse; ++i) {
-                size_type additionalRank =
-                    static_cast<InnerNode*>(inner->childid[i])->subtree_size;
-                if (additionalRank > rank) {
-                    n = inner->childid[i];
-                    break;
-                }
-                rank -= additionalRank;
-            }
-        }
-        if (n->level == 1) {
+        // only the child counts of the inner nodes on the path are read, the
+        // children themselves aren't touched until descending into them
+        while (!n->is_leafnode()) {
             const InnerNode* inner = static_cast<const InnerNode*>(n);
-            for (SlotIndexType i = 0; i <= inner->slotuse; ++i) {
-                size_type additionalRank = inner->childid[i]->slotuse;
-                if (additionalRank > rank) {
-                    n = inner->childid[i];
-                    break;
-                }
-                rank -= additionalRank;
+            SlotIndexType i = 0;
+            while (inner->childcount[i] <= rank) {
+                rank -= inner->childcount[i];
+                ++i;
             }
+            TLX_BTREE_ASSERT(i <= inner->slotuse);
+            n = inner->childid[i];
         }
         TLX_BTREE_ASSERT(n->is_leafnode());
         TLX_BTREE_ASSERT(rank < n->slotuse);
@@ -4278,6 +5213,74 @@ public:
             const_cast<BTree*>(this)->find_rank(rank));
     }
 
+    //! Look up the ranks in the sorted range [first, last) and write an
+    //! iterator to the element of each rank to out, or end() for ranks of at
+    //! least size(). Equivalent to calling find_rank() for every rank, but
+    //! the tree is descended only once: the ranks are partitioned among the
+    //! children at each inner node, and subtrees without any of them aren't
+    //! visited. Returns the output iterator past the last written one.
+    template <typename RankIterator, typename OutputIterator>
+    OutputIterator find_ranks(RankIterator first, RankIterator last,
+                              OutputIterator out) noexcept {
+        return find_ranks_impl<iterator>(first, last, out);
+    }
+
+    template <typename RankIterator, typename OutputIterator>
+    OutputIterator find_ranks(RankIterator first, RankIterator last,
+                              OutputIterator out) const noexcept {
+        return const_cast<BTree*>(this)->find_ranks_impl<const_iterator>(
+            first, last, out);
+    }
+
+private:
+    template <typename Iterator, typename RankIterator,
+              typename OutputIterator>
+    OutputIterator find_ranks_impl(RankIterator first, RankIterator last,
+                                   OutputIterator out) noexcept {
+        if (root_ != nullptr) {
+            find_ranks_descend<Iterator>(root_, 0, first, last, out);
+        }
+        for (; first != last; ++first) {
+            *out++ = Iterator(end());
+        }
+        return out;
+    }
+
+    //! Resolve the ranks at the front of [first, last) that fall into the
+    //! subtree of n, whose smallest element has rank offset, and advance
+    //! first past them
+    template <typename Iterator, typename RankIterator,
+              typename OutputIterator>
+    void find_ranks_descend(node* n, size_type offset, RankIterator& first,
+                            RankIterator last, OutputIterator& out) noexcept {
+        if (n->is_leafnode()) {
+            LeafNode* leaf = static_cast<LeafNode*>(n);
+            const size_type end = offset + leaf->slotuse;
+            for (; first != last; ++first) {
+                const size_type rank = static_cast<size_type>(*first);
+                TLX_BTREE_ASSERT(rank >= offset);
+                if (rank >= end) {
+                    break;
+                }
+                *out++ = Iterator(leaf,
+                                  static_cast<SlotIndexType>(rank - offset));
+            }
+            return;
+        }
+
+        const InnerNode* inner = static_cast<const InnerNode*>(n);
+        for (SlotIndexType i = 0; i <= inner->slotuse && first != last; ++i) {
+            const size_type end = offset + inner->childcount[i];
+            if (static_cast<size_type>(*first) < end) {
+                find_ranks_descend<Iterator>(inner->childid[i], offset, first,
+                                             last, out);
+            }
+            offset = end;
+        }
+    }
+
+public:
+
     //! return the smallest rank (index in array) of an element with the given
     //! key or size() if no such element exists
     std::pair<size_type, const_iterator> rank_of(const key_type& key) const
@@ -4294,7 +5297,7 @@ public:
         if (iter == end()) {
             return size();
         } else {
-            auto [rank, it] = rank_of(key_of_value::get(*iter));
+            auto [rank, it] = rank_of(iter.key());
             TLX_BTREE_ASSERT(std::distance(it, iter) >= 0);
             return rank + static_cast<size_type>(std::distance(it, iter));
         }
@@ -4320,6 +5323,51 @@ public:
         return rankImpl<UPPER_BOUND>(key);
     }
 
+    //! Return the number of elements with keys in [lo, hi) in O(log n). The
+    //! descents for both bounds are shared until they reach different
+    //! children, from there the counts of the children in between are summed.
+    size_type count_range(const key_type& lo, const key_type& hi) const
+        noexcept {
+        if (!root_ || !key_less(lo, hi)) {
+            return 0;
+        }
+        const node* n = root_;
+        while (!n->is_leafnode()) {
+            const InnerNode* inner = static_cast<const InnerNode*>(n);
+            const SlotIndexType slo = find_lower(inner, lo),
+                                shi = find_lower(inner, hi);
+            if (slo != shi) {
+                size_type count = child_size(inner->childid[slo]) -
+                                  count_less(inner->childid[slo], lo);
+                for (SlotIndexType i = slo + 1; i < shi; ++i) {
+                    count += inner->childcount[i];
+                }
+                return count + count_less(inner->childid[shi], hi);
+            }
+            n = inner->childid[slo];
+        }
+        const LeafNode* leaf = static_cast<const LeafNode*>(n);
+        return static_cast<size_type>(find_lower(leaf, hi) -
+                                      find_lower(leaf, lo));
+    }
+
+private:
+    //! Number of elements with keys less than key in the subtree of n
+    size_type count_less(const node* n, const key_type& key) const noexcept {
+        size_type count = 0;
+        while (!n->is_leafnode()) {
+            const InnerNode* inner = static_cast<const InnerNode*>(n);
+            const SlotIndexType slot = find_lower(inner, key);
+            for (SlotIndexType i = 0; i < slot; ++i) {
+                count += inner->childcount[i];
+            }
+            n = inner->childid[slot];
+        }
+        return count + find_lower(static_cast<const LeafNode*>(n), key);
+    }
+
+public:
+
 
 #ifdef TLX_BTREE_DEBUG
 
@@ -4459,7 +5507,10 @@ private:
                 key_type submaxkey = key_type();
 
                 tlx_die_unless(subnode->level + 1 == inner->level);
-                subtree_size += verify_node(subnode, &subminkey, &submaxkey);
+                size_type subnode_size =
+                    verify_node(subnode, &subminkey, &submaxkey);
+                tlx_die_unless(inner->childcount[slot] == subnode_size);
+                subtree_size += subnode_size;
 
                 TLX_BTREE_PRINT("verify subnode " << subnode << ": " << subminkey
                                                   << " - " << submaxkey);
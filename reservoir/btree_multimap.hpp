@@ -19,6 +19,7 @@
 #include <functional>
 #include <memory>
 #include <utility>
+#include <vector>
 
 namespace reservoir {
 
@@ -90,6 +91,9 @@ public:
     //! Size type used to count keys
     using size_type = typename btree_impl::size_type;
 
+    //! Subtrees cut off by truncate(), freed when destroyed or cleared
+    using detached_subtrees = typename btree_impl::detached_subtrees;
+
     //! \}
 
 public:
@@ -459,6 +463,11 @@ public:
         return tree_.insert(x).first;
     }
 
+    //! Insert a key/data pair into the B+ tree, moving it into the tree.
+    iterator insert(value_type&& x) noexcept {
+        return tree_.insert(std::move(x)).first;
+    }
+
     //! Attempt to insert a key/data pair into the B+ tree. This function is the
     //! same as the other insert.  As this tree allows duplicates, insertion
     //! never fails.
@@ -466,6 +475,11 @@ public:
         return tree_.insert(value_type(key, data)).first;
     }
 
+    //! Insert a key/data pair into the B+ tree, moving the data into the tree.
+    iterator insert2(const key_type& key, data_type&& data) noexcept {
+        return tree_.insert(value_type(key, std::move(data))).first;
+    }
+
     //! Attempt to insert a key/data pair into the B+ tree. The iterator hint is
     //! currently ignored by the B+ tree insertion routine.
     iterator insert(iterator hint, const value_type& x) noexcept {
@@ -494,6 +508,22 @@ public:
         return tree_.bulk_load(first, last);
     }
 
+    //! Bulk load a sorted range [first,last) with num_threads threads, see
+    //! BTree::bulk_load_parallel. The tree must be empty.
+    template <typename Iterator>
+    void bulk_load_parallel(Iterator first, Iterator last,
+                            size_t num_threads) {
+        return tree_.bulk_load_parallel(first, last, num_threads);
+    }
+
+    //! Bulk load the merge of several sorted runs [first,last) with
+    //! num_threads threads, see BTree::bulk_load_runs. The tree must be empty.
+    template <typename Iterator>
+    void bulk_load_runs(const std::vector<std::pair<Iterator, Iterator> >& runs,
+                        size_t num_threads) {
+        return tree_.bulk_load_runs(runs, num_threads);
+    }
+
     //! \}
 
 public:
@@ -563,6 +593,20 @@ public:
         return tree_.find_rank(rank);
     }
 
+    //! Write find_rank(r) to out for each r in the sorted range of ranks
+    //! [first, last), descending the tree only once
+    template <typename RankIterator, typename OutputIterator>
+    OutputIterator find_ranks(RankIterator first, RankIterator last,
+                              OutputIterator out) noexcept {
+        return tree_.find_ranks(first, last, out);
+    }
+
+    template <typename RankIterator, typename OutputIterator>
+    OutputIterator find_ranks(RankIterator first, RankIterator last,
+                              OutputIterator out) const noexcept {
+        return tree_.find_ranks(first, last, out);
+    }
+
     //! Return the rank of the leftmost element with the given key in O(log
     //! size()) or size() if there is no such element
     std::pair<size_type, const_iterator> rank_of(const key_type& key) const
@@ -600,8 +644,50 @@ public:
         return tree_.rank_of_upper_bound(key);
     }
 
+    //! Return the number of elements with keys in [lo, hi) in O(log size())
+    size_type count_range(const key_type& lo, const key_type& hi) const
+        noexcept {
+        return tree_.count_range(lo, hi);
+    }
+
     //! \}
 
+    //! Keep only the k smallest elements in O(log size()) by cutting the tree
+    //! in place. The removed elements are moved to detached, see
+    //! BTree::truncate.
+    void truncate(size_type k, detached_subtrees& detached) noexcept {
+        tree_.truncate(k, detached);
+    }
+
+    //! Keep only the k smallest elements, the removed elements are freed when
+    //! the result is destroyed
+    detached_subtrees truncate(size_type k) noexcept {
+        return tree_.truncate(k);
+    }
+
+    //! Erase all elements with keys in [lo, hi) in O(log size()) plus the
+    //! boundary, moving whole subtrees to detached. Returns the number of
+    //! erased elements, see BTree::erase_range.
+    size_type erase_range(const key_type& lo, const key_type& hi,
+                          detached_subtrees& detached) noexcept {
+        return tree_.erase_range(lo, hi, detached);
+    }
+
+    //! Erase all elements with keys in [lo, hi) and free them right away
+    size_type erase_range(const key_type& lo, const key_type& hi) noexcept {
+        return tree_.erase_range(lo, hi);
+    }
+
+    //! Erase all elements with keys not less than key by truncating the tree
+    size_type erase_from(const key_type& key,
+                         detached_subtrees& detached) noexcept {
+        return tree_.erase_from(key, detached);
+    }
+
+    size_type erase_from(const key_type& key) noexcept {
+        return tree_.erase_from(key);
+    }
+
     //! Delete the k smallest elements
     btree_multimap bulk_delete(size_type k) noexcept {
         return tree_.bulk_delete(k);
@@ -612,6 +698,13 @@ public:
         return tree_.bulk_delete(k, iter);
     }
 
+    //! Replace every key by f(key) without changing the structure of the tree.
+    //! f must preserve the order of the keys, see BTree::transform_keys.
+    template <typename Function>
+    void transform_keys(Function&& f) noexcept {
+        tree_.transform_keys(std::forward<Function>(f));
+    }
+
 #ifdef TLX_BTREE_DEBUG
 
 public:
@@ -0,0 +1,82 @@
+/*******************************************************************************
+ * reservoir/btree_simd.hpp
+ *
+ * Vectorized search of the sorted double keys of a B+ tree node
+ *
+ * Copyright (C) 2019 Lorenz Hübschle-Schneider <lorenz@4z2.de>
+ *
+ * All rights reserved. Published under the Boost Software License, Version 1.0
+ ******************************************************************************/
+
+#pragma once
+#ifndef RESERVOIR_BTREE_SIMD_HEADER
+#define RESERVOIR_BTREE_SIMD_HEADER
+
+#include <cstdint>
+
+#if defined(__AVX512F__) || defined(__AVX2__)
+#include <immintrin.h>
+#define RESERVOIR_BTREE_SIMD_SEARCH 1
+#else
+#define RESERVOIR_BTREE_SIMD_SEARCH 0
+#endif
+
+namespace reservoir {
+
+//! Whether simd_count_less() is vectorized on the target architecture
+static constexpr bool simd_search_supported = RESERVOIR_BTREE_SIMD_SEARCH;
+
+/*!
+ * Count the keys among the first n of the sorted array keys that are less than
+ * key, or less than or equal to key if Inclusive is set.  This is the index of
+ * the first key greater than or equal to (greater than) key, i.e., the result
+ * of find_lower (find_upper) on a node.
+ *
+ * Whole vectors of keys are compared at once and the comparison masks are
+ * popcounted.  As the keys are sorted, the scan stops at the first vector that
+ * isn't entirely below key.  Keys at index n and above are never read, so the
+ * unused slots of a node may be uninitialized.
+ */
+template <bool Inclusive>
+inline uint16_t simd_count_less(const double* keys, uint16_t n,
+                                double key) noexcept {
+    uint16_t i = 0;
+#if defined(__AVX512F__)
+    constexpr int pred = Inclusive ? _CMP_LE_OQ : _CMP_LT_OQ;
+    const __m512d k = _mm512_set1_pd(key);
+    for (; i + 8 <= n; i += 8) {
+        __mmask8 m = _mm512_cmp_pd_mask(_mm512_loadu_pd(keys + i), k, pred);
+        if (m != 0xFF)
+            return static_cast<uint16_t>(i + __builtin_popcount(m));
+    }
+    if (i < n) {
+        // masked load of the remaining keys, the other lanes compare false
+        __mmask8 tail = static_cast<__mmask8>((1u << (n - i)) - 1);
+        __mmask8 m = _mm512_mask_cmp_pd_mask(
+            tail, _mm512_maskz_loadu_pd(tail, keys + i), k, pred);
+        i = static_cast<uint16_t>(i + __builtin_popcount(m));
+    }
+    return i;
+#else
+#if defined(__AVX2__)
+    constexpr int pred = Inclusive ? _CMP_LE_OQ : _CMP_LT_OQ;
+    const __m256d k = _mm256_set1_pd(key);
+    for (; i + 4 <= n; i += 4) {
+        int m = _mm256_movemask_pd(
+            _mm256_cmp_pd(_mm256_loadu_pd(keys + i), k, pred));
+        if (m != 0xF)
+            return static_cast<uint16_t>(i + __builtin_popcount(m));
+    }
+#endif
+    // remaining keys, or everything without vector support
+    while (i < n && (Inclusive ? keys[i] <= key : keys[i] < key))
+        ++i;
+    return i;
+#endif
+}
+
+} // namespace reservoir
+
+#endif // !RESERVOIR_BTREE_SIMD_HEADER
+
+/******************************************************************************/
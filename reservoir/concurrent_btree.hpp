@@ -0,0 +1,506 @@
+/*******************************************************************************
+ * reservoir/concurrent_btree.hpp
+ *
+ * B+ tree multimap with optimistic lock coupling for concurrent insertions
+ *
+ * Copyright (C) 2019 Lorenz Hübschle-Schneider <lorenz@4z2.de>
+ *
+ * All rights reserved. Published under the Boost Software License, Version 1.0
+ ******************************************************************************/
+
+#pragma once
+#ifndef RESERVOIR_CONCURRENT_BTREE_HEADER
+#define RESERVOIR_CONCURRENT_BTREE_HEADER
+
+#include <reservoir/btree.hpp>
+
+#include <tlx/die/core.hpp>
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <iterator>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace reservoir {
+
+/*!
+ * B+ tree multimap into which several threads can insert at the same time.
+ *
+ * Synchronization uses optimistic lock coupling: every node carries a version
+ * counter that doubles as a write lock (odd while locked). Readers descend
+ * without taking any locks and validate the versions of the nodes they read
+ * afterwards, restarting from the root if a node was modified in between.
+ * Writers only lock the leaf they insert into, or the node they split and its
+ * parent. Full nodes are split eagerly on the way down, so a split never
+ * propagates upwards. As the inner nodes are read while other threads may
+ * modify them, their keys and child pointers are relaxed atomics, and the
+ * keys must be trivially copyable.
+ *
+ * The tree only supports insertions, and keeps neither subtree sizes nor a
+ * global element count, which every insertion would have to update. Instead,
+ * once all inserting threads have finished (a quiesce point), merge_into()
+ * moves the elements into a BTree-based container, whose subtree sizes, and
+ * thus find_rank(), are exact. size(), verify() and merge_into() must not run
+ * concurrently with insertions.
+ */
+template <typename Key, typename Data, typename Compare = std::less<Key>,
+          typename Traits = btree_default_traits<Key, std::pair<Key, Data> > >
+class concurrent_btree_multimap {
+public:
+    //! \name Template Parameter Types
+    //! \{
+
+    typedef Key key_type;
+    typedef Data data_type;
+    typedef Data mapped_type;
+    typedef std::pair<Key, Data> value_type;
+    typedef Compare key_compare;
+    typedef Traits traits;
+    typedef size_t size_type;
+
+    //! \}
+
+    static_assert(std::is_trivially_copyable<key_type>::value,
+                  "keys of inner nodes are read concurrently as atomics");
+
+    //! Maximum number of elements in a leaf
+    static const uint16_t leaf_slotmax = traits::leaf_slots;
+
+    //! Maximum number of keys in an inner node
+    static const uint16_t inner_slotmax = traits::inner_slots;
+
+    explicit concurrent_btree_multimap(const key_compare& cmp = key_compare())
+        : key_less_(cmp) {
+        init();
+    }
+
+    //! Non-copyable
+    concurrent_btree_multimap(const concurrent_btree_multimap&) = delete;
+    concurrent_btree_multimap&
+    operator=(const concurrent_btree_multimap&) = delete;
+
+    ~concurrent_btree_multimap() {
+        free_node(root_.load(std::memory_order_relaxed));
+    }
+
+    //! Insert the pair (key, data). Safe to call from several threads at the
+    //! same time. data is only moved from once the insertion succeeds.
+    template <typename D>
+    void insert2(const key_type& key, D&& data) {
+        while (!try_insert<D>(key, data)) {
+        }
+    }
+
+    //! Number of elements. Must not be called during insertions.
+    size_type size() const {
+        size_type size = 0;
+        for (const leaf_node* leaf = head_leaf_; leaf != nullptr;
+             leaf = leaf->next_leaf) {
+            size += leaf->slotuse.load(std::memory_order_relaxed);
+        }
+        return size;
+    }
+
+    //! True if there are no elements. Must not be called during insertions.
+    bool empty() const {
+        return head_leaf_->next_leaf == nullptr &&
+               head_leaf_->slotuse.load(std::memory_order_relaxed) == 0;
+    }
+
+    //! Remove all elements. Must not be called during insertions.
+    void clear() {
+        free_node(root_.load(std::memory_order_relaxed));
+        init();
+    }
+
+    //! Move all elements into tree, a BTree-based multimap that may already
+    //! contain elements, and clear this tree. tree is rebuilt from the merge
+    //! of both with bulk_load_runs() using num_threads threads, so its
+    //! subtree sizes are exact afterwards. Equal keys of tree come first.
+    //! Must not be called during insertions.
+    template <typename Tree>
+    void merge_into(Tree& tree, size_t num_threads = 1) {
+        items_.clear();
+        items_.reserve(tree.size() + size());
+        for (auto it = tree.begin(); it != tree.end(); ++it) {
+            items_.emplace_back(it->first, std::move(it->second));
+        }
+        const size_t num_old = items_.size();
+        for (leaf_node* leaf = head_leaf_; leaf != nullptr;
+             leaf = leaf->next_leaf) {
+            const uint16_t slotuse =
+                leaf->slotuse.load(std::memory_order_relaxed);
+            for (uint16_t i = 0; i < slotuse; ++i) {
+                items_.emplace_back(leaf->slotkey[i],
+                                    std::move(leaf->slotdata[i]));
+            }
+        }
+        tree.clear();
+        clear();
+
+        using run_iterator = std::move_iterator<typename items_type::iterator>;
+        const std::vector<std::pair<run_iterator, run_iterator> > runs{
+            { run_iterator(items_.begin()),
+              run_iterator(items_.begin() + num_old) },
+            { run_iterator(items_.begin() + num_old),
+              run_iterator(items_.end()) }
+        };
+        tree.bulk_load_runs(runs, num_threads);
+        items_.clear();
+    }
+
+    //! Check the order of the keys and the separators of the inner nodes.
+    //! Must not be called during insertions.
+    void verify() const {
+        verify_node(root_.load(std::memory_order_relaxed), nullptr, nullptr);
+        const key_type* prev = nullptr;
+        for (const leaf_node* leaf = head_leaf_; leaf != nullptr;
+             leaf = leaf->next_leaf) {
+            const uint16_t slotuse =
+                leaf->slotuse.load(std::memory_order_relaxed);
+            tlx_die_unless(slotuse > 0 || leaf == head_leaf_);
+            for (uint16_t i = 0; i < slotuse; ++i) {
+                tlx_die_unless(!prev || !key_less_(leaf->slotkey[i], *prev));
+                prev = &leaf->slotkey[i];
+            }
+        }
+    }
+
+private:
+    //! \name Node Classes and Version Locks
+    //! \{
+
+    //! Common part of inner and leaf nodes
+    struct node {
+        //! Version counter, odd while the node is write-locked. Every
+        //! modification increments it by two.
+        std::atomic<uint64_t> version { 0 };
+
+        //! Number of keys used, read optimistically by other threads
+        std::atomic<uint16_t> slotuse { 0 };
+
+        //! Whether this is a leaf node
+        const bool is_leaf;
+
+        explicit node(bool leaf) : is_leaf(leaf) { }
+
+        //! Start an optimistic read. Sets restart if the node is locked.
+        uint64_t read_lock(bool& restart) const {
+            const uint64_t v = version.load(std::memory_order_acquire);
+            if (v & 1) {
+                restart = true;
+            }
+            return v;
+        }
+
+        //! Check that the node wasn't modified since read_lock() returned v,
+        //! which validates everything read from it in between
+        void validate(uint64_t v, bool& restart) const {
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (version.load(std::memory_order_relaxed) != v) {
+                restart = true;
+            }
+        }
+
+        //! Lock the node for writing if it is still at version v
+        void upgrade_to_write_lock(uint64_t& v, bool& restart) {
+            if (version.compare_exchange_strong(v, v + 1,
+                                                std::memory_order_acquire)) {
+                ++v;
+                // order the lock before the following writes for readers
+                std::atomic_thread_fence(std::memory_order_release);
+            } else {
+                restart = true;
+            }
+        }
+
+        void write_unlock() {
+            version.fetch_add(1, std::memory_order_release);
+        }
+    };
+
+    //! Inner node, its contents are read concurrently
+    struct inner_node : public node {
+        std::atomic<key_type> slotkey[inner_slotmax];
+        std::atomic<node*> childid[inner_slotmax + 1];
+
+        inner_node() : node(false) { }
+
+        key_type key(uint16_t i) const {
+            return slotkey[i].load(std::memory_order_relaxed);
+        }
+
+        node* child(uint16_t i) const {
+            return childid[i].load(std::memory_order_relaxed);
+        }
+    };
+
+    //! Leaf node, only accessed while it is write-locked, except for slotuse
+    struct leaf_node : public node {
+        key_type slotkey[leaf_slotmax];
+        data_type slotdata[leaf_slotmax];
+
+        //! Next leaf in key order, only followed at quiesce points
+        leaf_node* next_leaf = nullptr;
+
+        leaf_node() : node(true) { }
+    };
+
+    //! \}
+
+    //! Index of the child of inner to descend into for key
+    uint16_t find_lower(const inner_node* inner, const key_type& key) const {
+        const uint16_t slotuse =
+            inner->slotuse.load(std::memory_order_relaxed);
+        uint16_t i = 0;
+        while (i < slotuse && key_less_(inner->key(i), key)) {
+            ++i;
+        }
+        return i;
+    }
+
+    //! One attempt to insert, returns false if it has to be restarted
+    template <typename D>
+    bool try_insert(const key_type& key, D& data) {
+        bool restart = false;
+        node* n = root_.load(std::memory_order_acquire);
+        uint64_t version = n->read_lock(restart);
+        if (restart || n != root_.load(std::memory_order_acquire)) {
+            return false;
+        }
+        inner_node* parent = nullptr;
+        uint64_t parent_version = 0;
+
+        while (!n->is_leaf) {
+            inner_node* inner = static_cast<inner_node*>(n);
+            if (inner->slotuse.load(std::memory_order_relaxed) ==
+                inner_slotmax) {
+                split(parent, parent_version, n, version);
+                return false;
+            }
+            if (parent) {
+                parent->validate(parent_version, restart);
+                if (restart) {
+                    return false;
+                }
+            }
+            parent = inner;
+            parent_version = version;
+
+            n = inner->child(find_lower(inner, key));
+            inner->validate(version, restart);
+            if (restart) {
+                return false;
+            }
+            version = n->read_lock(restart);
+            if (restart) {
+                return false;
+            }
+        }
+
+        leaf_node* leaf = static_cast<leaf_node*>(n);
+        if (leaf->slotuse.load(std::memory_order_relaxed) == leaf_slotmax) {
+            split(parent, parent_version, n, version);
+            return false;
+        }
+        leaf->upgrade_to_write_lock(version, restart);
+        if (restart) {
+            return false;
+        }
+        if (parent) {
+            parent->validate(parent_version, restart);
+            if (restart) {
+                leaf->write_unlock();
+                return false;
+            }
+        }
+
+        // insert after all equal keys
+        const uint16_t slotuse = leaf->slotuse.load(std::memory_order_relaxed);
+        uint16_t slot = slotuse;
+        while (slot > 0 && key_less_(key, leaf->slotkey[slot - 1])) {
+            leaf->slotkey[slot] = leaf->slotkey[slot - 1];
+            leaf->slotdata[slot] = std::move(leaf->slotdata[slot - 1]);
+            --slot;
+        }
+        leaf->slotkey[slot] = key;
+        leaf->slotdata[slot] = std::forward<D>(data);
+        leaf->slotuse.store(slotuse + 1, std::memory_order_relaxed);
+        leaf->write_unlock();
+        return true;
+    }
+
+    //! Lock the full node n and its parent and split n. The caller restarts
+    //! the insertion afterwards, whether this succeeded or not.
+    void split(inner_node* parent, uint64_t parent_version, node* n,
+               uint64_t version) {
+        bool restart = false;
+        if (parent) {
+            parent->upgrade_to_write_lock(parent_version, restart);
+            if (restart) {
+                return;
+            }
+        }
+        n->upgrade_to_write_lock(version, restart);
+        if (restart) {
+            if (parent) {
+                parent->write_unlock();
+            }
+            return;
+        }
+        if (!parent && n != root_.load(std::memory_order_relaxed)) {
+            // another thread added a new root above n
+            n->write_unlock();
+            return;
+        }
+
+        key_type separator;
+        node* right;
+        if (n->is_leaf) {
+            right = split_leaf(static_cast<leaf_node*>(n), separator);
+        } else {
+            right = split_inner(static_cast<inner_node*>(n), separator);
+        }
+        if (parent) {
+            insert_child(parent, n, separator, right);
+        } else {
+            inner_node* root = new inner_node();
+            root->slotkey[0].store(separator, std::memory_order_relaxed);
+            root->childid[0].store(n, std::memory_order_relaxed);
+            root->childid[1].store(right, std::memory_order_relaxed);
+            root->slotuse.store(1, std::memory_order_relaxed);
+            root_.store(root, std::memory_order_release);
+        }
+
+        n->write_unlock();
+        if (parent) {
+            parent->write_unlock();
+        }
+    }
+
+    //! Move the upper half of the locked leaf to a new leaf. All keys of
+    //! leaf are not greater than separator afterwards.
+    leaf_node* split_leaf(leaf_node* leaf, key_type& separator) {
+        const uint16_t slotuse = leaf->slotuse.load(std::memory_order_relaxed);
+        const uint16_t mid = slotuse / 2;
+        leaf_node* right = new leaf_node();
+        for (uint16_t i = mid; i < slotuse; ++i) {
+            right->slotkey[i - mid] = leaf->slotkey[i];
+            right->slotdata[i - mid] = std::move(leaf->slotdata[i]);
+        }
+        right->slotuse.store(slotuse - mid, std::memory_order_relaxed);
+        leaf->slotuse.store(mid, std::memory_order_relaxed);
+        right->next_leaf = leaf->next_leaf;
+        leaf->next_leaf = right;
+        separator = leaf->slotkey[mid - 1];
+        return right;
+    }
+
+    //! Move the upper half of the locked inner node to a new one, the middle
+    //! key becomes the separator
+    inner_node* split_inner(inner_node* inner, key_type& separator) {
+        const uint16_t slotuse = inner->slotuse.load(std::memory_order_relaxed);
+        const uint16_t mid = slotuse / 2;
+        inner_node* right = new inner_node();
+        for (uint16_t i = mid + 1; i < slotuse; ++i) {
+            right->slotkey[i - mid - 1].store(inner->key(i),
+                                              std::memory_order_relaxed);
+        }
+        for (uint16_t i = mid + 1; i <= slotuse; ++i) {
+            right->childid[i - mid - 1].store(inner->child(i),
+                                              std::memory_order_relaxed);
+        }
+        right->slotuse.store(slotuse - mid - 1, std::memory_order_relaxed);
+        separator = inner->key(mid);
+        inner->slotuse.store(mid, std::memory_order_relaxed);
+        return right;
+    }
+
+    //! Insert right with separator after its left sibling into the locked
+    //! parent, which isn't full as full nodes are split on the way down
+    void insert_child(inner_node* parent, node* left, const key_type& separator,
+                      node* right) {
+        uint16_t slot = parent->slotuse.load(std::memory_order_relaxed);
+        TLX_BTREE_ASSERT(slot < inner_slotmax);
+        parent->childid[slot + 1].store(parent->child(slot),
+                                        std::memory_order_relaxed);
+        while (parent->child(slot) != left) {
+            TLX_BTREE_ASSERT(slot > 0);
+            parent->slotkey[slot].store(parent->key(slot - 1),
+                                        std::memory_order_relaxed);
+            parent->childid[slot].store(parent->child(slot - 1),
+                                        std::memory_order_relaxed);
+            --slot;
+        }
+        parent->slotkey[slot].store(separator, std::memory_order_relaxed);
+        parent->childid[slot + 1].store(right, std::memory_order_relaxed);
+        parent->slotuse.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void init() {
+        head_leaf_ = new leaf_node();
+        root_.store(head_leaf_, std::memory_order_release);
+    }
+
+    static void free_node(node* n) {
+        if (n->is_leaf) {
+            delete static_cast<leaf_node*>(n);
+            return;
+        }
+        inner_node* inner = static_cast<inner_node*>(n);
+        const uint16_t slotuse = inner->slotuse.load(std::memory_order_relaxed);
+        for (uint16_t i = 0; i <= slotuse; ++i) {
+            free_node(inner->child(i));
+        }
+        delete inner;
+    }
+
+    //! Check that all keys in the subtree of n are in [lo, hi], where null
+    //! means unbounded
+    void verify_node(const node* n, const key_type* lo,
+                     const key_type* hi) const {
+        const uint16_t slotuse = n->slotuse.load(std::memory_order_relaxed);
+        tlx_die_unless(n->version.load(std::memory_order_relaxed) % 2 == 0);
+        if (n->is_leaf) {
+            const leaf_node* leaf = static_cast<const leaf_node*>(n);
+            for (uint16_t i = 0; i < slotuse; ++i) {
+                tlx_die_unless(!lo || !key_less_(leaf->slotkey[i], *lo));
+                tlx_die_unless(!hi || !key_less_(*hi, leaf->slotkey[i]));
+            }
+            return;
+        }
+        const inner_node* inner = static_cast<const inner_node*>(n);
+        tlx_die_unless(slotuse > 0);
+        std::vector<key_type> keys(slotuse);
+        for (uint16_t i = 0; i < slotuse; ++i) {
+            keys[i] = inner->key(i);
+            tlx_die_unless(i == 0 || !key_less_(keys[i], keys[i - 1]));
+        }
+        for (uint16_t i = 0; i <= slotuse; ++i) {
+            verify_node(inner->child(i), i == 0 ? lo : &keys[i - 1],
+                        i == slotuse ? hi : &keys[i]);
+        }
+    }
+
+    using items_type = std::vector<value_type>;
+
+    //! Root node, replaced when the root is split
+    std::atomic<node*> root_;
+
+    //! Leftmost leaf, which is never replaced as splits move the upper half
+    leaf_node* head_leaf_;
+
+    key_compare key_less_;
+
+    //! Buffer for merge_into
+    items_type items_;
+};
+
+} // namespace reservoir
+
+#endif // !RESERVOIR_CONCURRENT_BTREE_HEADER
+
+/******************************************************************************/
@@ -0,0 +1,410 @@
+/*******************************************************************************
+ * reservoir/fr_select.hpp
+ *
+ * Distributed Floyd-Rivest style selection from sorted sequences (in this case,
+ * mostly B-trees)
+ *
+ * Copyright (C) 2019 Lorenz Hübschle-Schneider <lorenz@4z2.de>
+ *
+ * All rights reserved. Published under the GNU General Public License 3
+ ******************************************************************************/
+
+#pragma once
+#ifndef RESERVOIR_FR_SELECT_HEADER
+#define RESERVOIR_FR_SELECT_HEADER
+
+#include <reservoir/aggregate.hpp>
+#include <reservoir/generators/select.hpp>
+#include <reservoir/logger.hpp>
+#include <reservoir/select_helpers.hpp>
+#include <reservoir/timer.hpp>
+#include <reservoir/util.hpp>
+
+#include <tlx/die/core.hpp>
+#include <tlx/math/aggregate.hpp>
+
+#include <boost/mpi.hpp>
+#include <boost/mpi/collectives/all_gatherv.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <functional>
+#include <limits>
+#include <ostream>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+namespace mpi = boost::mpi;
+
+namespace reservoir {
+
+// Selection using a pair of pivots that bracket the target rank with high
+// probability.  In every round, each PE samples the elements of its remaining
+// range independently with probability p, the samples are gathered at every PE
+// and the two pivots are taken from the sorted sample at distance `delta`
+// around the expected rank of the targets.  The sample has ~n^(2/3) elements,
+// but at most ~max_sample, as every PE gathers and sorts all of it.  The
+// remaining range then shrinks to O(n / sqrt(sample size)) elements per round
+// w.h.p., i.e., to O(n^(2/3)) below the cap, not to the ~sqrt(n) of the
+// sequential algorithm.  Once the range fits into a single sample, the round
+// is exact.
+template <typename Seq, size_t max_sample = (1 << 14),
+          typename RNG = generators::select_t>
+class fr_select {
+public:
+    static constexpr const char *short_name = "[frs]";
+    static const std::string name() {
+        return "fr-select";
+    }
+
+    using Iterator = typename Seq::const_iterator;
+    using Cmp = typename Seq::key_compare;
+    using Key = typename Seq::key_type;
+    using Elem = typename Seq::value_type;
+
+    // pair of iterator and local rank
+    using Result = std::pair<Iterator, ssize_t>;
+
+    // Upper/lower bound iterator and an index
+    struct Bound {
+        ssize_t ub_pos, lb_pos;
+        Iterator ub_it, lb_it;
+
+        Bound() = default;
+        Bound(const std::tuple<ssize_t, ssize_t, Iterator, Iterator> &tup) {
+            std::tie(ub_pos, lb_pos, ub_it, lb_it) = tup;
+        }
+    };
+
+    static constexpr bool debug = false;
+    static constexpr bool check = false;
+    static constexpr bool time = true;
+
+    // number of standard deviations of the sample rank between target rank
+    // and pivot.  Each pivot misses its side with probability < 1%.
+    static constexpr double delta_factor = 2.5;
+    // sample ranges of at most this size completely, making the round exact
+    static constexpr size_t exact_threshold = max_sample;
+    // below this distance, advance iterators instead of descending the tree
+    static constexpr ssize_t advance_threshold = 16;
+    // skips drawn in addition to the expected number of sampled elements
+    static constexpr size_t skip_slack = 16;
+
+    // Construct a selector using a given communicator and seed.  The seed must
+    // be different on every PE (member of the communicator)!
+    fr_select(mpi::communicator &comm, size_t seed)
+        : comm_(comm), rng_(seed), pivots_(2), bounds_(2), gbounds_(4) {
+        // two pivots per round
+        stats_.norm_factor = 2;
+    }
+
+    // wrapper for kmin = kmax
+    Result operator()(Seq &seq, size_t k) {
+        return operator()(seq, k, k);
+    }
+
+    Result operator()(const Seq &seq, const size_t kmin, const size_t kmax) {
+        timer total_timer;
+
+        sLOGR << "Selecting between" << kmin << "and" << kmax << "with"
+              << comm_.size() << "PEs";
+        if (kmin > kmax || kmax == 0) {
+            sLOGR << "aborting: kmin =" << kmin << "kmax =" << kmax;
+            return std::make_pair(seq.begin(), 0);
+        }
+        if constexpr (check) {
+            seq.verify();
+            size_t size = seq.size();
+            mpi::all_reduce(comm_, mpi::inplace(size), std::plus<>());
+            sLOGR << "Checking size: want at least" << kmin << "have" << size;
+            tlx_die_unless(kmin <= size);
+        }
+
+        // calculate global size
+        size_t size = seq.size();
+        mpi::all_reduce(comm_, mpi::inplace(size), std::plus<>());
+        LOGR << "global size: " << size;
+        // clang-format off
+        tlx_die_verbose_unless(kmin <= size,
+                               "Cannot select " << kmin << " to " << kmax
+                               << " smallest out of " << size << " items; have "
+                               << seq.size() << " at PE " << comm_.rank());
+        // clang-format on
+
+        sample_sizes_.resize(comm_.size());
+
+        auto res = select(seq, kmin, kmax, 0, seq.size(), size);
+
+        if constexpr (check) {
+            size_t result_size = res.second;
+            mpi::all_reduce(comm_, mpi::inplace(result_size), std::plus<>());
+            tlx_die_verbose_unless(kmin <= result_size && kmax >= result_size,
+                                   "Expected between " << kmin << " and " << kmax
+                                                       << " got " << result_size);
+        }
+
+        if constexpr (debug) {
+            comm_.barrier();
+            auto it = seq.begin();
+            std::vector<Elem> vec;
+            while (it != res.first) {
+                vec.emplace_back(*it++);
+            }
+            size_t size = vec.size();
+            pLOG << "local result " << size << " elements";
+            // double-check output size
+            mpi::all_reduce(comm_, mpi::inplace(size), std::plus<>());
+            tlx_die_unless(size >= kmin && size <= kmax);
+        }
+
+        stats_.record_total(total_timer.get());
+        stats_.reset_level();
+        pLOGC(time && debug) << "stats: " << stats_;
+        return res;
+    }
+
+    _detail::select_stats<time> &get_stats() {
+        return stats_;
+    }
+
+protected:
+    // Iterative selection.  Every level narrows the local range [min_idx,
+    // max_idx) and carries its boundary iterators forward, so the only tree
+    // descents per level are the ones for the sample and the pivots.
+    Result select(const Seq &seq, ssize_t kmin, ssize_t kmax, ssize_t min_idx,
+                  ssize_t max_idx, ssize_t global_size) {
+        Iterator min_it, max_it;
+        std::tie(min_it, max_it) =
+            _detail::find_rank_range(seq, min_idx, max_idx);
+        while (true) {
+            stats_.next_level(); // debug timings
+            if (comm_.rank() == 0)
+                stats_.record_size(global_size);
+            timer_.reset();
+
+            tlx_die_verbose_unless(max_idx >= min_idx,
+                                   "Expected max_idx >= min_idx, got max_idx = "
+                                       << max_idx << " min_idx = " << min_idx);
+            tlx_die_unless(kmin <= kmax && kmin <= global_size);
+
+            const ssize_t local_size = max_idx - min_idx;
+            spLOG << "kmin =" << kmin << "kmax =" << kmax
+                  << "global_size =" << global_size << "local range:" << min_idx
+                  << max_idx << "size" << local_size;
+
+            if (kmin == 1 || kmax == 1) {
+                Key pivot = std::numeric_limits<Key>::max();
+                if (local_size > 0) {
+                    pivot = get_key(min_it);
+                }
+                pLOG << "Aborting at level " << stats_.level
+                     << " with kmin = " << kmin << " kmax = " << kmax
+                     << " local minimum: " << pivot;
+                mpi::all_reduce(comm_, mpi::inplace(pivot),
+                                mpi::minimum<Key>());
+
+                // The minimum may occur several times, so split its copies
+                // like any other pivot's instead of taking all of them
+                Bound bound = _detail::get_bounds<false>(
+                    seq, stats_, pivot, min_idx, max_idx, min_it, max_it,
+                    comm_, short_name, debug);
+                auto [global_ub, global_lb] = _detail::global_bound(
+                    bound.ub_pos, bound.lb_pos, global_size, comm_);
+                pLOG << "pivot = " << pivot << " global ub " << global_ub;
+                Result result = _detail::find_eq_pos(
+                    global_ub, bound.ub_pos, bound.ub_it, global_lb,
+                    bound.lb_pos, bound.lb_it, min_idx, kmin - global_lb,
+                    comm_, debug, short_name);
+
+                stats_.record(timer_.get());
+                return result;
+            }
+
+            // Sample the local range with probability p and gather the sample
+            const bool exact =
+                global_size <= static_cast<ssize_t>(exact_threshold);
+            const double n = static_cast<double>(global_size);
+            const double p =
+                exact ? 1.0
+                      : std::min(static_cast<double>(max_sample),
+                                 std::pow(n, 2.0 / 3.0)) /
+                            n;
+            stats_.kcase.add(exact ? 1 : 0);
+            draw_sample(seq, p, min_idx, local_size, min_it);
+
+            const ssize_t sample_size = sample_.size();
+            const double delta =
+                exact ? 0.0 : delta_factor * std::sqrt(sample_size);
+            // sample indices of the pivots, -1 to convert ranks to indices
+            const ssize_t left_idx =
+                static_cast<ssize_t>(std::floor(kmin * p - delta)) - 1;
+            const ssize_t right_idx =
+                static_cast<ssize_t>(std::ceil(kmax * p + delta)) - 1;
+            sLOGR << "p =" << p << "sample size" << sample_size << "delta"
+                  << delta << "pivot indices" << left_idx << right_idx;
+
+            // Compute the bounds of both pivots.  A missing pivot is an empty
+            // bound at the respective end of the range.
+            if (left_idx >= 0 && left_idx < sample_size) {
+                pivots_[0] = sample_[left_idx];
+                bounds_[0] = _detail::get_bounds<false>(
+                    seq, stats_, pivots_[0], min_idx, max_idx, min_it, max_it,
+                    comm_, short_name, debug);
+            } else {
+                stats_.pidx_oob++;
+                bounds_[0] =
+                    std::make_tuple(ssize_t{0}, ssize_t{0}, min_it, min_it);
+            }
+            if (right_idx >= 0 && right_idx < sample_size) {
+                pivots_[1] = sample_[right_idx];
+                bounds_[1] = _detail::get_bounds<false>(
+                    seq, stats_, pivots_[1], min_idx, max_idx, min_it, max_it,
+                    comm_, short_name, debug);
+            } else {
+                stats_.pidx_oob++;
+                bounds_[1] =
+                    std::make_tuple(local_size, local_size, max_it, max_it);
+            }
+            for (int i = 0; i < 2; i++) {
+                gbounds_[ubidx(i)] = bounds_[i].ub_pos;
+                gbounds_[lbidx(i)] = bounds_[i].lb_pos;
+            }
+
+            mpi::all_reduce(comm_, mpi::inplace(gbounds_.data()), 4,
+                            std::plus<>());
+
+            sLOGR << "global_size =" << global_size << "want" << kmin << "to"
+                  << kmax << "got bounds (ub,lb)" << gbounds_;
+
+            int best_ub_idx = -1, best_lb_idx = -1;
+            for (int i = 0; i < 2; i++) {
+                ssize_t global_ub = gbounds_[ubidx(i)],
+                        global_lb = gbounds_[lbidx(i)];
+                if (global_ub >= kmin && global_lb <= kmax) {
+                    // we're good, just figure out the duplicates
+                    sLOGR << "Success! Bound" << i << "is perfect:"
+                          << global_lb << "ub" << global_ub << "kmin" << kmin
+                          << "kmax" << kmax;
+                    Result result = _detail::find_eq_pos(
+                        global_ub, bounds_[i].ub_pos, bounds_[i].ub_it,
+                        global_lb, bounds_[i].lb_pos, bounds_[i].lb_it,
+                        min_idx, kmin - global_lb, comm_, debug, short_name);
+
+                    stats_.record(timer_.get());
+                    return result;
+                }
+                if (global_ub < kmin) {
+                    best_ub_idx = i;
+                }
+                if (global_lb > kmax && best_lb_idx < 0) {
+                    best_lb_idx = i;
+                }
+            }
+
+            // The pivots bracket the target rank, or at least one of them cuts
+            // off part of the range
+            ssize_t new_global_size = global_size;
+            if (best_lb_idx >= 0) {
+                // do this first, it's relative to the old min_idx
+                max_idx = min_idx + bounds_[best_lb_idx].lb_pos;
+                max_it = bounds_[best_lb_idx].lb_it;
+                ssize_t global_lb = gbounds_[lbidx(best_lb_idx)];
+                new_global_size -= (global_size - global_lb);
+            }
+            if (best_ub_idx >= 0) {
+                min_idx += bounds_[best_ub_idx].ub_pos;
+                min_it = bounds_[best_ub_idx].ub_it;
+                ssize_t global_ub = gbounds_[ubidx(best_ub_idx)];
+                kmin -= global_ub;
+                kmax -= global_ub;
+                new_global_size -= global_ub;
+            }
+            tlx_die_unless(new_global_size > 0);
+            tlx_die_unless(new_global_size <= global_size);
+
+            sLOGR << "New kmin:" << kmin << "kmax:" << kmax
+                  << "size:" << new_global_size;
+
+            // Record magnitude of size change in statistics
+            if (new_global_size == global_size)
+                stats_.size_unchanged++;
+            else if ((global_size - new_global_size) * 50 <= global_size ||
+                     (global_size - new_global_size) <= 5)
+                stats_.tinychange++;
+            global_size = new_global_size;
+
+            stats_.record(timer_.get());
+        }
+    }
+
+    // Sample every element of the local range [min_idx, min_idx + local_size)
+    // with probability p and gather the sorted sample at every PE
+    void draw_sample(const Seq &seq, const double p, const ssize_t min_idx,
+                     const ssize_t local_size, const Iterator &min_it) {
+        local_sample_.clear();
+        Iterator it = min_it;
+        if (p >= 1.0) {
+            // exact round, take every element without drawing skips
+            for (ssize_t i = 0; i < local_size; ++i, ++it) {
+                local_sample_.push_back(get_key(it));
+            }
+        } else {
+            // draw the skips in blocks of the expected sample size
+            const size_t block =
+                static_cast<size_t>(p * static_cast<double>(local_size)) +
+                skip_slack;
+            size_t next_skip = block;
+            auto skip = [&]() -> ssize_t {
+                if (next_skip == block) {
+                    rng_.generate_geometric_block(p, skips_, block);
+                    next_skip = 0;
+                }
+                return skips_[next_skip++];
+            };
+
+            ssize_t it_pos = 0, pos = skip();
+            while (pos < local_size) {
+                if (pos - it_pos <= advance_threshold) {
+                    std::advance(it, pos - it_pos);
+                } else {
+                    it = seq.find_rank(min_idx + pos);
+                }
+                it_pos = pos;
+                local_sample_.push_back(get_key(it));
+                pos += 1 + skip();
+            }
+        }
+
+        mpi::all_gather(comm_, static_cast<int>(local_sample_.size()),
+                        sample_sizes_.data());
+        mpi::all_gatherv(comm_, local_sample_, sample_, sample_sizes_);
+        std::sort(sample_.begin(), sample_.end(), Cmp());
+    }
+
+    constexpr Key get_key(const Iterator &it) {
+        return Seq::key_of_value::get(*it);
+    }
+
+    constexpr ssize_t ubidx(int i) {
+        return 2 * i;
+    }
+    constexpr ssize_t lbidx(int i) {
+        return 2 * i + 1;
+    }
+
+    mpi::communicator &comm_;
+    RNG rng_;
+    std::vector<int> skips_;
+    std::vector<Key> local_sample_, sample_;
+    std::vector<int> sample_sizes_;
+    std::vector<Key> pivots_;
+    std::vector<Bound> bounds_;
+    std::vector<ssize_t> gbounds_;
+    mutable _detail::select_stats<time> stats_;
+    mutable timer timer_;
+};
+
+} // namespace reservoir
+
+#endif // RESERVOIR_FR_SELECT_HEADER
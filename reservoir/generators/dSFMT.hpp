@@ -263,9 +263,14 @@ public:
     //! Generate `size` geometrically integers with parameter p
     template <typename int_t>
     void generate_geometric_block(double p, int_t *arr, size_t size) {
-        const double denominator = std::log(1.0 - p);
+        // next_log() draws from (0, 1], so this never takes the log of 0.
+        // Clamp to the value range of int_t for tiny p.
+        const double denominator = std::log1p(-p);
+        const double max_value =
+            static_cast<double>(std::numeric_limits<int_t>::max());
         for (size_t i = 0; i < size; ++i) {
-            arr[i] = std::log(next()) / denominator;
+            arr[i] = static_cast<int_t>(
+                std::min(next_log() / denominator, max_value));
         }
     }
 
@@ -0,0 +1,356 @@
+/*******************************************************************************
+ * reservoir/mmap_input.hpp
+ *
+ * Memory-mapped binary input files of (weight, id) items
+ *
+ * Copyright (C) 2019 Lorenz Hübschle-Schneider <lorenz@4z2.de>
+ *
+ * All rights reserved. Published under the GNU General Public License 3
+ ******************************************************************************/
+
+#pragma once
+#ifndef RESERVOIR_MMAP_INPUT_HEADER
+#define RESERVOIR_MMAP_INPUT_HEADER
+
+#include <tlx/die/core.hpp>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstddef>
+#include <cstring>
+#include <iterator>
+#include <ostream>
+#include <string>
+#include <type_traits>
+#include <utility>
+
+namespace reservoir {
+
+// Input files are flat binary files without a header, in the native byte order
+// and layout of the machine.  There are two formats for n items:
+//
+//  - records: n consecutive std::pair<double, Id>, i.e., what writing the data
+//    of a std::vector<std::pair<double, Id>> to a file produces.  Use
+//    mmap_records to read them.
+//  - columns: n doubles (the weights) followed by n Ids.  Use mmap_columns to
+//    read them.  The skips of the reservoir only read the weights, so the ids
+//    of skipped items are never touched, and only their pages are loaded.
+//
+// The number of items is determined from the file size.  Every PE maps only
+// its own part of the file: PE i of p gets the items [i*n/p, (i+1)*n/p).  The
+// mappings are read-only and advised for sequential access.  The items can be
+// passed to reservoir::insert in batches through begin() and end(), without
+// copying them into a vector first.
+
+namespace _detail {
+// A read-only mapping of the byte range [offset, offset + length) of a file,
+// which needn't be page-aligned
+class mapped_range {
+public:
+    mapped_range() : base_(nullptr), mapped_length_(0), data_(nullptr) {}
+
+    mapped_range(int fd, size_t offset, size_t length)
+        : base_(nullptr), mapped_length_(0), data_(nullptr) {
+        if (length == 0)
+            return;
+        const size_t page_size = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+        const size_t aligned = offset - offset % page_size;
+        mapped_length_ = length + (offset - aligned);
+        base_ = mmap(nullptr, mapped_length_, PROT_READ, MAP_PRIVATE, fd,
+                     static_cast<off_t>(aligned));
+        tlx_die_verbose_if(base_ == MAP_FAILED,
+                           "mmap failed: " << std::strerror(errno));
+        // only a hint, so failures don't matter
+        madvise(base_, mapped_length_, MADV_SEQUENTIAL);
+        data_ = static_cast<const char *>(base_) + (offset - aligned);
+    }
+
+    mapped_range(const mapped_range &) = delete;
+    mapped_range &operator=(const mapped_range &) = delete;
+
+    mapped_range(mapped_range &&other) noexcept
+        : base_(other.base_), mapped_length_(other.mapped_length_),
+          data_(other.data_) {
+        other.base_ = nullptr;
+        other.mapped_length_ = 0;
+        other.data_ = nullptr;
+    }
+
+    mapped_range &operator=(mapped_range &&other) noexcept {
+        std::swap(base_, other.base_);
+        std::swap(mapped_length_, other.mapped_length_);
+        std::swap(data_, other.data_);
+        return *this;
+    }
+
+    ~mapped_range() {
+        if (base_ != nullptr)
+            munmap(base_, mapped_length_);
+    }
+
+    const char *data() const {
+        return data_;
+    }
+
+private:
+    void *base_;
+    size_t mapped_length_;
+    const char *data_;
+};
+
+// An open file descriptor and the size of the file
+class input_file {
+public:
+    explicit input_file(const std::string &path)
+        : fd_(open(path.c_str(), O_RDONLY)) {
+        tlx_die_verbose_if(fd_ < 0, "Could not open " << path << ": "
+                                                       << std::strerror(errno));
+        struct stat st;
+        tlx_die_verbose_if(fstat(fd_, &st) != 0,
+                           "Could not stat " << path << ": "
+                                             << std::strerror(errno));
+        size_ = static_cast<size_t>(st.st_size);
+    }
+
+    input_file(const input_file &) = delete;
+    input_file &operator=(const input_file &) = delete;
+
+    ~input_file() {
+        close(fd_);
+    }
+
+    int fd() const {
+        return fd_;
+    }
+
+    size_t size() const {
+        return size_;
+    }
+
+private:
+    int fd_;
+    size_t size_;
+};
+
+// first item of PE `rank` when distributing `total` items over `nprocs` PEs
+inline size_t input_offset(size_t total, int rank, int nprocs) {
+    return total * static_cast<size_t>(rank) / static_cast<size_t>(nprocs);
+}
+} // namespace _detail
+
+// This PE's part of a file in the records format
+template <typename Id = int>
+class mmap_records {
+public:
+    using value_type = std::pair<double, Id>;
+    using const_iterator = const value_type *;
+
+    static_assert(std::is_trivially_copyable_v<Id>,
+                  "ids must be trivially copyable to be memory-mapped");
+
+    mmap_records(const std::string &path, int rank, int nprocs) {
+        _detail::input_file file(path);
+        tlx_die_verbose_unless(file.size() % sizeof(value_type) == 0,
+                               "Size of " << path << " is not a multiple of "
+                                          << sizeof(value_type));
+        total_size_ = file.size() / sizeof(value_type);
+        const size_t first = _detail::input_offset(total_size_, rank, nprocs);
+        size_ = _detail::input_offset(total_size_, rank + 1, nprocs) - first;
+        range_ = _detail::mapped_range(file.fd(), first * sizeof(value_type),
+                                       size_ * sizeof(value_type));
+    }
+
+    // number of items of this PE
+    size_t size() const {
+        return size_;
+    }
+
+    // number of items in the file
+    size_t total_size() const {
+        return total_size_;
+    }
+
+    const_iterator begin() const {
+        return reinterpret_cast<const_iterator>(range_.data());
+    }
+
+    const_iterator end() const {
+        return begin() + size_;
+    }
+
+private:
+    _detail::mapped_range range_;
+    size_t size_, total_size_;
+};
+
+// This PE's part of a file in the columns format.  Its iterators dereference to
+// proxies that only read the weight or the id when it is accessed.
+template <typename Id = int>
+class mmap_columns {
+public:
+    using value_type = std::pair<double, Id>;
+
+    static_assert(std::is_trivially_copyable_v<Id>,
+                  "ids must be trivially copyable to be memory-mapped");
+
+    // An item, referring to its weight and id in the mapped columns
+    struct reference {
+        const double &first;
+        const Id &second;
+
+        operator value_type() const {
+            return value_type(first, second);
+        }
+
+        friend std::ostream &operator<<(std::ostream &os,
+                                        const reference &ref) {
+            return os << '(' << ref.first << ',' << ref.second << ')';
+        }
+    };
+
+    class const_iterator {
+    public:
+        using iterator_category = std::random_access_iterator_tag;
+        using value_type = typename mmap_columns::value_type;
+        using difference_type = std::ptrdiff_t;
+        using reference = typename mmap_columns::reference;
+
+        // makes it->first work with the proxy reference
+        struct pointer {
+            reference ref;
+            const reference *operator->() const {
+                return &ref;
+            }
+        };
+
+        const_iterator() : weight_(nullptr), id_(nullptr) {}
+        const_iterator(const double *weight, const Id *id)
+            : weight_(weight), id_(id) {}
+
+        reference operator*() const {
+            return reference{*weight_, *id_};
+        }
+        pointer operator->() const {
+            return pointer{**this};
+        }
+        reference operator[](difference_type n) const {
+            return *(*this + n);
+        }
+
+        const_iterator &operator++() {
+            ++weight_, ++id_;
+            return *this;
+        }
+        const_iterator operator++(int) {
+            const_iterator tmp = *this;
+            ++*this;
+            return tmp;
+        }
+        const_iterator &operator--() {
+            --weight_, --id_;
+            return *this;
+        }
+        const_iterator operator--(int) {
+            const_iterator tmp = *this;
+            --*this;
+            return tmp;
+        }
+        const_iterator &operator+=(difference_type n) {
+            weight_ += n, id_ += n;
+            return *this;
+        }
+        const_iterator &operator-=(difference_type n) {
+            weight_ -= n, id_ -= n;
+            return *this;
+        }
+        friend const_iterator operator+(const_iterator it, difference_type n) {
+            return it += n;
+        }
+        friend const_iterator operator+(difference_type n, const_iterator it) {
+            return it += n;
+        }
+        friend const_iterator operator-(const_iterator it, difference_type n) {
+            return it -= n;
+        }
+        friend difference_type operator-(const const_iterator &a,
+                                         const const_iterator &b) {
+            return a.weight_ - b.weight_;
+        }
+
+        friend bool operator==(const const_iterator &a,
+                               const const_iterator &b) {
+            return a.weight_ == b.weight_;
+        }
+        friend bool operator!=(const const_iterator &a,
+                               const const_iterator &b) {
+            return a.weight_ != b.weight_;
+        }
+        friend bool operator<(const const_iterator &a,
+                              const const_iterator &b) {
+            return a.weight_ < b.weight_;
+        }
+        friend bool operator>(const const_iterator &a,
+                              const const_iterator &b) {
+            return a.weight_ > b.weight_;
+        }
+        friend bool operator<=(const const_iterator &a,
+                               const const_iterator &b) {
+            return a.weight_ <= b.weight_;
+        }
+        friend bool operator>=(const const_iterator &a,
+                               const const_iterator &b) {
+            return a.weight_ >= b.weight_;
+        }
+
+    private:
+        const double *weight_;
+        const Id *id_;
+    };
+
+    mmap_columns(const std::string &path, int rank, int nprocs) {
+        _detail::input_file file(path);
+        constexpr size_t item_size = sizeof(double) + sizeof(Id);
+        tlx_die_verbose_unless(file.size() % item_size == 0,
+                               "Size of " << path << " is not a multiple of "
+                                          << item_size);
+        total_size_ = file.size() / item_size;
+        const size_t first = _detail::input_offset(total_size_, rank, nprocs);
+        size_ = _detail::input_offset(total_size_, rank + 1, nprocs) - first;
+        weights_ = _detail::mapped_range(file.fd(), first * sizeof(double),
+                                         size_ * sizeof(double));
+        ids_ = _detail::mapped_range(
+            file.fd(), total_size_ * sizeof(double) + first * sizeof(Id),
+            size_ * sizeof(Id));
+    }
+
+    // number of items of this PE
+    size_t size() const {
+        return size_;
+    }
+
+    // number of items in the file
+    size_t total_size() const {
+        return total_size_;
+    }
+
+    const_iterator begin() const {
+        return const_iterator(reinterpret_cast<const double *>(weights_.data()),
+                              reinterpret_cast<const Id *>(ids_.data()));
+    }
+
+    const_iterator end() const {
+        return begin() + static_cast<std::ptrdiff_t>(size_);
+    }
+
+private:
+    _detail::mapped_range weights_, ids_;
+    size_t size_, total_size_;
+};
+
+} // namespace reservoir
+
+#endif // RESERVOIR_MMAP_INPUT_HEADER
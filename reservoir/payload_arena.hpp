@@ -0,0 +1,97 @@
+/*******************************************************************************
+ * reservoir/payload_arena.hpp
+ *
+ * Append-only storage for reservoir payloads, referenced by 32-bit handles
+ *
+ * Copyright (C) 2019 Lorenz Hübschle-Schneider <lorenz@4z2.de>
+ *
+ * All rights reserved. Published under the GNU General Public License 3
+ ******************************************************************************/
+
+#pragma once
+#ifndef RESERVOIR_PAYLOAD_ARENA_HEADER
+#define RESERVOIR_PAYLOAD_ARENA_HEADER
+
+#include <reservoir/util.hpp>
+
+#include <tlx/die/core.hpp>
+
+#include <cstdint>
+#include <limits>
+#include <utility>
+#include <vector>
+
+namespace reservoir {
+
+// Storage for large payloads, so that a B-tree only needs to store (key,
+// handle) pairs instead of whole items.  This keeps the leaves of the tree
+// small and cache-resident, and splitAt and insertions don't move payload
+// bytes around.
+//
+// Payloads are only ever appended, and removing entries from the tree leaves
+// dead payloads behind.  They are reclaimed by compact(), which copies the
+// live payloads to a new arena in the order of the tree and rewrites the
+// handles in the tree.  Call it once the arena has grown to a multiple of the
+// tree size to keep the amortized cost per insertion constant.
+template <typename T>
+class payload_arena {
+public:
+    using value_type = T;
+    using handle_type = uint32_t;
+
+    // Append a payload, returns its handle
+    handle_type add(const T &item) {
+        tlx_die_unless(items_.size() <
+                       std::numeric_limits<handle_type>::max());
+        items_.push_back(item);
+        return static_cast<handle_type>(items_.size() - 1);
+    }
+
+    handle_type add(T &&item) {
+        tlx_die_unless(items_.size() <
+                       std::numeric_limits<handle_type>::max());
+        items_.push_back(std::move(item));
+        return static_cast<handle_type>(items_.size() - 1);
+    }
+
+    T &operator[](handle_type handle) {
+        my_assert(handle < items_.size());
+        return items_[handle];
+    }
+
+    const T &operator[](handle_type handle) const {
+        my_assert(handle < items_.size());
+        return items_[handle];
+    }
+
+    // number of payloads, including dead ones
+    size_t size() const {
+        return items_.size();
+    }
+
+    void clear() {
+        items_.clear();
+    }
+
+    // Discard all payloads that aren't referenced by `tree`, a B-tree map
+    // whose mapped values are handles into this arena
+    template <typename Tree>
+    void compact(Tree &tree) {
+        compacted_.clear();
+        compacted_.reserve(tree.size());
+        for (auto it = tree.begin(); it != tree.end(); ++it) {
+            compacted_.push_back(std::move(items_[it->second]));
+            it->second = static_cast<handle_type>(compacted_.size() - 1);
+        }
+        // keep both buffers' capacity for the next compaction
+        std::swap(items_, compacted_);
+        compacted_.clear();
+    }
+
+private:
+    std::vector<T> items_, compacted_;
+};
+
+} // namespace reservoir
+
+#endif // RESERVOIR_PAYLOAD_ARENA_HEADER
@@ -0,0 +1,503 @@
+/*******************************************************************************
+ * reservoir/quantiles.hpp
+ *
+ * Distributed selection of many ranks at once, and quantile queries
+ *
+ * Copyright (C) 2019 Lorenz Hübschle-Schneider <lorenz@4z2.de>
+ *
+ * All rights reserved. Published under the GNU General Public License 3
+ ******************************************************************************/
+
+#pragma once
+#ifndef RESERVOIR_QUANTILES_HEADER
+#define RESERVOIR_QUANTILES_HEADER
+
+#include <reservoir/aggregate.hpp>
+#include <reservoir/generators/select.hpp>
+#include <reservoir/logger.hpp>
+#include <reservoir/select_helpers.hpp>
+#include <reservoir/timer.hpp>
+#include <reservoir/util.hpp>
+
+#include <tlx/die/core.hpp>
+#include <tlx/math/aggregate.hpp>
+
+#include <boost/mpi.hpp>
+#include <boost/mpi/collectives/all_gatherv.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <functional>
+#include <limits>
+#include <ostream>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+namespace mpi = boost::mpi;
+
+namespace reservoir {
+
+// Select the k_i globally smallest elements for many ranks k_1, ..., k_m at
+// once.  This uses the sampling approach of fr_select for every target rank,
+// but all targets share the collectives of a level: the samples of all targets
+// are gathered with one all_gatherv, the bounds of all pivots are summed with
+// one all_reduce, and duplicate pivots are resolved with one scan.  In the
+// first level, all targets share the same range and thus a single sample.
+template <typename Seq, size_t max_sample = (1 << 14),
+          typename RNG = generators::select_t>
+class multi_select {
+public:
+    static constexpr const char *short_name = "[mqs]";
+    static const std::string name() {
+        return "multi-select";
+    }
+
+    using Iterator = typename Seq::const_iterator;
+    using Cmp = typename Seq::key_compare;
+    using Key = typename Seq::key_type;
+    using Elem = typename Seq::value_type;
+
+    // pair of iterator and local rank
+    using Result = std::pair<Iterator, ssize_t>;
+
+    // Upper/lower bound iterator and an index
+    struct Bound {
+        ssize_t ub_pos, lb_pos;
+        Iterator ub_it, lb_it;
+
+        Bound() = default;
+        Bound(const std::tuple<ssize_t, ssize_t, Iterator, Iterator> &tup) {
+            std::tie(ub_pos, lb_pos, ub_it, lb_it) = tup;
+        }
+    };
+
+    static constexpr bool debug = false;
+    static constexpr bool check = false;
+    static constexpr bool time = true;
+
+    // number of standard deviations of the sample rank between target rank
+    // and pivot, see fr_select
+    static constexpr double delta_factor = 2.5;
+    // lower limit on the per-target sample size when many targets share the
+    // sample budget of max_sample
+    static constexpr size_t min_sample = 64;
+    // below this distance, advance iterators instead of descending the tree
+    static constexpr ssize_t advance_threshold = 16;
+    // skips drawn in addition to the expected number of sampled elements
+    static constexpr size_t skip_slack = 16;
+
+    // Construct a selector using a given communicator and seed.  The seed must
+    // be different on every PE (member of the communicator)!
+    multi_select(mpi::communicator &comm, size_t seed)
+        : comm_(comm), rng_(seed) {
+        // two pivots per target
+        stats_.norm_factor = 2;
+    }
+
+    // For every rank k = ks[i], find the local split position such that the
+    // elements before it on all PEs are exactly the k globally smallest.  The
+    // ranks may be given in any order, results are in the same order.
+    std::vector<Result> operator()(const Seq &seq,
+                                   const std::vector<size_t> &ks) {
+        timer total_timer;
+
+        if constexpr (check) {
+            seq.verify();
+        }
+
+        // calculate global size
+        size_t size = seq.size();
+        mpi::all_reduce(comm_, mpi::inplace(size), std::plus<>());
+        sLOGR << "Selecting" << ks.size() << "ranks out of" << size << "with"
+              << comm_.size() << "PEs";
+
+        targets_.resize(ks.size());
+        for (size_t i = 0; i < ks.size(); i++) {
+            tlx_die_verbose_unless(ks[i] <= size,
+                                   "Cannot select " << ks[i]
+                                                    << " smallest out of "
+                                                    << size << " items");
+            Target &t = targets_[i];
+            t.k = static_cast<ssize_t>(ks[i]);
+            t.min_idx = 0;
+            t.max_idx = seq.size();
+            t.global_size = size;
+            t.min_it = seq.begin();
+            t.max_it = seq.end();
+            t.result = std::make_pair(seq.begin(), 0);
+            t.done = (t.k == 0);
+        }
+
+        // in the first level, all targets share the whole range
+        bool shared = true;
+        while (select_level(seq, shared)) {
+            shared = false;
+        }
+
+        std::vector<Result> results(ks.size());
+        for (size_t i = 0; i < ks.size(); i++) {
+            results[i] = targets_[i].result;
+        }
+
+        if constexpr (check) {
+            std::vector<ssize_t> sizes(ks.size());
+            for (size_t i = 0; i < ks.size(); i++) {
+                sizes[i] = results[i].second;
+                tlx_die_unless(seq.find_rank(sizes[i]) == results[i].first);
+            }
+            mpi::all_reduce(comm_, mpi::inplace(sizes.data()),
+                            static_cast<int>(sizes.size()), std::plus<>());
+            for (size_t i = 0; i < ks.size(); i++) {
+                tlx_die_verbose_unless(sizes[i] == static_cast<ssize_t>(ks[i]),
+                                       "Expected " << ks[i] << " got "
+                                                   << sizes[i]);
+            }
+        }
+
+        stats_.record_total(total_timer.get());
+        stats_.reset_level();
+        pLOGC(time && debug) << "stats: " << stats_;
+        return results;
+    }
+
+    _detail::select_stats<time> &get_stats() {
+        return stats_;
+    }
+
+protected:
+    struct Target {
+        // rank within the range, global size of the range
+        ssize_t k, global_size;
+        // local range
+        ssize_t min_idx, max_idx;
+        Iterator min_it, max_it;
+        bool done;
+        Result result;
+    };
+
+    // Perform one level for all targets that aren't done yet.  Returns whether
+    // there were any such targets.
+    bool select_level(const Seq &seq, const bool shared) {
+        active_.clear();
+        for (size_t i = 0; i < targets_.size(); i++) {
+            if (!targets_[i].done)
+                active_.push_back(i);
+        }
+        if (active_.empty()) {
+            return false;
+        }
+
+        stats_.next_level(); // debug timings
+        timer_.reset();
+        const size_t num_active = active_.size();
+        sLOGR << "level" << stats_.level << "with" << num_active
+              << "active targets";
+
+        // Step 1: sample the range of each target, or the shared range
+        const size_t num_ranges = shared ? 1 : num_active;
+        const size_t budget =
+            shared ? max_sample : std::max(min_sample, max_sample / num_active);
+        range_p_.resize(num_ranges);
+        range_exact_.resize(num_ranges);
+        local_counts_.resize(num_ranges);
+        local_sample_.clear();
+        for (size_t r = 0; r < num_ranges; r++) {
+            const Target &t = targets_[active_[r]];
+            range_exact_[r] = t.global_size <= static_cast<ssize_t>(budget);
+            const double n = static_cast<double>(t.global_size);
+            range_p_[r] = range_exact_[r]
+                              ? 1.0
+                              : std::min(static_cast<double>(budget),
+                                         std::pow(n, 2.0 / 3.0)) /
+                                    n;
+            stats_.kcase.add(range_exact_[r] ? 1 : 0);
+
+            size_t before = local_sample_.size();
+            draw_sample(seq, range_p_[r], t.min_idx, t.max_idx - t.min_idx,
+                        t.min_it);
+            local_counts_[r] = static_cast<int>(local_sample_.size() - before);
+        }
+        gather_samples(num_ranges);
+
+        // Step 2: choose two pivots per target and compute their bounds
+        bounds_.resize(2 * num_active);
+        gbounds_.resize(4 * num_active);
+        for (size_t j = 0; j < num_active; j++) {
+            const Target &t = targets_[active_[j]];
+            const size_t r = shared ? 0 : j;
+            const std::vector<Key> &sample = samples_[r];
+            const ssize_t sample_size = sample.size();
+            const double p = range_p_[r];
+            const double delta =
+                range_exact_[r] ? 0.0 : delta_factor * std::sqrt(sample_size);
+            // sample indices of the pivots, -1 to convert ranks to indices
+            const ssize_t idx[2] = {
+                static_cast<ssize_t>(std::floor(t.k * p - delta)) - 1,
+                static_cast<ssize_t>(std::ceil(t.k * p + delta)) - 1};
+            const ssize_t local_size = t.max_idx - t.min_idx;
+
+            for (int i = 0; i < 2; i++) {
+                Bound &bound = bounds_[2 * j + i];
+                if (idx[i] >= 0 && idx[i] < sample_size) {
+                    bound = _detail::get_bounds<false>(
+                        seq, stats_, sample[idx[i]], t.min_idx, t.max_idx,
+                        t.min_it, t.max_it, comm_, short_name, debug);
+                } else if (i == 0) {
+                    // no left pivot, empty bound at the beginning
+                    stats_.pidx_oob++;
+                    bound = std::make_tuple(ssize_t{0}, ssize_t{0}, t.min_it,
+                                            t.min_it);
+                } else {
+                    // no right pivot, empty bound at the end
+                    stats_.pidx_oob++;
+                    bound = std::make_tuple(local_size, local_size, t.max_it,
+                                            t.max_it);
+                }
+                gbounds_[4 * j + 2 * i] = bound.ub_pos;
+                gbounds_[4 * j + 2 * i + 1] = bound.lb_pos;
+            }
+        }
+
+        mpi::all_reduce(comm_, mpi::inplace(gbounds_.data()),
+                        static_cast<int>(4 * num_active), std::plus<>());
+
+        // Step 3: finish targets whose pivot has the right rank, narrow the
+        // range of all others
+        eq_targets_.clear();
+        eq_counts_.clear();
+        for (size_t j = 0; j < num_active; j++) {
+            Target &t = targets_[active_[j]];
+            int best_ub_idx = -1, best_lb_idx = -1;
+            for (int i = 0; i < 2; i++) {
+                const Bound &bound = bounds_[2 * j + i];
+                ssize_t global_ub = gbounds_[4 * j + 2 * i],
+                        global_lb = gbounds_[4 * j + 2 * i + 1];
+                if (global_ub >= t.k && global_lb <= t.k) {
+                    sLOGR << "Target" << active_[j] << "done with bound" << i
+                          << "lb" << global_lb << "ub" << global_ub << "k"
+                          << t.k;
+                    t.done = true;
+                    if (global_lb + 1 >= global_ub) {
+                        // pivot is unique, result is its lower or upper bound
+                        t.result =
+                            (t.k - global_lb <= 0)
+                                ? std::make_pair(bound.lb_it,
+                                                 t.min_idx + bound.lb_pos)
+                                : std::make_pair(bound.ub_it,
+                                                 t.min_idx + bound.ub_pos);
+                    } else {
+                        // figure out the duplicates below, together with
+                        // those of the other targets
+                        eq_targets_.emplace_back(j, i);
+                        eq_counts_.push_back(bound.ub_pos - bound.lb_pos);
+                    }
+                    break;
+                }
+                if (global_ub < t.k) {
+                    best_ub_idx = i;
+                }
+                if (global_lb > t.k && best_lb_idx < 0) {
+                    best_lb_idx = i;
+                }
+            }
+            if (t.done)
+                continue;
+
+            ssize_t new_global_size = t.global_size;
+            if (best_lb_idx >= 0) {
+                // do this first, it's relative to the old min_idx
+                const Bound &bound = bounds_[2 * j + best_lb_idx];
+                t.max_idx = t.min_idx + bound.lb_pos;
+                t.max_it = bound.lb_it;
+                ssize_t global_lb = gbounds_[4 * j + 2 * best_lb_idx + 1];
+                new_global_size -= (t.global_size - global_lb);
+            }
+            if (best_ub_idx >= 0) {
+                const Bound &bound = bounds_[2 * j + best_ub_idx];
+                t.min_idx += bound.ub_pos;
+                t.min_it = bound.ub_it;
+                ssize_t global_ub = gbounds_[4 * j + 2 * best_ub_idx];
+                t.k -= global_ub;
+                new_global_size -= global_ub;
+            }
+            tlx_die_unless(new_global_size > 0);
+            tlx_die_unless(new_global_size <= t.global_size);
+            if (new_global_size == t.global_size)
+                stats_.size_unchanged++;
+            t.global_size = new_global_size;
+        }
+
+        // Step 4: distribute the duplicates of non-unique pivots
+        if (!eq_targets_.empty()) {
+            eq_prefsums_.resize(eq_counts_.size());
+            // MPI_Scan is an inclusive prefix sum
+            mpi::scan(comm_, eq_counts_.data(),
+                      static_cast<int>(eq_counts_.size()), eq_prefsums_.data(),
+                      std::plus<>());
+            for (size_t e = 0; e < eq_targets_.size(); e++) {
+                auto [j, i] = eq_targets_[e];
+                Target &t = targets_[active_[j]];
+                const Bound &bound = bounds_[2 * j + i];
+                ssize_t global_lb = gbounds_[4 * j + 2 * i + 1];
+                t.result = _detail::split_eq_range(
+                    bound.ub_pos, bound.ub_it, bound.lb_pos, bound.lb_it,
+                    t.min_idx, t.k - global_lb, eq_prefsums_[e]);
+            }
+        }
+
+        stats_.record(timer_.get());
+        return true;
+    }
+
+    // Sample every element of the local range [min_idx, min_idx + local_size)
+    // with probability p and append the sample to local_sample_
+    void draw_sample(const Seq &seq, const double p, const ssize_t min_idx,
+                     const ssize_t local_size, const Iterator &min_it) {
+        Iterator it = min_it;
+        if (p >= 1.0) {
+            // exact round, take every element without drawing skips
+            for (ssize_t i = 0; i < local_size; ++i, ++it) {
+                local_sample_.push_back(get_key(it));
+            }
+        } else {
+            // draw the skips in blocks of the expected sample size
+            const size_t block =
+                static_cast<size_t>(p * static_cast<double>(local_size)) +
+                skip_slack;
+            size_t next_skip = block;
+            auto skip = [&]() -> ssize_t {
+                if (next_skip == block) {
+                    rng_.generate_geometric_block(p, skips_, block);
+                    next_skip = 0;
+                }
+                return skips_[next_skip++];
+            };
+
+            ssize_t it_pos = 0, pos = skip();
+            while (pos < local_size) {
+                if (pos - it_pos <= advance_threshold) {
+                    std::advance(it, pos - it_pos);
+                } else {
+                    it = seq.find_rank(min_idx + pos);
+                }
+                it_pos = pos;
+                local_sample_.push_back(get_key(it));
+                pos += 1 + skip();
+            }
+        }
+    }
+
+    // Gather the samples of all ranges at every PE, and sort them by range
+    void gather_samples(const size_t num_ranges) {
+        const int nprocs = comm_.size();
+        all_counts_.resize(num_ranges * nprocs);
+        mpi::all_gather(comm_, local_counts_.data(),
+                        static_cast<int>(num_ranges), all_counts_.data());
+        pe_sizes_.assign(nprocs, 0);
+        for (int pe = 0; pe < nprocs; pe++) {
+            for (size_t r = 0; r < num_ranges; r++) {
+                pe_sizes_[pe] += all_counts_[pe * num_ranges + r];
+            }
+        }
+        mpi::all_gatherv(comm_, local_sample_, sample_, pe_sizes_);
+
+        samples_.resize(num_ranges);
+        for (auto &sample : samples_)
+            sample.clear();
+        auto it = sample_.begin();
+        for (int pe = 0; pe < nprocs; pe++) {
+            for (size_t r = 0; r < num_ranges; r++) {
+                auto end = it + all_counts_[pe * num_ranges + r];
+                samples_[r].insert(samples_[r].end(), it, end);
+                it = end;
+            }
+        }
+        for (auto &sample : samples_)
+            std::sort(sample.begin(), sample.end(), Cmp());
+    }
+
+    constexpr Key get_key(const Iterator &it) {
+        return Seq::key_of_value::get(*it);
+    }
+
+    mpi::communicator &comm_;
+    RNG rng_;
+    std::vector<int> skips_;
+    std::vector<Target> targets_;
+    std::vector<size_t> active_;
+    std::vector<double> range_p_;
+    std::vector<bool> range_exact_;
+    std::vector<int> local_counts_, all_counts_, pe_sizes_;
+    std::vector<Key> local_sample_, sample_;
+    std::vector<std::vector<Key>> samples_;
+    std::vector<Bound> bounds_;
+    std::vector<ssize_t> gbounds_, eq_counts_, eq_prefsums_;
+    std::vector<std::pair<size_t, int>> eq_targets_;
+    mutable _detail::select_stats<time> stats_;
+    mutable timer timer_;
+};
+
+
+// Result of a distributed quantile query
+template <typename Seq>
+struct quantile_result {
+    // global rank (1-based) of the quantile
+    size_t rank;
+    // the quantile, i.e., the key of the element with this rank (same on all
+    // PEs)
+    typename Seq::key_type key;
+    // local split position: the elements before `it` on all PEs are exactly
+    // the `rank` globally smallest, i.e., the top-k for k = rank
+    typename Seq::const_iterator it;
+    ssize_t local_rank;
+};
+
+// Compute the quantiles qs (each in [0, 1]) of the keys of sequences
+// distributed over all PEs of the communicator.  Uses the nearest-rank
+// definition, i.e., the q-quantile of n elements is the element with rank
+// max(1, ceil(q * n)).  All targets are selected together, see multi_select.
+// The seed must be different on every PE!
+template <typename Seq>
+std::vector<quantile_result<Seq>>
+distributed_quantiles(const Seq &seq, const std::vector<double> &qs,
+                      mpi::communicator &comm, size_t seed) {
+    using Key = typename Seq::key_type;
+
+    size_t size = seq.size();
+    mpi::all_reduce(comm, mpi::inplace(size), std::plus<>());
+    tlx_die_verbose_unless(size > 0, "Cannot compute quantiles of nothing");
+
+    std::vector<size_t> ranks(qs.size());
+    for (size_t i = 0; i < qs.size(); i++) {
+        tlx_die_verbose_unless(0.0 <= qs[i] && qs[i] <= 1.0,
+                               "Invalid quantile " << qs[i]);
+        double rank = std::ceil(qs[i] * static_cast<double>(size));
+        ranks[i] = std::clamp<size_t>(static_cast<size_t>(rank), 1, size);
+    }
+
+    multi_select<Seq> select(comm, seed);
+    auto splits = select(seq, ranks);
+
+    // The quantile is the largest selected key.  The ranks are at least 1, so
+    // some PE selected an element.  PEs that selected none locally contribute
+    // lowest(), the identity of the maximum.
+    std::vector<Key> keys(qs.size(), std::numeric_limits<Key>::lowest());
+    for (size_t i = 0; i < qs.size(); i++) {
+        if (splits[i].second > 0) {
+            keys[i] = Seq::key_of_value::get(*std::prev(splits[i].first));
+        }
+    }
+    mpi::all_reduce(comm, mpi::inplace(keys.data()),
+                    static_cast<int>(keys.size()), mpi::maximum<Key>());
+
+    std::vector<quantile_result<Seq>> result(qs.size());
+    for (size_t i = 0; i < qs.size(); i++) {
+        result[i] = {ranks[i], keys[i], splits[i].first, splits[i].second};
+    }
+    return result;
+}
+
+} // namespace reservoir
+
+#endif // RESERVOIR_QUANTILES_HEADER
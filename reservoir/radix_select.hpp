@@ -0,0 +1,148 @@
+/*******************************************************************************
+ * reservoir/radix_select.hpp
+ *
+ * Sequential MSB radix selection on order-preserving key bits
+ *
+ * Copyright (C) 2019 Lorenz Hübschle-Schneider <lorenz@4z2.de>
+ *
+ * All rights reserved. Published under the GNU General Public License 3
+ ******************************************************************************/
+
+#pragma once
+#ifndef RESERVOIR_RADIX_SELECT_HEADER
+#define RESERVOIR_RADIX_SELECT_HEADER
+
+#include <reservoir/util.hpp>
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace reservoir {
+
+// Bit pattern of a double.  For non-negative doubles x and y, x < y if and only
+// if double_bits(x) < double_bits(y).
+inline uint64_t double_bits(double x) {
+    my_assert(!std::signbit(x));
+    uint64_t bits;
+    std::memcpy(&bits, &x, sizeof(bits));
+    return bits;
+}
+
+// Keep only the k items of `items` with the smallest keys, in arbitrary order
+// except that one with the largest key among them is at position k-1 (as with
+// std::nth_element on k-1 followed by a resize to k).  `get_bits` maps an item
+// to an unsigned integer whose order is that of the keys, see double_bits.
+//
+// Every pass builds a histogram of the next `radix_bits` bits of the remaining
+// candidates, moves the items of the buckets below the target rank to the
+// front of `items` and keeps only the bucket containing the target rank as
+// candidates in `tmp`.  `tmp` is scratch space that is only ever grown, pass
+// the same vector every time to avoid allocations.
+template <int radix_bits = 8, typename T, typename GetBits>
+void radix_select(std::vector<T> &items, size_t k, std::vector<T> &tmp,
+                  GetBits &&get_bits) {
+    using bits_t = std::decay_t<std::invoke_result_t<GetBits, const T &>>;
+    static_assert(std::is_unsigned_v<bits_t>, "key bits must be unsigned");
+    constexpr int num_bits = 8 * sizeof(bits_t);
+    constexpr size_t num_buckets = size_t{1} << radix_bits;
+    // finish with std::nth_element below this number of candidates
+    constexpr size_t base_case_size = 64;
+
+    auto bits_less = [&](const T &a, const T &b) {
+        return get_bits(a) < get_bits(b);
+    };
+    auto move_to = [](T &from, T &to) {
+        if (&from != &to)
+            to = std::move(from);
+    };
+
+    if (k == 0) {
+        items.clear();
+        return;
+    }
+    if (k >= items.size()) {
+        // nothing to discard, only move the largest item to the end
+        auto max_it = std::max_element(items.begin(), items.end(), bits_less);
+        if (max_it != items.end())
+            std::iter_swap(max_it, items.end() - 1);
+        return;
+    }
+
+    // items[0, selected) are definitely part of the result, src[0, n) are the
+    // remaining candidates
+    T *src = items.data();
+    size_t n = items.size(), selected = 0;
+    std::array<size_t, num_buckets> hist;
+    for (int shift = num_bits - radix_bits;
+         n > base_case_size && shift + radix_bits > 0; shift -= radix_bits) {
+        // the last digit may overlap the previous one if radix_bits doesn't
+        // divide num_bits, which is harmless
+        const int s = std::max(shift, 0);
+        auto digit = [&](const T &item) {
+            return static_cast<size_t>(get_bits(item) >> s) &
+                   (num_buckets - 1);
+        };
+
+        hist.fill(0);
+        for (size_t i = 0; i < n; i++) {
+            hist[digit(src[i])]++;
+        }
+        // find the bucket containing the target rank
+        const size_t want = k - selected;
+        size_t below = 0, bucket = 0;
+        while (below + hist[bucket] < want) {
+            below += hist[bucket++];
+        }
+        if (hist[bucket] == n) {
+            // all candidates share this digit, nothing to move
+            continue;
+        }
+
+        if (tmp.size() < hist[bucket])
+            tmp.resize(hist[bucket]);
+        // Both writes trail the read position: items are only ever moved to
+        // the front of `items` or of `tmp`.  They may coincide with it, which
+        // must not turn into a self-move.
+        T *dst = tmp.data();
+        size_t num_candidates = 0;
+        for (size_t i = 0; i < n; i++) {
+            const size_t d = digit(src[i]);
+            if (d < bucket) {
+                move_to(src[i], items[selected++]);
+            } else if (d == bucket) {
+                move_to(src[i], dst[num_candidates++]);
+            }
+        }
+        src = dst;
+        n = num_candidates;
+        if (below + n == want) {
+            // the whole bucket is part of the result
+            break;
+        }
+    }
+
+    // take the `want` smallest of the remaining candidates
+    const size_t want = k - selected;
+    T *max_ptr;
+    if (n > want) {
+        std::nth_element(src, src + want - 1, src + n, bits_less);
+        max_ptr = src + want - 1;
+    } else {
+        max_ptr = std::max_element(src, src + n, bits_less);
+    }
+    std::iter_swap(max_ptr, src + want - 1);
+    if (src != items.data() + selected) {
+        std::move(src, src + want, items.begin() + selected);
+    }
+    items.resize(k);
+}
+
+} // namespace reservoir
+
+#endif // RESERVOIR_RADIX_SELECT_HEADER
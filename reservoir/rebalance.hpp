@@ -0,0 +1,219 @@
+/*******************************************************************************
+ * reservoir/rebalance.hpp
+ *
+ * Load balancing of distributed B-trees by migrating sorted key ranges
+ *
+ * Copyright (C) 2019 Lorenz Hübschle-Schneider <lorenz@4z2.de>
+ *
+ * All rights reserved. Published under the GNU General Public License 3
+ ******************************************************************************/
+
+#pragma once
+#ifndef RESERVOIR_REBALANCE_HEADER
+#define RESERVOIR_REBALANCE_HEADER
+
+#include <reservoir/logger.hpp>
+#include <reservoir/util.hpp>
+
+#include <tlx/die/core.hpp>
+
+#include <boost/mpi.hpp>
+#include <boost/serialization/utility.hpp>
+
+#include <algorithm>
+#include <functional>
+#include <iterator>
+#include <utility>
+#include <vector>
+
+namespace mpi = boost::mpi;
+
+namespace reservoir {
+
+namespace _detail {
+// number of elements that PE `pe` should hold when `total` elements are
+// distributed evenly over `nprocs` PEs
+inline size_t balanced_size(int pe, size_t total, int nprocs) {
+    const size_t p = static_cast<size_t>(nprocs);
+    return total / p + (static_cast<size_t>(pe) < total % p ? 1 : 0);
+}
+
+// Compute which PEs need to send how many elements to which other PEs so that
+// the local sizes `sizes` become balanced.  The surpluses of the PEs are
+// matched to their deficits greedily in rank order, and the (peer, count)
+// pairs that involve PE `rank` are stored in `plan`, sorted by peer.  A PE
+// either sends or receives, never both.
+inline void balance_plan(const std::vector<size_t> &sizes, int rank,
+                         std::vector<std::pair<int, size_t>> &plan) {
+    const int nprocs = static_cast<int>(sizes.size());
+    size_t total = 0;
+    for (size_t size : sizes) {
+        total += size;
+    }
+    auto target = [&](int pe) { return balanced_size(pe, total, nprocs); };
+
+    plan.clear();
+    int sender = 0, receiver = 0;
+    size_t have = 0, need = 0;
+    while (true) {
+        while (have == 0 && sender < nprocs) {
+            if (sizes[sender] > target(sender))
+                have = sizes[sender] - target(sender);
+            else
+                sender++;
+        }
+        while (need == 0 && receiver < nprocs) {
+            if (sizes[receiver] < target(receiver))
+                need = target(receiver) - sizes[receiver];
+            else
+                receiver++;
+        }
+        if (sender >= nprocs || receiver >= nprocs)
+            break;
+
+        const size_t count = std::min(have, need);
+        if (sender == rank)
+            plan.emplace_back(receiver, count);
+        else if (receiver == rank)
+            plan.emplace_back(sender, count);
+        have -= count;
+        need -= count;
+        if (have == 0)
+            sender++;
+        if (need == 0)
+            receiver++;
+    }
+}
+} // namespace _detail
+
+// Rebalance a sequence that is distributed over the PEs of a communicator as
+// one B-tree per PE, such that every PE holds the same number of elements (up
+// to rounding).  The union of the trees stays the same, so this doesn't change
+// the distributed sample of the reservoir, or the result of a selection.
+//
+// PEs with more elements than the average split off their largest elements
+// with splitAt and send them as contiguous sorted ranges to the PEs with fewer
+// elements, assigned greedily in order of PE rank.  The receivers merge the
+// received ranges with their own elements and bulk_load a new tree.  Every PE
+// sends or receives, but never both, and the plan is computed from the
+// all-gathered local sizes at every PE, so only the elements need to move.
+template <typename Tree>
+class rebalancer {
+public:
+    static constexpr const char *short_name = "[reb]";
+    static constexpr bool debug = false;
+
+    using value_type = typename Tree::value_type;
+
+    // Rebalance whenever the largest local size exceeds the average by more
+    // than a factor of `factor` (> 1).  A factor of 0 disables rebalancing.
+    // The factor must be the same on all PEs.  Receivers rebuild their tree
+    // with `num_threads` threads.
+    rebalancer(mpi::communicator &comm, double factor, size_t num_threads = 1)
+        : comm_(comm), factor_(factor), num_threads_(num_threads) {
+        tlx_die_verbose_unless(factor == 0.0 || factor > 1.0,
+                               "Invalid rebalancing factor " << factor);
+    }
+
+    bool enabled() const {
+        return factor_ > 0.0;
+    }
+
+    // Collective operation.  Returns whether any elements were moved.
+    bool operator()(Tree &tree) {
+        if (!enabled())
+            return false;
+
+        const int nprocs = comm_.size(), rank = comm_.rank();
+        sizes_.resize(nprocs);
+        mpi::all_gather(comm_, tree.size(), sizes_.data());
+
+        size_t total = 0, max_size = 0;
+        for (size_t size : sizes_) {
+            total += size;
+            max_size = std::max(max_size, size);
+        }
+        const double avg = static_cast<double>(total) / nprocs;
+        if (static_cast<double>(max_size) <= factor_ * avg) {
+            return false;
+        }
+        sLOGR << "Rebalancing" << total << "elements, max size" << max_size
+              << "avg" << avg;
+
+        _detail::balance_plan(sizes_, rank, plan_);
+
+        std::vector<mpi::request> requests;
+        requests.reserve(plan_.size());
+        if (sizes_[rank] > target(rank, total)) {
+            // send the largest elements in consecutive ranges
+            const size_t surplus = sizes_[rank] - target(rank, total);
+            Tree keep, send;
+            tree.splitAt(keep, tree.size() - surplus, send);
+            tree = std::move(keep);
+            buffer_.assign(std::make_move_iterator(send.begin()),
+                           std::make_move_iterator(send.end()));
+            size_t offset = 0;
+            for (auto [peer, count] : plan_) {
+                requests.push_back(comm_.isend(peer, 0, buffer_.data() + offset,
+                                               static_cast<int>(count)));
+                offset += count;
+            }
+        } else if (!plan_.empty()) {
+            size_t num_recv = 0;
+            for (auto [peer, count] : plan_) {
+                num_recv += count;
+            }
+            buffer_.resize(num_recv);
+            size_t offset = 0;
+            for (auto [peer, count] : plan_) {
+                requests.push_back(comm_.irecv(peer, 0, buffer_.data() + offset,
+                                               static_cast<int>(count)));
+                offset += count;
+            }
+        }
+        mpi::wait_all(requests.begin(), requests.end());
+
+        if (sizes_[rank] < target(rank, total) && !plan_.empty()) {
+            merge_into(tree);
+        }
+        tlx_die_unless(tree.size() == target(rank, total));
+        return true;
+    }
+
+protected:
+    // number of elements that PE `pe` should hold after rebalancing
+    size_t target(int pe, size_t total) const {
+        return _detail::balanced_size(pe, total, comm_.size());
+    }
+
+    // Rebuild `tree` from the multiway merge of its own elements and the
+    // received sorted ranges in buffer_.  The elements are moved, not copied.
+    void merge_into(Tree &tree) {
+        local_.assign(std::make_move_iterator(tree.begin()),
+                      std::make_move_iterator(tree.end()));
+        runs_.clear();
+        runs_.emplace_back(std::make_move_iterator(local_.begin()),
+                           std::make_move_iterator(local_.end()));
+        auto begin = std::make_move_iterator(buffer_.begin());
+        for (auto [peer, count] : plan_) {
+            runs_.emplace_back(begin, begin + count);
+            begin += count;
+        }
+        tree.clear();
+        tree.bulk_load_runs(runs_, num_threads_);
+    }
+
+    mpi::communicator &comm_;
+    double factor_;
+    size_t num_threads_;
+    std::vector<size_t> sizes_;
+    std::vector<std::pair<int, size_t>> plan_;
+    std::vector<value_type> buffer_, local_;
+    using buffer_iterator =
+        std::move_iterator<typename std::vector<value_type>::iterator>;
+    std::vector<std::pair<buffer_iterator, buffer_iterator>> runs_;
+};
+
+} // namespace reservoir
+
+#endif // RESERVOIR_REBALANCE_HEADER
@@ -0,0 +1,140 @@
+/*******************************************************************************
+ * reservoir/reclaimer.hpp
+ *
+ * Deferred and background freeing of subtrees cut off a B-tree
+ *
+ * Copyright (C) 2019 Lorenz Hübschle-Schneider <lorenz@4z2.de>
+ *
+ * All rights reserved. Published under the GNU General Public License 3
+ ******************************************************************************/
+
+#pragma once
+#ifndef RESERVOIR_RECLAIMER_HEADER
+#define RESERVOIR_RECLAIMER_HEADER
+
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+namespace reservoir {
+
+// When to free the subtrees that BTree::truncate cut off a tree
+enum class reclaim_mode {
+    // free them right away in retire()
+    immediate,
+    // collect them until drain() is called, e.g., while waiting for a
+    // nonblocking collective to complete
+    deferred,
+    // free them on a separate thread
+    background
+};
+
+// Takes ownership of the detached subtrees of a B-tree (the
+// `detached_subtrees` type of the tree) and frees them as configured by a
+// reclaim_mode.  Nobody reads the discarded elements, so freeing them doesn't
+// have to delay the next collective operation.
+//
+// In background mode, the destructors of the discarded keys and values run on
+// the reclamation thread, which requires that they don't touch state shared
+// with the tree's owner.  Plain old data and handles into a payload_arena are
+// fine.
+//
+// All pending subtrees are freed with one allocator, that of the tree they
+// were last retired from.  Thus, the trees that retire subtrees to the same
+// reclaimer must use equal allocators, e.g., stateless ones.
+template <typename Detached>
+class reclaimer {
+public:
+    explicit reclaimer(reclaim_mode mode = reclaim_mode::immediate)
+        : mode_(mode) {
+        if (mode_ == reclaim_mode::background) {
+            thread_ = std::thread([this] { run(); });
+        }
+    }
+
+    // Non-copyable and non-movable, the reclamation thread refers to this
+    reclaimer(const reclaimer &) = delete;
+    reclaimer &operator=(const reclaimer &) = delete;
+
+    ~reclaimer() {
+        if (thread_.joinable()) {
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                stop_ = true;
+            }
+            cv_.notify_one();
+            thread_.join();
+        }
+    }
+
+    reclaim_mode mode() const {
+        return mode_;
+    }
+
+    // Take over the subtrees in `detached`, which is left empty but keeps its
+    // capacity, so that it can be reused for the next truncate
+    void retire(Detached &detached) {
+        if (detached.empty()) {
+            return;
+        }
+        switch (mode_) {
+        case reclaim_mode::immediate:
+            detached.clear();
+            break;
+        case reclaim_mode::deferred:
+            pending_.splice(detached);
+            break;
+        case reclaim_mode::background:
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                pending_.splice(detached);
+            }
+            cv_.notify_one();
+            break;
+        }
+    }
+
+    void retire(Detached &&detached) {
+        retire(detached);
+    }
+
+    // In deferred mode, free all subtrees retired so far.  Does nothing in
+    // the other modes.
+    void drain() {
+        if (mode_ == reclaim_mode::deferred) {
+            pending_.clear();
+        }
+    }
+
+protected:
+    // Body of the reclamation thread: take the pending subtrees and free them
+    // without holding the lock.  Frees everything left before stopping.
+    void run() {
+        Detached work;
+        std::unique_lock<std::mutex> lock(mutex_);
+        while (true) {
+            cv_.wait(lock, [this] { return stop_ || !pending_.empty(); });
+            if (pending_.empty()) {
+                break;
+            }
+            work.splice(pending_);
+            lock.unlock();
+            work.clear();
+            lock.lock();
+        }
+    }
+
+    reclaim_mode mode_;
+    // subtrees that weren't freed yet, guarded by mutex_ in background mode
+    Detached pending_;
+
+    // for background mode
+    std::thread thread_;
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    bool stop_ = false;
+};
+
+} // namespace reservoir
+
+#endif // RESERVOIR_RECLAIMER_HEADER
@@ -16,6 +16,9 @@
 #include <reservoir/aggregate.hpp>
 #include <reservoir/btree_multimap.hpp>
 #include <reservoir/logger.hpp>
+#include <reservoir/payload_arena.hpp>
+#include <reservoir/rebalance.hpp>
+#include <reservoir/reclaimer.hpp>
 #include <reservoir/select_helpers.hpp>
 #include <reservoir/stats.hpp>
 #include <reservoir/timer.hpp>
@@ -27,49 +30,80 @@
 #include <boost/mpi.hpp>
 
 #include <algorithm>
+#include <iterator>
+#include <memory>
+#include <type_traits>
 #include <utility>
+#include <vector>
 
 namespace mpi = boost::mpi;
 
 namespace reservoir {
 
-template <typename Key, template <typename> typename select_t, typename RNG>
+// With `use_arena` set, the items are stored in a payload_arena and the tree
+// only holds (key, 32-bit handle) pairs.  This is worth it for large item
+// types, whose size would otherwise determine the size of the tree's leaves.
+template <typename Key, template <typename> typename select_t, typename RNG,
+          bool use_arena = false>
 class reservoir {
 public:
     static constexpr const char *short_name = "[res]";
 
     using key_type = Key;
-    using reservoir_type = btree_multimap<double, key_type>;
+    using arena_type = payload_arena<key_type>;
+    using mapped_type = std::conditional_t<use_arena,
+                                           typename arena_type::handle_type,
+                                           key_type>;
+    using reservoir_type = btree_multimap<double, mapped_type>;
+    using detached_type = typename reservoir_type::detached_subtrees;
+    // immutable copy of the local sample for concurrent readers
+    using snapshot_type = btree_multimap<double, key_type>;
     using select_type = select_t<reservoir_type>;
 
     static constexpr bool check = false;
     static constexpr bool debug = false;
     static constexpr bool time = true;
 
-    reservoir(mpi::communicator &comm, size_t size, size_t seed)
+    // If rebalance_factor is nonzero, the reservoir is redistributed after a
+    // batch whenever the largest local reservoir exceeds the average size by
+    // more than that factor, see rebalancer.  The items that fall out of the
+    // reservoir are freed as specified by `reclaim`: with
+    // reclaim_mode::deferred, while waiting for the threshold all-reduce, and
+    // with reclaim_mode::background, on a separate thread.
+    reservoir(mpi::communicator &comm, size_t size, size_t seed,
+              double rebalance_factor = 0.0,
+              reclaim_mode reclaim = reclaim_mode::immediate)
         : select_(comm, seed + static_cast<size_t>(comm.size() + comm.rank())),
+          rebalance_(comm, rebalance_factor), reclaim_(reclaim),
           rng_(seed + static_cast<size_t>(comm.rank())), comm_(comm),
           size_(size), threshold_(0.0), batch_id_(0) {
+        // handles are only meaningful on the PE that created them
+        tlx_die_verbose_unless(!use_arena || !rebalance_.enabled(),
+                               "Rebalancing isn't supported with an arena");
         LOGRC(check) << "Checking is active, things might be slow!";
     }
 
-    // Iterator should dereference to (weight, id) pairs
+    // Iterator should dereference to (weight, id) pairs.  All weights of the
+    // batch are multiplied by weight_scale, see reservoir_forward_decay.  To
+    // move the ids of an rvalue batch into the reservoir instead of copying
+    // them, pass std::move_iterators.
     template <typename Iterator>
-    void insert(Iterator begin, Iterator end) {
+    void insert(Iterator begin, Iterator end, double weight_scale = 1.0) {
         timer t, t_total;
 
         pLOG << "batch " << batch_id_ << " beginning";
 
         // Step 1: process new items locally
         Iterator it = begin;
-        size_t count = 0;
+        // the reservoir holds items of earlier batches if it isn't full yet
+        size_t count = reservoir_.size();
         if (threshold_ == 0.0) {
             size_t size_thresh = std::max(3 * size_ / 2, size_ + 500);
             while (it != end && reservoir_.size() < size_thresh) {
                 // generate exponentially distributed variables
-                double key = rng_.next_exponential(it->first);
+                double key = rng_.next_exponential(it->first * weight_scale);
                 spLOG0 << "item" << *it << "key" << key;
-                reservoir_.insert2(key, it->second);
+                insert_item(key, (*it).second);
                 ++count;
                 // catch a compiler bug in the subtree size compilation
                 tlx_die_verbose_unless(reservoir_.size() == count,
@@ -96,19 +130,19 @@ public:
                           << "splitter" << *thresh_it << "after seeing"
                           << it - begin << "elements";
 
-                    // splitting is fast
-                    reservoir_type keep, discard;
-                    reservoir_.splitAt(keep, size_, thresh_it, discard);
-                    reservoir_ = std::move(keep);
+                    // truncating is fast
+                    reservoir_.truncate(size_, detached_);
+                    reclaim_.retire(detached_);
                 }
                 tlx_die_unless(local_threshold > 0);
 
-                it = insert_skip<false>(it, end, local_threshold);
+                it = insert_skip<false>(it, end, local_threshold,
+                                        weight_scale);
             }
             spLOG0 << "first round of insertions took" << t.get() << "ms";
         } else {
             while (it != end) {
-                it = insert_skip<true>(it, end, threshold_);
+                it = insert_skip<true>(it, end, threshold_, weight_scale);
             }
         }
         pLOG0 << "done processing items";
@@ -125,8 +159,19 @@ public:
 
         pLOG << "batch " << batch_id_ << " finding splitter...";
 
-        // Step 2: find splitter
-        auto [split_it, num_keep] = select_(reservoir_, size_);
+        // Step 2: find splitter.  Until the reservoir has seen `size_` items,
+        // e.g., after clear(), it keeps all of them and stays in the mode of
+        // the first batch.
+        bool full = true;
+        if (threshold_ == 0.0) {
+            size_t total = reservoir_.size();
+            mpi::all_reduce(comm_, mpi::inplace(total), std::plus<>());
+            full = total >= size_;
+        }
+        ssize_t num_keep = static_cast<ssize_t>(reservoir_.size());
+        if (full) {
+            num_keep = select_(reservoir_, size_).second;
+        }
         if constexpr (time) {
             double t_select = t.get();
             stats_.record("select", t_select);
@@ -139,10 +184,9 @@ public:
 
         pLOG << "batch " << batch_id_ << " splitting...";
 
-        // Step 3: split
-        reservoir_type keep, discard;
-        reservoir_.splitAt(keep, static_cast<size_t>(num_keep), split_it, discard);
-        reservoir_ = std::move(keep);
+        // Step 3: split, cutting off everything above the splitter in place
+        reservoir_.truncate(static_cast<size_t>(num_keep), detached_);
+        reclaim_.retire(detached_);
         if constexpr (time) {
             double t_split = t.get();
             stats_.record("split", t_split);
@@ -156,14 +200,24 @@ public:
         pLOG << "batch " << batch_id_ << " finding new threshold";
 
         // Step 4: determine value of new threshold
-        double max_local =
-            reservoir_.empty() ? 0.0 : std::prev(reservoir_.end())->first;
-        threshold_ = mpi::all_reduce(comm_, max_local, mpi::maximum<double>());
+        double max_local = !full || reservoir_.empty()
+                               ? 0.0
+                               : std::prev(reservoir_.end())->first;
+        if (reclaim_.mode() == reclaim_mode::deferred) {
+            // free the discarded subtrees while the reduction is in flight
+            MPI_Request request;
+            MPI_Iallreduce(&max_local, &threshold_, 1, MPI_DOUBLE, MPI_MAX,
+                           static_cast<MPI_Comm>(comm_), &request);
+            reclaim_.drain();
+            MPI_Wait(&request, MPI_STATUS_IGNORE);
+        } else {
+            threshold_ =
+                mpi::all_reduce(comm_, max_local, mpi::maximum<double>());
+        }
         LOGR << "new threshold is " << threshold_;
 
         if constexpr (check) {
             reservoir_.verify();
-            discard.verify();
             tlx_die_unless(static_cast<ssize_t>(reservoir_.size()) == num_keep);
         }
 
@@ -175,7 +229,46 @@ public:
                  << " batch=" << batch_id_ << " samplesize=" << size_
                  << " time=" << t_threshold;
             t.reset();
+        }
+
+        // Step 5: reclaim the payloads of discarded items.  Every payload in
+        // the arena was inserted at some point, so this is amortized constant
+        // time per insertion.
+        if constexpr (use_arena) {
+            if (arena_.size() > 2 * reservoir_.size() + arena_slack) {
+                arena_.compact(reservoir_);
+            }
+            if constexpr (time) {
+                stats_.record("compact", t.get());
+                t.reset();
+            }
+        }
+
+        // Step 6: migrate parts of the reservoir if it is too unbalanced
+        if (rebalance_.enabled()) {
+            pLOG << "batch " << batch_id_ << " rebalancing";
+            rebalance_(reservoir_);
+            if constexpr (time) {
+                double t_rebalance = t.get();
+                stats_.record("rebalance", t_rebalance);
+                LOG0 << "RESULT op=rebalance pe=" << comm_.rank()
+                     << " np=" << comm_.size() << " batchsize=" << end - begin
+                     << " batch=" << batch_id_ << " samplesize=" << size_
+                     << " time=" << t_rebalance;
+                t.reset();
+            }
+        }
+
+        // Step 7: hand the new sample to concurrent readers
+        if (publish_snapshots_) {
+            publish_snapshot();
+            if constexpr (time) {
+                stats_.record("snapshot", t.get());
+                t.reset();
+            }
+        }
 
+        if constexpr (time) {
             stats_.record("total", t_total.get());
         }
 
@@ -184,11 +277,152 @@ public:
         ++batch_id_;
     }
 
+    // Like insert, but first balance the input of this batch over the PEs, for
+    // batches whose size differs between PEs.  PEs with more than the average
+    // number of items hand the end of their input to PEs with fewer items, so
+    // that all PEs process the same number of items (up to rounding) and
+    // nobody waits for an overloaded PE in the selection collectives.  This
+    // costs one all_gather and point-to-point transfers of the surplus items.
+    // Iterator must be a random access iterator, as for insert, and
+    // weight_scale is passed on to insert.
+    template <typename Iterator>
+    void insert_balanced(Iterator begin, Iterator end,
+                         double weight_scale = 1.0) {
+        timer t;
+        const int rank = comm_.rank();
+        const size_t local_size = static_cast<size_t>(end - begin);
+        input_sizes_.resize(comm_.size());
+        mpi::all_gather(comm_, local_size, input_sizes_.data());
+        _detail::balance_plan(input_sizes_, rank, input_plan_);
+
+        if (input_plan_.empty()) {
+            record_balance_time(t, local_size);
+            insert(begin, end, weight_scale);
+            return;
+        }
+
+        size_t total = 0;
+        for (size_t size : input_sizes_) {
+            total += size;
+        }
+        const size_t target = _detail::balanced_size(rank, total, comm_.size());
+        std::vector<mpi::request> requests;
+        requests.reserve(input_plan_.size());
+        if (local_size > target) {
+            // hand off the end of the input
+            input_buffer_.assign(begin + target, end);
+            size_t offset = 0;
+            for (auto [peer, count] : input_plan_) {
+                requests.push_back(
+                    comm_.isend(peer, 0, input_buffer_.data() + offset,
+                                static_cast<int>(count)));
+                offset += count;
+            }
+            mpi::wait_all(requests.begin(), requests.end());
+            record_balance_time(t, local_size);
+            insert(begin, begin + target, weight_scale);
+        } else {
+            // receive behind a copy of the local input
+            input_buffer_.resize(target);
+            std::copy(begin, end, input_buffer_.begin());
+            size_t offset = local_size;
+            for (auto [peer, count] : input_plan_) {
+                requests.push_back(
+                    comm_.irecv(peer, 0, input_buffer_.data() + offset,
+                                static_cast<int>(count)));
+                offset += count;
+            }
+            mpi::wait_all(requests.begin(), requests.end());
+            record_balance_time(t, local_size);
+            insert(std::make_move_iterator(input_buffer_.begin()),
+                   std::make_move_iterator(input_buffer_.end()), weight_scale);
+        }
+    }
+
+    // Multiply all keys and the threshold by a positive factor.  This doesn't
+    // change the sample, but is equivalent to dividing the weights of all
+    // items seen so far by `factor`.  Must be called on all PEs.
+    void rescale_keys(double factor) {
+        tlx_die_unless(factor > 0);
+        reservoir_.transform_keys(
+            [factor](double key) { return key * factor; });
+        threshold_ *= factor;
+        if (publish_snapshots_) {
+            publish_snapshot();
+        }
+    }
+
+    // Calls callback with the (key, item) pairs of the local sample.  With an
+    // arena, the pairs hold a reference to the item.
     template <typename Callback>
     void sample(Callback &&callback) const {
         for (auto it = reservoir_.begin(); it != reservoir_.end(); ++it) {
-            callback(*it);
+            if constexpr (use_arena) {
+                callback(std::pair<double, const key_type &>(
+                    it->first, arena_[it->second]));
+            } else {
+                callback(*it);
+            }
+        }
+    }
+
+    // Like sample, but moves the (key, item) pairs out of the reservoir, which
+    // is empty afterwards.  The next batch is treated like the first one.
+    // Must be called on all PEs.
+    template <typename Callback>
+    void consume_sample(Callback &&callback) {
+        for (auto it = reservoir_.begin(); it != reservoir_.end(); ++it) {
+            if constexpr (use_arena) {
+                callback(std::pair<double, key_type>(
+                    it->first, std::move(arena_[it->second])));
+            } else {
+                callback(std::move(*it));
+            }
+        }
+        clear();
+    }
+
+    // Discard the sample.  The next batch is treated like the first one.
+    // Must be called on all PEs.
+    void clear() {
+        reservoir_.clear();
+        if constexpr (use_arena) {
+            arena_.clear();
         }
+        threshold_ = 0.0;
+        if (publish_snapshots_) {
+            publish_snapshot();
+        }
+    }
+
+    // The largest key in the sample, or 0 if it has fewer than `size` items
+    double threshold() const {
+        return threshold_;
+    }
+
+    // Enable or disable publishing snapshots of the local sample for readers
+    // on other threads, see snapshot().  Publishing copies the local sample
+    // into a new tree once per batch, so it requires copyable items.  Must not
+    // be called concurrently with modifying operations.
+    void publish_snapshots(bool enable) {
+        static_assert(std::is_copy_constructible_v<key_type>,
+                      "Snapshots require copy-constructible items");
+        publish_snapshots_ = enable;
+        if (enable) {
+            publish_snapshot();
+        } else {
+            std::atomic_store(&snapshot_,
+                              std::shared_ptr<const snapshot_type>());
+        }
+    }
+
+    // The local sample as of the last completed batch, or nullptr if
+    // snapshots aren't published.  May be called from any thread while
+    // insert() runs: a snapshot is never modified, so readers can iterate and
+    // query it without locking, and it stays valid for as long as they hold
+    // on to it, independent of later batches.
+    std::shared_ptr<const snapshot_type> snapshot() const {
+        return std::atomic_load(&snapshot_);
     }
 
     _detail::res_stats<time> &get_stats() {
@@ -200,6 +434,52 @@ public:
     }
 
 protected:
+    void record_balance_time(timer &t, size_t local_size) {
+        if constexpr (time) {
+            double t_balance = t.get();
+            stats_.record("balance", t_balance);
+            LOG0 << "RESULT op=balance pe=" << comm_.rank()
+                 << " np=" << comm_.size() << " batchsize=" << local_size
+                 << " batch=" << batch_id_ << " samplesize=" << size_
+                 << " time=" << t_balance;
+        }
+    }
+
+    // Build an immutable copy of the local sample, with the items resolved
+    // from the arena, and replace the published snapshot with it.  Readers
+    // that still hold the previous snapshot keep it alive.  Compiled only for
+    // copyable items, as publish_snapshots() can't be used with the others.
+    void publish_snapshot() {
+        if constexpr (std::is_copy_constructible_v<key_type>) {
+            std::vector<std::pair<double, key_type>> items;
+            items.reserve(reservoir_.size());
+            sample([&items](const auto &item) {
+                items.emplace_back(item.first, item.second);
+            });
+            auto next = std::make_shared<snapshot_type>();
+            next->bulk_load(std::make_move_iterator(items.begin()),
+                            std::make_move_iterator(items.end()));
+            std::atomic_store(
+                &snapshot_,
+                std::shared_ptr<const snapshot_type>(std::move(next)));
+        }
+    }
+
+    // Number of dead payloads that the arena may hold in addition to twice the
+    // reservoir size before it is compacted
+    static constexpr size_t arena_slack = 1024;
+
+    // Insert an item into the tree, or into the arena.  The item is moved if
+    // it is an rvalue, i.e., if the input is accessed through a move_iterator.
+    template <typename Item>
+    void insert_item(double key, Item &&item) {
+        if constexpr (use_arena) {
+            reservoir_.insert2(key, arena_.add(std::forward<Item>(item)));
+        } else {
+            reservoir_.insert2(key, std::forward<Item>(item));
+        }
+    }
+
     template <size_t w, typename Iterator>
     constexpr double vec_sum(Iterator it) {
         if constexpr (w == 1) {
@@ -211,10 +491,13 @@ protected:
         }
     }
 
+    // The skip is measured in unscaled weights, so its rate is scaled instead
     template <bool far, typename Iterator>
     TLX_ATTRIBUTE_ALWAYS_INLINE Iterator insert_skip(Iterator it, Iterator end,
-                                                     double threshold) {
-        double skip = rng_.next_exponential(threshold);
+                                                     double threshold,
+                                                     double weight_scale) {
+        const double rate = threshold * weight_scale;
+        double skip = rng_.next_exponential(rate);
         pLOG0 << "skip = " << skip;
 
         if constexpr (far) {
@@ -224,7 +507,7 @@ protected:
             double sum = 0.0;
             // Check that the next w items (including this) appear before `end`
             Iterator curr_last = it + (w - 1);
-            Iterator prev;
+            Iterator prev = it;
             while (curr_last < end && skip >= 0) {
                 sum = vec_sum<w>(it);
 
@@ -258,17 +541,23 @@ protected:
         if (it == end)
             return it;
 
-        double minv = std::exp(-threshold * it->first);
+        double minv = std::exp(-rate * it->first);
         double r = rng_.next(minv, 1.0);
-        double key = -std::log(r) / it->first;
+        double key = -std::log(r) / (it->first * weight_scale);
         my_assert(key > 0);
         spLOG0 << "item" << *it << "minv" << minv << "r" << r << "key" << key;
-        reservoir_.insert2(key, it->second);
+        insert_item(key, (*it).second);
         return it;
     }
 
     reservoir_type reservoir_;
+    // only used with use_arena
+    arena_type arena_;
     select_type select_;
+    rebalancer<reservoir_type> rebalance_;
+    // subtrees cut off by truncate, reused across batches
+    detached_type detached_;
+    reclaimer<detached_type> reclaim_;
     RNG rng_;
     mpi::communicator &comm_;
     size_t size_;
@@ -276,6 +565,15 @@ protected:
 
     size_t batch_id_;
     mutable _detail::res_stats<time> stats_;
+
+    // published snapshot of the sample, only accessed atomically
+    std::shared_ptr<const snapshot_type> snapshot_;
+    bool publish_snapshots_ = false;
+
+    // for insert_balanced
+    std::vector<size_t> input_sizes_;
+    std::vector<std::pair<int, size_t>> input_plan_;
+    std::vector<std::pair<double, key_type>> input_buffer_;
 };
 
 } // namespace reservoir
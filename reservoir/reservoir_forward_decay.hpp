@@ -0,0 +1,145 @@
+/*******************************************************************************
+ * reservoir/reservoir_forward_decay.hpp
+ *
+ * Distributed Weighted Reservoir Sampling with Exponential Forward Decay
+ *
+ * Copyright (C) 2019 Lorenz Hübschle-Schneider <lorenz@4z2.de>
+ *
+ * All rights reserved. Published under the GNU General Public License 3
+ ******************************************************************************/
+
+#pragma once
+
+#ifndef RESERVOIR_RESERVOIR_FORWARD_DECAY_HEADER
+#define RESERVOIR_RESERVOIR_FORWARD_DECAY_HEADER
+
+#include <reservoir/logger.hpp>
+#include <reservoir/reservoir.hpp>
+#include <reservoir/stats.hpp>
+
+#include <tlx/die/core.hpp>
+
+#include <boost/mpi.hpp>
+
+#include <cmath>
+
+namespace mpi = boost::mpi;
+
+namespace reservoir {
+
+// Weighted reservoir sampling where the weight of an item decays exponentially
+// with its age: at time `now`, an item of weight w that arrived at time t has
+// the effective weight w * exp(-decay_rate * (now - t)).
+//
+// Instead of re-keying the reservoir whenever time advances, this uses forward
+// decay: an item arriving at time t is inserted with the weight
+// w * exp(decay_rate * (t - landmark)), which grows with the arrival time.
+// All items are then scaled by the same factor exp(-decay_rate * (now -
+// landmark)) relative to their decayed weights, so the sample is the same.
+// To avoid overflowing the scaled weights, the landmark is moved forward once
+// the scale factor gets too large.  This divides the weights of all items in
+// the reservoir by the same factor, which is done by multiplying their keys
+// in-place, without changing their order or the sample.  If the time jumps so
+// far that the keys would overflow, the items in the reservoir have no weight
+// left compared to new items, and the reservoir is emptied instead.
+template <typename Key, template <typename> typename select_t, typename RNG>
+class reservoir_forward_decay {
+public:
+    static constexpr const char *short_name = "[fwd]";
+
+    using key_type = Key;
+    using reservoir_type = reservoir<Key, select_t, RNG>;
+
+    static constexpr bool debug = false;
+
+    // Move the landmark once the weight scale exceeds exp(max_exponent).  This
+    // leaves plenty of room below the double range for the keys.
+    static constexpr double max_exponent = 64.0;
+    // Discard the sample instead of moving the landmark if that would scale
+    // the largest key beyond exp(max_log_key).  The largest double is about
+    // exp(709.78), so this leaves the same room as above.
+    static constexpr double max_log_key = 709.0 - max_exponent;
+
+    reservoir_forward_decay(mpi::communicator &comm, size_t size,
+                            double decay_rate, size_t seed,
+                            double landmark = 0.0)
+        : res_(comm, size, seed), comm_(comm), decay_rate_(decay_rate),
+          landmark_(landmark), renormalizations_(0) {
+        tlx_die_verbose_unless(decay_rate >= 0,
+                               "Invalid decay rate " << decay_rate);
+    }
+
+    // Iterator should dereference to (weight, id) pairs.  Time stamps must be
+    // non-decreasing and the same on all PEs.
+    template <typename Iterator>
+    void insert(Iterator begin, Iterator end, double time) {
+        res_.insert(begin, end, advance(time));
+    }
+
+    // Like insert, but balance the batch over the PEs first, see
+    // reservoir::insert_balanced
+    template <typename Iterator>
+    void insert_balanced(Iterator begin, Iterator end, double time) {
+        res_.insert_balanced(begin, end, advance(time));
+    }
+
+    template <typename Callback>
+    void sample(Callback &&callback) const {
+        res_.sample(callback);
+    }
+
+    double landmark() const {
+        return landmark_;
+    }
+
+    // Number of times the landmark was moved
+    size_t renormalizations() const {
+        return renormalizations_;
+    }
+
+    _detail::res_stats<reservoir_type::time> &get_stats() {
+        return res_.get_stats();
+    }
+
+    auto get_mss_stats() {
+        return res_.get_mss_stats();
+    }
+
+protected:
+    // Move the landmark if necessary and return the weight scale of items
+    // arriving at `time`
+    double advance(double time) {
+        double exponent = decay_rate_ * (time - landmark_);
+        if (exponent > max_exponent) {
+            // the threshold is 0 while the sample isn't full, then go by
+            // the exponent alone
+            const double threshold = res_.threshold();
+            const double log_key =
+                threshold > 0 ? std::log(threshold) + exponent : exponent;
+            if (log_key > max_log_key) {
+                // The rescaled keys would overflow, so the items in the
+                // reservoir are weightless compared to any that arrive now
+                sLOGR << "moving landmark from" << landmark_ << "to" << time
+                      << "and discarding the sample";
+                res_.clear();
+            } else {
+                sLOGR << "moving landmark from" << landmark_ << "to" << time;
+                res_.rescale_keys(std::exp(exponent));
+            }
+            landmark_ = time;
+            exponent = 0.0;
+            ++renormalizations_;
+        }
+        return std::exp(exponent);
+    }
+
+    reservoir_type res_;
+    mpi::communicator &comm_;
+    double decay_rate_;
+    double landmark_;
+    size_t renormalizations_;
+};
+
+} // namespace reservoir
+
+#endif // RESERVOIR_RESERVOIR_FORWARD_DECAY_HEADER
@@ -15,6 +15,7 @@
 
 #include <reservoir/aggregate.hpp>
 #include <reservoir/logger.hpp>
+#include <reservoir/radix_select.hpp>
 #include <reservoir/select_helpers.hpp>
 #include <reservoir/stats.hpp>
 #include <reservoir/timer.hpp>
@@ -25,6 +26,8 @@
 
 #include <boost/mpi.hpp>
 
+#include <algorithm>
+#include <iterator>
 #include <utility>
 #include <vector>
 
@@ -33,20 +36,26 @@ namespace mpi = boost::mpi;
 namespace reservoir {
 
 namespace _detail {
+template <bool tree>
 struct gather_selection {
     static const std::string name() {
-        return "gather";
+        return tree ? "gather-tree" : "gather";
     }
 };
 } // namespace _detail
 
-template <typename Key, typename RNG>
+// Naive distributed reservoir sampling: all candidates are collected at PE 0,
+// which selects the sample sequentially.  With `tree` set, the PEs instead
+// combine their candidates pairwise up a binomial tree, keeping only the `size`
+// smallest at every hop.  This reduces the communication volume at PE 0 from
+// O(p*k) to O(k log p) and the memory of every PE to O(k).
+template <typename Key, typename RNG, bool tree = false>
 class reservoir_gather {
 public:
     static constexpr const char *short_name = "[res]";
 
     using key_type = Key;
-    using select_type = _detail::gather_selection;
+    using select_type = _detail::gather_selection<tree>;
 
     static constexpr bool check = false;
     static constexpr bool debug = false;
@@ -58,7 +67,8 @@ public:
         LOGRC(check) << "Checking is active, things might be slow!";
     }
 
-    // Iterator should dereference to (weight, id) pairs
+    // Iterator should dereference to (weight, id) pairs.  Pass move_iterators
+    // to move the ids of an rvalue batch instead of copying them.
     template <typename Iterator>
     void insert(Iterator begin, Iterator end) {
         timer t, t_total;
@@ -76,7 +86,7 @@ public:
                 // generate exponentially distributed variables
                 double key = rng_.next_exponential(it->first);
                 spLOG0 << "item" << *it << "key" << key;
-                items_.emplace_back(key, it->second);
+                items_.emplace_back(key, (*it).second);
                 ++it;
             }
             spLOG0 << "first batch took" << t.get() << "ms";
@@ -87,15 +97,9 @@ public:
         }
         pLOG0 << "done processing items";
 
-        // Step 1b: local selection
-        if (items_.size() > size_) {
-            // Select `size_` smallest items locally to avoid transmitting
-            // unnecessarily many (and OOM at root)
-            std::nth_element(items_.begin(), items_.begin() + size_ - 1,
-                             items_.end());
-            // Discard the rest
-            items_.resize(size_);
-        }
+        // Step 1b: local selection.  Select `size_` smallest items locally to
+        // avoid transmitting unnecessarily many (and OOM at root)
+        keep_smallest(items_);
 
         if constexpr (time) {
             stats_.record("size", items_.size());
@@ -111,26 +115,16 @@ public:
         pLOG << "batch " << batch_id_ << " gathering...";
 
         // Step 2: gather
-        if (comm_.rank() == 0) {
-            sizes_.resize(comm_.size());
-        }
-        mpi::gather(comm_, static_cast<int>(items_.size()), sizes_, 0);
-        size_t old_size = all_items_.size();
-        if (comm_.rank() == 0) {
-            // Compute displacements. According to the MPI standard,
-            // displacements are significant only at the root, but boost::mpi
-            // wants to compute them at every PE if they're not provided...
-            int nprocs = comm_.size(), aux = 0;
-            displ_.resize(nprocs);
-            for (int rank = 0; rank < nprocs; ++rank) {
-                displ_[rank] = aux;
-                aux += sizes_[rank];
+        if constexpr (tree) {
+            reduce_tree();
+            if (comm_.rank() == 0) {
+                all_items_.insert(all_items_.end(),
+                                  std::make_move_iterator(items_.begin()),
+                                  std::make_move_iterator(items_.end()));
             }
-            // Allocate space for receiving all items at the end of the all_items_ vector
-            all_items_.resize(old_size + aux);
+        } else {
+            gather();
         }
-        mpi::gatherv(comm_, items_, all_items_.data() + old_size, sizes_,
-                     displ_, 0);
         if constexpr (time) {
             double t_select = t.get();
             stats_.record("gather", t_select);
@@ -145,11 +139,13 @@ public:
         sLOGR << "Have" << all_items_.size()
               << "items under consideration in batch" << batch_id_;
         if (comm_.rank() == 0) {
-            // Select result sequentially at root
-            std::nth_element(all_items_.begin(), all_items_.begin() + size_ - 1,
-                             all_items_.end());
-            // Discard the rest
-            all_items_.resize(size_);
+            // Select result sequentially at root.  The keys are positive
+            // doubles, so radix selection on their bits works.  This discards
+            // the rest, and both all_items_ and the scratch buffer keep their
+            // capacity for the next batch.
+            radix_select(all_items_, size_, select_tmp_, [](const auto &item) {
+                return double_bits(item.first);
+            });
             threshold_ = all_items_[size_ - 1].first;
             tlx_die_unless(threshold_ > 0);
         }
@@ -191,6 +187,62 @@ public:
     }
 
 protected:
+    // Keep only the `size_` smallest items of `vec`, in arbitrary order
+    void keep_smallest(std::vector<std::pair<double, Key>> &vec) {
+        if (vec.size() > size_) {
+            std::nth_element(vec.begin(), vec.begin() + size_ - 1, vec.end());
+            // Discard the rest
+            vec.resize(size_);
+        }
+    }
+
+    // Gather the local candidates of all PEs at the end of all_items_ at PE 0
+    void gather() {
+        if (comm_.rank() == 0) {
+            sizes_.resize(comm_.size());
+        }
+        mpi::gather(comm_, static_cast<int>(items_.size()), sizes_, 0);
+        size_t old_size = all_items_.size();
+        if (comm_.rank() == 0) {
+            // Compute displacements. According to the MPI standard,
+            // displacements are significant only at the root, but boost::mpi
+            // wants to compute them at every PE if they're not provided...
+            int nprocs = comm_.size(), aux = 0;
+            displ_.resize(nprocs);
+            for (int rank = 0; rank < nprocs; ++rank) {
+                displ_[rank] = aux;
+                aux += sizes_[rank];
+            }
+            // Allocate space for receiving all items at the end of the
+            // all_items_ vector
+            all_items_.resize(old_size + aux);
+        }
+        mpi::gatherv(comm_, items_, all_items_.data() + old_size, sizes_,
+                     displ_, 0);
+    }
+
+    // Reduce the local candidates of all PEs to the `size_` smallest ones with
+    // a binomial tree rooted at PE 0.  In round i, PE r with bit i set sends
+    // its candidates to PE r - 2^i and drops out, all others receive and merge.
+    // Afterwards, items_ holds the result at PE 0 and is empty elsewhere.
+    void reduce_tree() {
+        const int rank = comm_.rank(), nprocs = comm_.size();
+        for (int mask = 1; mask < nprocs; mask <<= 1) {
+            if (rank & mask) {
+                comm_.send(rank - mask, 0, items_);
+                items_.clear();
+                return;
+            }
+            if (rank + mask < nprocs) {
+                comm_.recv(rank + mask, 0, recv_items_);
+                items_.insert(items_.end(),
+                              std::make_move_iterator(recv_items_.begin()),
+                              std::make_move_iterator(recv_items_.end()));
+                keep_smallest(items_);
+            }
+        }
+    }
+
     template <size_t w, typename Iterator>
     constexpr double vec_sum(Iterator it) {
         if constexpr (w == 1) {
@@ -215,7 +267,7 @@ protected:
             double sum = 0.0;
             // Check that the next w items (including this) appear before `end`
             Iterator curr_last = it + (w - 1);
-            Iterator prev;
+            Iterator prev = it;
             while (curr_last < end && skip >= 0) {
                 sum = vec_sum<w>(it);
 
@@ -254,12 +306,13 @@ protected:
         double key = -std::log(r) / it->first;
         my_assert(key > 0);
         spLOG0 << "item" << *it << "minv" << minv << "r" << r << "key" << key;
-        items_.emplace_back(key, it->second);
+        items_.emplace_back(key, (*it).second);
         return it;
     }
 
     // all_items is significant only at PE 0
-    std::vector<std::pair<double, Key>> items_, all_items_;
+    std::vector<std::pair<double, Key>> items_, all_items_, recv_items_,
+        select_tmp_;
     std::vector<int> sizes_, displ_;
     RNG rng_;
     mpi::communicator &comm_;
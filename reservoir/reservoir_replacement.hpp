@@ -0,0 +1,311 @@
+/*******************************************************************************
+ * reservoir/reservoir_replacement.hpp
+ *
+ * Distributed Weighted Reservoir Sampling with Replacement
+ *
+ * Copyright (C) 2019 Lorenz Hübschle-Schneider <lorenz@4z2.de>
+ *
+ * All rights reserved. Published under the GNU General Public License 3
+ ******************************************************************************/
+
+#pragma once
+
+#ifndef RESERVOIR_RESERVOIR_REPLACEMENT_HEADER
+#define RESERVOIR_RESERVOIR_REPLACEMENT_HEADER
+
+#include <reservoir/logger.hpp>
+#include <reservoir/select_helpers.hpp>
+#include <reservoir/stats.hpp>
+#include <reservoir/timer.hpp>
+#include <reservoir/util.hpp>
+
+#include <tlx/define.hpp>
+#include <tlx/die/core.hpp>
+
+#include <boost/mpi.hpp>
+#include <mpi.h>
+
+#include <algorithm>
+#include <cmath>
+#include <functional>
+#include <limits>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace mpi = boost::mpi;
+
+namespace reservoir {
+
+namespace _detail {
+struct minloc_selection {
+    static const std::string name() {
+        return "minloc";
+    }
+};
+} // namespace _detail
+
+// Weighted sampling with replacement: `size` independent single-item
+// reservoirs ("slots"), each of which keeps the item with the smallest of its
+// own exponentially distributed keys.  The slots are independent draws from the
+// weight distribution of all items seen so far.
+//
+// Every slot skips through the input with its own exponential skip, whose rate
+// is the slot's key.  The next positions (in cumulative weight) at which the
+// slots accept an item are kept in a heap, so the items between the smallest
+// of them and the current position are skipped with vectorized sums as in
+// reservoir.  The candidates of the PEs are combined slot-wise with a single
+// MPI_MINLOC reduction, which doesn't need any selection.  Afterwards, every
+// PE knows the global key of every slot, and the item of a slot is stored at
+// the PE that holds its smallest key.
+template <typename Key, typename RNG>
+class reservoir_replacement {
+public:
+    static constexpr const char *short_name = "[rep]";
+
+    using key_type = Key;
+    using value_type = std::pair<double, key_type>;
+    using select_type = _detail::minloc_selection;
+
+    static constexpr bool check = false;
+    static constexpr bool debug = false;
+    static constexpr bool time = true;
+
+    reservoir_replacement(mpi::communicator &comm, size_t size, size_t seed)
+        : slots_(size, value_type(infinity, key_type())), owned_(size, 0),
+          minloc_(size), rng_(seed + static_cast<size_t>(comm.rank())),
+          comm_(comm), size_(size), batch_id_(0) {
+        LOGRC(check) << "Checking is active, things might be slow!";
+    }
+
+    // Iterator should dereference to (weight, id) pairs.  Ids must be
+    // copyable, as one item can fill several slots, but with
+    // std::move_iterators, an id is copied only for the second and further
+    // slots that accept it.
+    template <typename Iterator>
+    void insert(Iterator begin, Iterator end) {
+        timer t, t_total;
+
+        pLOG << "batch " << batch_id_ << " beginning";
+
+        // Step 1: process new items locally
+        size_t num_accepted = process(begin, end);
+        pLOG0 << "done processing items";
+
+        if constexpr (time) {
+            stats_.record("size", num_accepted);
+            double t_insert = t.get();
+            stats_.record("insert", t_insert);
+            LOG0 << "RESULT op=insert pe=" << comm_.rank()
+                 << " np=" << comm_.size() << " batchsize=" << end - begin
+                 << " batch=" << batch_id_ << " samplesize=" << size_
+                 << " time=" << t_insert;
+            t.reset();
+        }
+
+        // Step 2: find the smallest key of every slot and its PE
+        reduce();
+        if constexpr (time) {
+            double t_select = t.get();
+            stats_.record("select", t_select);
+            LOG0 << "RESULT op=select pe=" << comm_.rank()
+                 << " np=" << comm_.size() << " batchsize=" << end - begin
+                 << " batch=" << batch_id_ << " samplesize=" << size_
+                 << " time=" << t_select;
+            t.reset();
+
+            stats_.record("total", t_total.get());
+        }
+
+        pLOG << "batch " << batch_id_ << " done";
+
+        ++batch_id_;
+    }
+
+    // Calls callback with the (key, item) pairs of the slots stored on this
+    // PE.  An item can occur in several slots.
+    template <typename Callback>
+    void sample(Callback &&callback) const {
+        for (size_t i = 0; i < size_; i++) {
+            if (owned_[i])
+                callback(slots_[i]);
+        }
+    }
+
+    // The global key of slot `i`, or infinity if no item was inserted yet
+    double slot_key(size_t i) const {
+        return slots_[i].first;
+    }
+
+    // Whether the item of slot `i` is stored on this PE
+    bool owns_slot(size_t i) const {
+        return owned_[i] != 0;
+    }
+
+    _detail::res_stats<time> &get_stats() {
+        return stats_;
+    }
+
+    auto get_mss_stats() {
+        return _detail::select_stats<false>();
+    }
+
+protected:
+    static constexpr double infinity = std::numeric_limits<double>::infinity();
+
+    // position (in cumulative weight of the batch) and slot of the next
+    // acceptance of a slot
+    using event = std::pair<double, size_t>;
+
+    // Process the items in [begin, end), returns the number of accepted items
+    template <typename Iterator>
+    size_t process(Iterator begin, Iterator end) {
+        if (size_ == 0)
+            return 0;
+
+        // Skips are memoryless, so they can be redrawn at the start of every
+        // batch with the new slot keys.  Empty slots accept the first item.
+        events_.clear();
+        for (size_t i = 0; i < size_; i++) {
+            double pos = slots_[i].first == infinity
+                             ? 0.0
+                             : rng_.next_exponential(slots_[i].first);
+            events_.emplace_back(pos, i);
+        }
+        std::make_heap(events_.begin(), events_.end(), std::greater<>());
+
+        size_t num_accepted = 0;
+        // cumulative weight of the items before `it`
+        double pos = 0.0;
+        Iterator it = begin;
+        while (it != end) {
+            it = skip(it, end, pos, events_.front().first);
+            if (it == end)
+                break;
+
+            // all slots whose next acceptance lies within this item accept it.
+            // The first of them takes the id from the batch, which moves it
+            // for std::move_iterators, and the others copy it from that slot.
+            const double next_pos = pos + it->first;
+            size_t first_slot = size_;
+            while (events_.front().first < next_pos) {
+                std::pop_heap(events_.begin(), events_.end(), std::greater<>());
+                const size_t slot = events_.back().second;
+                const double key = accept(*it, slots_[slot].first);
+                spLOG0 << "slot" << slot << "item" << *it << "key" << key;
+                if (first_slot == size_) {
+                    slots_[slot] = value_type(key, (*it).second);
+                    first_slot = slot;
+                } else {
+                    slots_[slot] = value_type(key, slots_[first_slot].second);
+                }
+                owned_[slot] = 1;
+                events_.back().first = next_pos + rng_.next_exponential(key);
+                std::push_heap(events_.begin(), events_.end(),
+                               std::greater<>());
+                ++num_accepted;
+            }
+            pos = next_pos;
+            ++it;
+        }
+        return num_accepted;
+    }
+
+    // Advance `it` and `pos` to the item containing position `target`, or to
+    // end if there is no such item
+    template <typename Iterator>
+    TLX_ATTRIBUTE_ALWAYS_INLINE Iterator skip(Iterator it, Iterator end,
+                                              double &pos, double target) {
+        // number of elements to skip at a time
+        constexpr size_t w = 32;
+        // Check that the next w items (including this) appear before `end`
+        Iterator curr_last = it + (w - 1);
+        while (curr_last < end) {
+            double sum = vec_sum<w>(it);
+            if (pos + sum > target)
+                break;
+            pos += sum;
+            // Avoid advancing iterator twice, it might not be a random access
+            // iterator
+            it = curr_last + 1;
+            curr_last += w;
+        }
+
+        while (it != end && pos + it->first <= target) {
+            pos += it->first;
+            ++it;
+        }
+        return it;
+    }
+
+    // Draw the key of an item accepted by a slot with key `threshold`, i.e.,
+    // an exponential variable with rate equal to the weight of the item,
+    // conditioned on being smaller than `threshold`
+    template <typename Item>
+    double accept(const Item &item, double threshold) {
+        if (threshold == infinity) {
+            return rng_.next_exponential(item.first);
+        }
+        double minv = std::exp(-threshold * item.first);
+        double r = rng_.next(minv, 1.0);
+        double key = -std::log(r) / item.first;
+        my_assert(key > 0);
+        return key;
+    }
+
+    // Element-wise MPI_MINLOC over the keys of all slots.  Only the PEs that
+    // store the item of a slot contribute its key, so ties between the slot
+    // keys that all PEs know from previous batches don't move items.
+    void reduce() {
+        const int rank = comm_.rank();
+        for (size_t i = 0; i < size_; i++) {
+            minloc_[i].key = owned_[i] ? slots_[i].first : infinity;
+            minloc_[i].rank = rank;
+        }
+        MPI_Allreduce(MPI_IN_PLACE, minloc_.data(), static_cast<int>(size_),
+                      MPI_DOUBLE_INT, MPI_MINLOC, static_cast<MPI_Comm>(comm_));
+        for (size_t i = 0; i < size_; i++) {
+            slots_[i].first = minloc_[i].key;
+            const bool owned =
+                minloc_[i].key < infinity && minloc_[i].rank == rank;
+            if (owned_[i] && !owned) {
+                // another PE stores the item now, don't keep this one alive
+                slots_[i].second = key_type();
+            }
+            owned_[i] = owned;
+        }
+    }
+
+    template <size_t w, typename Iterator>
+    constexpr double vec_sum(Iterator it) {
+        if constexpr (w == 1) {
+            return it->first;
+        } else if constexpr (w == 3) {
+            return it->first + (it + 1)->first + (it + 2)->first;
+        } else {
+            return vec_sum<w / 2>(it) + vec_sum<w / 2>(it + w / 2);
+        }
+    }
+
+    // layout of MPI_DOUBLE_INT
+    struct double_int {
+        double key;
+        int rank;
+    };
+
+    std::vector<value_type> slots_;
+    // whether the item of a slot is stored on this PE
+    std::vector<char> owned_;
+    std::vector<double_int> minloc_;
+    std::vector<event> events_;
+    RNG rng_;
+    mpi::communicator &comm_;
+    size_t size_;
+
+    size_t batch_id_;
+    mutable _detail::res_stats<time> stats_;
+};
+
+} // namespace reservoir
+
+#endif // RESERVOIR_RESERVOIR_REPLACEMENT_HEADER
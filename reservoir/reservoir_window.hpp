@@ -0,0 +1,360 @@
+/*******************************************************************************
+ * reservoir/reservoir_window.hpp
+ *
+ * Distributed Weighted Sampling over a Sliding Window
+ *
+ * Copyright (C) 2019 Lorenz Hübschle-Schneider <lorenz@4z2.de>
+ *
+ * All rights reserved. Published under the GNU General Public License 3
+ ******************************************************************************/
+
+#pragma once
+
+#ifndef RESERVOIR_RESERVOIR_WINDOW_HEADER
+#define RESERVOIR_RESERVOIR_WINDOW_HEADER
+
+#include <reservoir/aggregate.hpp>
+#include <reservoir/btree_multimap.hpp>
+#include <reservoir/logger.hpp>
+#include <reservoir/select_helpers.hpp>
+#include <reservoir/sorted_range_seq.hpp>
+#include <reservoir/stats.hpp>
+#include <reservoir/timer.hpp>
+#include <reservoir/util.hpp>
+
+#include <tlx/define.hpp>
+#include <tlx/die/core.hpp>
+
+#include <boost/mpi.hpp>
+
+#include <algorithm>
+#include <deque>
+#include <limits>
+#include <utility>
+#include <vector>
+
+namespace mpi = boost::mpi;
+
+namespace reservoir {
+
+// Weighted reservoir sampling over a sliding window: the sample consists of
+// the `size` items with the smallest keys among the items of the batches that
+// are still in the window.  Every batch has a time stamp (by default, its
+// number), and a batch expires once its time stamp is at most now - window.
+// Thus, with the default time stamps, the window consists of the last `window`
+// batches, and with wall-clock time stamps, of the last `window` seconds.
+//
+// Every batch keeps its own tree of candidates: the items that are among the
+// `size` globally smallest keys of that batch.  These are found the same way
+// as in the first batch of the reservoir, i.e., with local thresholding and
+// skips, so that the insertion cost is proportional to the number of accepted
+// candidates, followed by a distributed selection.  Expired batches are
+// dropped as a whole.  The window sample is selected from the candidates of
+// all batches that can be part of it, namely those whose key is at most the
+// smallest of the batch thresholds, by a multiway merge of the batches' trees.
+template <typename Key, template <typename> typename select_t, typename RNG>
+class reservoir_window {
+public:
+    static constexpr const char *short_name = "[win]";
+
+    using key_type = Key;
+    using reservoir_type = btree_multimap<double, key_type>;
+    using value_type = typename reservoir_type::value_type;
+    // candidate for the window sample: its key, and its id in the tree of its
+    // batch, so that ids are never copied
+    using window_item = std::pair<double, const key_type *>;
+    using window_seq =
+        sorted_range_seq<typename std::vector<window_item>::const_iterator>;
+    using select_type = select_t<reservoir_type>;
+    using window_select_type = select_t<window_seq>;
+    // current and end position in the candidates of a batch, for merging
+    using merge_head = std::pair<typename reservoir_type::const_iterator,
+                                 typename reservoir_type::const_iterator>;
+
+    static constexpr bool check = false;
+    static constexpr bool debug = false;
+    static constexpr bool time = true;
+
+    reservoir_window(mpi::communicator &comm, size_t size, double window,
+                     size_t seed)
+        : select_(comm, seed + static_cast<size_t>(comm.size() + comm.rank())),
+          window_select_(comm, seed + static_cast<size_t>(2 * comm.size() +
+                                                          comm.rank())),
+          rng_(seed + static_cast<size_t>(comm.rank())), comm_(comm),
+          size_(size), window_(window), threshold_(0.0), window_size_(0),
+          batch_id_(0) {
+        tlx_die_verbose_unless(window > 0, "Invalid window " << window);
+        LOGRC(check) << "Checking is active, things might be slow!";
+    }
+
+    // Insert a batch whose time stamp is its number
+    template <typename Iterator>
+    void insert(Iterator begin, Iterator end) {
+        insert(begin, end, static_cast<double>(batch_id_));
+    }
+
+    // Iterator should dereference to (weight, id) pairs.  Time stamps must be
+    // non-decreasing and the same on all PEs.
+    template <typename Iterator>
+    void insert(Iterator begin, Iterator end, double stamp) {
+        timer t, t_total;
+
+        pLOG << "batch " << batch_id_ << " beginning at time " << stamp;
+
+        // Step 1: find local candidates of this batch
+        current_.clear();
+        process(begin, end);
+        if constexpr (time) {
+            stats_.record("size", current_.size());
+            double t_insert = t.get();
+            stats_.record("insert", t_insert);
+            LOG0 << "RESULT op=insert pe=" << comm_.rank()
+                 << " np=" << comm_.size() << " batchsize=" << end - begin
+                 << " batch=" << batch_id_ << " samplesize=" << size_
+                 << " time=" << t_insert;
+            t.reset();
+        }
+
+        // Step 2: keep only the `size_` globally smallest keys of the batch
+        size_t batch_size = current_.size();
+        mpi::all_reduce(comm_, mpi::inplace(batch_size), std::plus<>());
+        double batch_threshold = std::numeric_limits<double>::infinity();
+        if (batch_size > size_) {
+            auto [split_it, num_keep] = select_(current_, size_);
+            current_.truncate(static_cast<size_t>(num_keep));
+            double max_local =
+                current_.empty() ? 0.0 : std::prev(current_.end())->first;
+            batch_threshold =
+                mpi::all_reduce(comm_, max_local, mpi::maximum<double>());
+        }
+        if constexpr (time) {
+            double t_select = t.get();
+            stats_.record("select", t_select);
+            LOG0 << "RESULT op=select pe=" << comm_.rank()
+                 << " np=" << comm_.size() << " batchsize=" << end - begin
+                 << " batch=" << batch_id_ << " samplesize=" << size_
+                 << " time=" << t_select;
+            t.reset();
+        }
+
+        // Step 3: add the batch to the window, drop expired batches
+        batches_.push_back(batch{stamp, batch_threshold, std::move(current_)});
+        while (batches_.front().stamp <= stamp - window_) {
+            batches_.pop_front();
+        }
+        sLOGR << "batch" << batch_id_ << "threshold" << batch_threshold
+              << "window has" << batches_.size() << "batches";
+        if constexpr (time) {
+            double t_expire = t.get();
+            stats_.record("expire", t_expire);
+            t.reset();
+        }
+
+        // Step 4: select the window sample and determine the new threshold
+        select_window();
+        if constexpr (time) {
+            double t_window = t.get();
+            stats_.record("window", t_window);
+            LOG0 << "RESULT op=window pe=" << comm_.rank()
+                 << " np=" << comm_.size() << " batchsize=" << end - begin
+                 << " batch=" << batch_id_ << " samplesize=" << size_
+                 << " time=" << t_window;
+            t.reset();
+
+            stats_.record("total", t_total.get());
+        }
+
+        pLOG << "batch " << batch_id_ << " done";
+
+        ++batch_id_;
+    }
+
+    // Calls callback with the (key, item) pairs of the local window sample.
+    // The pairs hold a reference to the item.
+    template <typename Callback>
+    void sample(Callback &&callback) const {
+        for (size_t i = 0; i < window_size_; i++) {
+            callback(std::pair<double, const key_type &>(
+                window_items_[i].first, *window_items_[i].second));
+        }
+    }
+
+    // The largest key in the window sample
+    double threshold() const {
+        return threshold_;
+    }
+
+    _detail::res_stats<time> &get_stats() {
+        return stats_;
+    }
+
+    auto get_mss_stats() {
+        return select_.get_stats();
+    }
+
+protected:
+    struct batch {
+        // time stamp of the batch
+        double stamp;
+        // the largest key of the batch that is part of the candidates
+        double threshold;
+        // local candidates of the batch
+        reservoir_type tree;
+    };
+
+    // Insert the local candidates of [begin, end) into current_.  Any item that
+    // isn't among the `size_` smallest local keys of the batch can't be part
+    // of the sample for any window, so every time the tree grows too large,
+    // discard its largest keys and skip items using the new local threshold.
+    template <typename Iterator>
+    void process(Iterator begin, Iterator end) {
+        Iterator it = begin;
+        size_t size_thresh = std::max(3 * size_ / 2, size_ + 500);
+        while (it != end && current_.size() < size_thresh) {
+            // generate exponentially distributed variables
+            double key = rng_.next_exponential(it->first);
+            current_.insert2(key, (*it).second);
+            ++it;
+        }
+
+        // Do local thresholding whenever the size exceeds 1.1*size_
+        size_thresh = std::max(11 * size_ / 10, size_ + 250);
+        double local_threshold = 0;
+        while (it != end) {
+            if (current_.size() >= size_thresh) {
+                auto thresh_it = current_.find_rank(size_);
+                local_threshold = thresh_it->first;
+                current_.truncate(size_);
+            }
+            tlx_die_unless(local_threshold > 0);
+
+            it = insert_skip<false>(it, end, local_threshold);
+        }
+    }
+
+    // Merge the sorted candidates of all batches that can be part of the
+    // window sample and select the `size_` smallest of them.  The merge stops
+    // at the bound, and after `size_` items, as no PE contributes more than
+    // that to the sample.
+    void select_window() {
+        double bound = std::numeric_limits<double>::infinity();
+        for (const batch &b : batches_) {
+            bound = std::min(bound, b.threshold);
+        }
+
+        heap_.clear();
+        for (const batch &b : batches_) {
+            if (!b.tree.empty() && b.tree.begin()->first <= bound) {
+                heap_.emplace_back(b.tree.begin(), b.tree.end());
+            }
+        }
+        auto greater = [](const merge_head &a, const merge_head &b) {
+            return a.first->first > b.first->first;
+        };
+        std::make_heap(heap_.begin(), heap_.end(), greater);
+
+        window_items_.clear();
+        while (!heap_.empty() && window_items_.size() < size_) {
+            std::pop_heap(heap_.begin(), heap_.end(), greater);
+            merge_head &head = heap_.back();
+            window_items_.emplace_back(head.first->first, &head.first->second);
+            if (++head.first == head.second || head.first->first > bound) {
+                heap_.pop_back();
+            } else {
+                std::push_heap(heap_.begin(), heap_.end(), greater);
+            }
+        }
+
+        size_t num_candidates = window_items_.size();
+        mpi::all_reduce(comm_, mpi::inplace(num_candidates), std::plus<>());
+        window_size_ = window_items_.size();
+        if (num_candidates > size_) {
+            window_seq seq = make_sorted_range_seq(window_items_);
+            auto [split_it, num_keep] = window_select_(seq, size_);
+            window_size_ = static_cast<size_t>(num_keep);
+        }
+
+        double max_local =
+            window_size_ == 0 ? 0.0 : window_items_[window_size_ - 1].first;
+        threshold_ = mpi::all_reduce(comm_, max_local, mpi::maximum<double>());
+        LOGR << "window sample of " << std::min(num_candidates, size_)
+             << " items from " << num_candidates << " candidates, threshold "
+             << threshold_;
+    }
+
+    template <size_t w, typename Iterator>
+    constexpr double vec_sum(Iterator it) {
+        if constexpr (w == 1) {
+            return it->first;
+        } else if constexpr (w == 3) {
+            return it->first + (it + 1)->first + (it + 2)->first;
+        } else {
+            return vec_sum<w / 2>(it) + vec_sum<w / 2>(it + w / 2);
+        }
+    }
+
+    template <bool far, typename Iterator>
+    TLX_ATTRIBUTE_ALWAYS_INLINE Iterator insert_skip(Iterator it, Iterator end,
+                                                     double threshold) {
+        double skip = rng_.next_exponential(threshold);
+
+        if constexpr (far) {
+            // number of elements to skip at a time
+            constexpr size_t w = 32;
+
+            double sum = 0.0;
+            // Check that the next w items (including this) appear before `end`
+            Iterator curr_last = it + (w - 1);
+            Iterator prev = it;
+            while (curr_last < end && skip >= 0) {
+                sum = vec_sum<w>(it);
+                skip -= sum;
+                prev = it;
+                // Avoid advancing iterator twice, it might not be a random
+                // access iterator
+                it = curr_last + 1;
+                curr_last += w;
+            }
+            if (skip < 0) {
+                // undo jump
+                it = prev;
+                skip += sum;
+            } else if (it >= end) {
+                return end;
+            }
+        }
+
+        while (++it != end && skip >= 0) {
+            skip -= it->first;
+        }
+        if (it == end)
+            return it;
+
+        double minv = std::exp(-threshold * it->first);
+        double r = rng_.next(minv, 1.0);
+        double key = -std::log(r) / it->first;
+        my_assert(key > 0);
+        current_.insert2(key, (*it).second);
+        return it;
+    }
+
+    std::deque<batch> batches_;
+    reservoir_type current_;
+    std::vector<window_item> window_items_;
+    std::vector<merge_head> heap_;
+    select_type select_;
+    window_select_type window_select_;
+    RNG rng_;
+    mpi::communicator &comm_;
+    size_t size_;
+    double window_;
+    double threshold_;
+    size_t window_size_;
+
+    size_t batch_id_;
+    mutable _detail::res_stats<time> stats_;
+};
+
+} // namespace reservoir
+
+#endif // RESERVOIR_RESERVOIR_WINDOW_HEADER
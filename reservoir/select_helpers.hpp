@@ -243,6 +243,19 @@ struct select_stats<true> {
 };
 
 
+// Iterators to the elements of ranks min_idx and max_idx of seq, or end() if a
+// rank is out of range, looked up in a single descent
+template <typename Seq, typename Iterator = typename Seq::const_iterator>
+std::pair<Iterator, Iterator> find_rank_range(const Seq &seq, ssize_t min_idx,
+                                              ssize_t max_idx) {
+    const size_t ranks[2] = {static_cast<size_t>(min_idx),
+                             static_cast<size_t>(max_idx)};
+    Iterator its[2];
+    seq.find_ranks(ranks, ranks + 2, its);
+    return std::make_pair(its[0], its[1]);
+}
+
+
 template <typename Seq, typename Stats>
 void dump_state(const Seq &seq, const Stats &stats, ssize_t min_idx,
                 ssize_t max_idx, ssize_t local_size, ssize_t global_size,
@@ -251,9 +264,9 @@ void dump_state(const Seq &seq, const Stats &stats, ssize_t min_idx,
                 const std::string &short_name, mpi::communicator &comm_) {
     std::stringstream elems;
     elems << "[";
-    auto begin = seq.find_rank(min_idx), end = seq.find_rank(max_idx);
+    auto [begin, end] = find_rank_range(seq, min_idx, max_idx);
     while (begin != end) {
-        elems << begin->first << ", ";
+        elems << Seq::key_of_value::get(*begin) << ", ";
         ++begin;
     }
     elems << "]";
@@ -364,7 +377,7 @@ std::tuple<ssize_t, ssize_t, Iterator, Iterator>
 get_bounds(const Seq &seq, Stats &stats_, Key pivot, ssize_t min_idx,
            ssize_t max_idx, mpi::communicator &comm_,
            const std::string &short_name, const bool debug) {
-    Iterator min_it = seq.find_rank(min_idx), max_it = seq.find_rank(max_idx);
+    auto [min_it, max_it] = find_rank_range(seq, min_idx, max_idx);
     return get_bounds<true>(seq, stats_, pivot, min_idx, max_idx, min_it,
                             max_it, comm_, short_name, debug);
 }
@@ -388,6 +401,30 @@ std::pair<ssize_t, ssize_t> global_bound(const ssize_t ub_pos, const ssize_t lb_
 }
 
 
+// Split the items equal to the pivot, [lb_pos, ub_pos), given the inclusive
+// prefix sum of ub_pos - lb_pos over all PEs, such that target_count of them
+// are included globally
+template <typename Iterator>
+std::pair<Iterator, ssize_t>
+split_eq_range(ssize_t ub_pos, Iterator ub_it, ssize_t lb_pos, Iterator lb_it,
+               ssize_t min_idx, ssize_t target_count, ssize_t prefsum) {
+    const ssize_t my_count = ub_pos - lb_pos;
+    if (prefsum < target_count) {
+        // return all
+        return std::make_pair(ub_it, min_idx + ub_pos);
+    } else if (prefsum - my_count > target_count) {
+        // return none
+        return std::make_pair(lb_it, min_idx + lb_pos);
+    } else {
+        // return some. Inclusive prefix sum -> re-add my_count
+        ssize_t count = target_count - prefsum + my_count;
+        Iterator it = lb_it;
+        std::advance(it, count);
+        return std::make_pair(it, min_idx + lb_pos + count);
+    }
+}
+
+
 template <typename Iterator>
 std::pair<Iterator, ssize_t>
 find_eq_pos(ssize_t global_ub, ssize_t ub_pos, Iterator ub_it,
@@ -418,20 +455,8 @@ find_eq_pos(ssize_t global_ub, ssize_t ub_pos, Iterator ub_it,
     spLOG << "Non-unique pivot, global lb:" << global_lb << "ub:" << global_ub
           << "have" << my_count << "locally, prefsum:" << prefsum;
 
-    if (prefsum < target_count) {
-        // return all
-        return std::make_pair(ub_it, min_idx + ub_pos);
-    } else if (prefsum - my_count > target_count) {
-        // return none
-        return std::make_pair(lb_it, min_idx + lb_pos);
-    } else {
-        // return some. Inclusive prefix sum -> re-add my_count
-        ssize_t count = target_count - prefsum + my_count;
-        spLOG << "Returning some:" << count << "of" << my_count;
-        Iterator it = lb_it;
-        std::advance(lb_it, count);
-        return std::make_pair(it, min_idx + lb_pos + count);
-    }
+    return split_eq_range(ub_pos, ub_it, lb_pos, lb_it, min_idx, target_count,
+                          prefsum);
 }
 
 } // namespace reservoir::_detail
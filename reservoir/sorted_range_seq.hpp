@@ -0,0 +1,185 @@
+/*******************************************************************************
+ * reservoir/sorted_range_seq.hpp
+ *
+ * Sequence adaptor providing the rank interface of the B-tree on sorted
+ * random-access ranges, for use with the selection algorithms
+ *
+ * Copyright (C) 2019 Lorenz Hübschle-Schneider <lorenz@4z2.de>
+ *
+ * All rights reserved. Published under the GNU General Public License 3
+ ******************************************************************************/
+
+#pragma once
+#ifndef RESERVOIR_SORTED_RANGE_SEQ_HEADER
+#define RESERVOIR_SORTED_RANGE_SEQ_HEADER
+
+#include <tlx/die/core.hpp>
+
+#include <algorithm>
+#include <cstddef>
+#include <functional>
+#include <iterator>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace reservoir {
+
+namespace _detail {
+template <typename T>
+struct is_pair : std::false_type {};
+
+template <typename T1, typename T2>
+struct is_pair<std::pair<T1, T2>> : std::true_type {};
+
+// Key extractor: the first element of pairs (like a map), the element itself
+// for everything else (like a set)
+template <typename Value, bool = is_pair<Value>::value>
+struct default_key_of_value {
+    using key_type = Value;
+    static const key_type &get(const Value &v) noexcept {
+        return v;
+    }
+};
+
+template <typename Value>
+struct default_key_of_value<Value, true> {
+    using key_type = typename Value::first_type;
+    static const key_type &get(const Value &v) noexcept {
+        return v.first;
+    }
+};
+} // namespace _detail
+
+// Adaptor for a sorted random-access range (e.g., a sorted std::vector or a
+// memory-mapped sorted file) that provides the parts of the B-tree interface
+// used by the selection algorithms (ams_select, ams_select_multi, fr_select).
+// Rank queries are answered with binary search.  The range is not copied, it
+// must outlive the adaptor and may not be modified while it is in use.
+template <typename RandomIt,
+          typename KeyOfValue = _detail::default_key_of_value<std::remove_cv_t<
+              typename std::iterator_traits<RandomIt>::value_type>>,
+          typename Compare = std::less<typename KeyOfValue::key_type>>
+class sorted_range_seq {
+public:
+    using const_iterator = RandomIt;
+    using iterator = RandomIt;
+    using value_type = std::remove_cv_t<
+        typename std::iterator_traits<RandomIt>::value_type>;
+    using key_of_value = KeyOfValue;
+    using key_type = typename KeyOfValue::key_type;
+    using key_compare = Compare;
+    using size_type = size_t;
+
+    static_assert(std::is_base_of_v<std::random_access_iterator_tag,
+                                    typename std::iterator_traits<
+                                        RandomIt>::iterator_category>,
+                  "sorted_range_seq requires random-access iterators");
+
+    sorted_range_seq(RandomIt begin, RandomIt end,
+                     const key_compare &cmp = key_compare())
+        : begin_(begin), end_(end), cmp_(cmp) {}
+
+    size_type size() const {
+        return static_cast<size_type>(end_ - begin_);
+    }
+
+    bool empty() const {
+        return begin_ == end_;
+    }
+
+    const_iterator begin() const {
+        return begin_;
+    }
+
+    const_iterator end() const {
+        return end_;
+    }
+
+    key_compare key_comp() const {
+        return cmp_;
+    }
+
+    // iterator to the element with the given rank, or end() if rank >= size()
+    const_iterator find_rank(size_type rank) const {
+        if (rank >= size())
+            return end_;
+        return begin_ + static_cast<difference_type>(rank);
+    }
+
+    // find_rank for each rank of the sorted range [first, last)
+    template <typename RankIterator, typename OutputIterator>
+    OutputIterator find_ranks(RankIterator first, RankIterator last,
+                              OutputIterator out) const {
+        for (; first != last; ++first) {
+            *out++ = find_rank(static_cast<size_type>(*first));
+        }
+        return out;
+    }
+
+    // the smallest rank of an element with the given key, or size() if no such
+    // element exists
+    std::pair<size_type, const_iterator> rank_of(const key_type &key) const {
+        auto [rank, it] = rank_of_lower_bound(key);
+        if (it != end_ && !cmp_(key, key_of_value::get(*it)))
+            return {rank, it};
+        return {size(), end_};
+    }
+
+    // the rank of the element referenced by iter
+    size_type rank_of(const_iterator iter) const {
+        return static_cast<size_type>(iter - begin_);
+    }
+
+    // the smallest rank of an element with a key not less than the given key
+    std::pair<size_type, const_iterator>
+    rank_of_lower_bound(const key_type &key) const {
+        const_iterator it =
+            std::partition_point(begin_, end_, [&](const value_type &v) {
+                return cmp_(key_of_value::get(v), key);
+            });
+        return {rank_of(it), it};
+    }
+
+    // the smallest rank of an element with key greater than the given key
+    std::pair<size_type, const_iterator>
+    rank_of_upper_bound(const key_type &key) const {
+        const_iterator it =
+            std::partition_point(begin_, end_, [&](const value_type &v) {
+                return !cmp_(key, key_of_value::get(v));
+            });
+        return {rank_of(it), it};
+    }
+
+    // check that the range is sorted
+    void verify() const {
+        tlx_die_unless(std::is_sorted(
+            begin_, end_, [&](const value_type &a, const value_type &b) {
+                return cmp_(key_of_value::get(a), key_of_value::get(b));
+            }));
+    }
+
+private:
+    using difference_type =
+        typename std::iterator_traits<RandomIt>::difference_type;
+
+    RandomIt begin_, end_;
+    key_compare cmp_;
+};
+
+// Adapt a sorted vector
+template <typename T, typename Alloc>
+sorted_range_seq<typename std::vector<T, Alloc>::const_iterator>
+make_sorted_range_seq(const std::vector<T, Alloc> &vec) {
+    return {vec.cbegin(), vec.cend()};
+}
+
+// Adapt a sorted array, e.g., a memory-mapped sorted file
+template <typename T>
+sorted_range_seq<const T *> make_sorted_range_seq(const T *data, size_t size) {
+    return {data, data + size};
+}
+
+} // namespace reservoir
+
+#endif // RESERVOIR_SORTED_RANGE_SEQ_HEADER
@@ -52,6 +52,19 @@ struct btree_traits_speed : reservoir::btree_default_traits<size_t, size_t> {
     static const size_t binsearch_threshold = 256 * 1024 * 1024; // never
 };
 
+//! Traits for the double key search tests. Without SIMD search, the default
+//! linear search for small nodes and binary search for large nodes is used.
+template <int Slots, bool SimdSearch>
+struct btree_traits_double : reservoir::btree_default_traits<double, double> {
+    static const bool self_verify = false;
+    static const bool debug = false;
+
+    static const int leaf_slots = Slots;
+    static const int inner_slots = Slots;
+
+    static const bool simd_search = SimdSearch;
+};
+
 // -----------------------------------------------------------------------------
 
 //! Test a generic set type with insertions
@@ -171,6 +184,66 @@ struct TestFactory_Set {
 
 // -----------------------------------------------------------------------------
 
+//! Test a set of doubles with find sequences, which exercise the node search
+template <typename SetType>
+class Test_DoubleSet_Find {
+public:
+    SetType set;
+
+    static const char* op() {
+        return "double_set_find";
+    }
+
+    Test_DoubleSet_Find(size_t items) {
+        std::default_random_engine rng(seed);
+        std::uniform_real_distribution<double> dist;
+        for (size_t i = 0; i < items; i++)
+            set.insert(dist(rng));
+
+        die_unless(set.size() == items);
+    }
+
+    void run(size_t items) {
+        std::default_random_engine rng(seed);
+        std::uniform_real_distribution<double> dist;
+        for (size_t i = 0; i < items; i++)
+            set.find(dist(rng));
+    }
+};
+
+//! Construct double sets with and without SIMD node search
+template <template <typename SetType> class TestClass>
+struct TestFactory_DoubleSet {
+    //! Test the multiset red-black tree from STL
+    using StdSet = TestClass<std::multiset<double>>;
+
+    //! Test the forked B+ tree with the vectorized node search
+    template <int Slots>
+    struct BtreeSimdSet
+        : TestClass<reservoir::btree_multiset<
+              double, std::less<>, btree_traits_double<Slots, true>>> {
+        BtreeSimdSet(size_t n)
+            : TestClass<reservoir::btree_multiset<
+                  double, std::less<>, btree_traits_double<Slots, true>>>(n) {}
+    };
+
+    //! Test the forked B+ tree with the scalar linear or binary node search
+    template <int Slots>
+    struct BtreeScalarSet
+        : TestClass<reservoir::btree_multiset<
+              double, std::less<>, btree_traits_double<Slots, false>>> {
+        BtreeScalarSet(size_t n)
+            : TestClass<reservoir::btree_multiset<
+                  double, std::less<>, btree_traits_double<Slots, false>>>(n) {
+        }
+    };
+
+    //! Run tests on all set types
+    void call_testrunner(size_t items);
+};
+
+// -----------------------------------------------------------------------------
+
 //! Test a generic map type with insertions
 template <typename MapType>
 class Test_Map_Insert {
@@ -396,6 +469,32 @@ void TestFactory_Set<TestClass>::call_testrunner(size_t items) {
 #endif
 }
 
+template <template <typename Type> class TestClass>
+void TestFactory_DoubleSet<TestClass>::call_testrunner(size_t items) {
+    testrunner_loop<StdSet>(items, "std::multiset");
+
+    testrunner_loop<BtreeSimdSet<8>>(items, "reservoir::btree_multiset<8> simd slots=8");
+    testrunner_loop<BtreeSimdSet<16>>(items,
+                                      "reservoir::btree_multiset<16> simd slots=16");
+    testrunner_loop<BtreeSimdSet<32>>(items,
+                                      "reservoir::btree_multiset<32> simd slots=32");
+    testrunner_loop<BtreeSimdSet<64>>(items,
+                                      "reservoir::btree_multiset<64> simd slots=64");
+    testrunner_loop<BtreeSimdSet<128>>(
+        items, "reservoir::btree_multiset<128> simd slots=128");
+
+    testrunner_loop<BtreeScalarSet<8>>(items,
+                                       "reservoir::btree_multiset<8> scalar slots=8");
+    testrunner_loop<BtreeScalarSet<16>>(
+        items, "reservoir::btree_multiset<16> scalar slots=16");
+    testrunner_loop<BtreeScalarSet<32>>(
+        items, "reservoir::btree_multiset<32> scalar slots=32");
+    testrunner_loop<BtreeScalarSet<64>>(
+        items, "reservoir::btree_multiset<64> scalar slots=64");
+    testrunner_loop<BtreeScalarSet<128>>(
+        items, "reservoir::btree_multiset<128> scalar slots=128");
+}
+
 template <template <typename Type> class TestClass>
 void TestFactory_Map<TestClass>::call_testrunner(size_t items) {
     testrunner_loop<StdMap>(items, "std::multimap");
@@ -464,6 +563,16 @@ int main() {
         }
     }
 
+    { // Set of doubles - speed test find only, SIMD vs. scalar node search
+
+        repeat_until = min_items;
+
+        for (size_t items = min_items; items <= max_items; items *= 2) {
+            std::cout << "double set: find " << items << "\n";
+            TestFactory_DoubleSet<Test_DoubleSet_Find>().call_testrunner(items);
+        }
+    }
+
     { // Map - speed test only insertion
 
         repeat_until = min_items;
@@ -14,13 +14,20 @@
 #include <reservoir/btree_multimap.hpp>
 #include <reservoir/btree_multiset.hpp>
 #include <reservoir/btree_set.hpp>
+#include <reservoir/concurrent_btree.hpp>
+#include <reservoir/reclaimer.hpp>
 
 #include <tlx/die.hpp>
 
+#include <algorithm>
 #include <cmath>
 #include <cstddef>
 #include <iostream>
+#include <map>
+#include <memory>
+#include <numeric>
 #include <set>
+#include <thread>
 #include <vector>
 
 #if RESERVOIR_MORE_TESTS
@@ -46,6 +53,45 @@ template class reservoir::btree_map<int, double>;
 template class reservoir::btree_multiset<int>;
 template class reservoir::btree_multimap<int, int>;
 
+//! Allocator that counts the live objects it allocated, to check that nodes
+//! are freed with the allocator of their tree
+template <typename T>
+struct counting_allocator : std::allocator<T> {
+    std::shared_ptr<long> live;
+
+    template <typename U>
+    struct rebind {
+        using other = counting_allocator<U>;
+    };
+
+    counting_allocator() = default;
+    explicit counting_allocator(std::shared_ptr<long> l) : live(std::move(l)) {}
+    template <typename U>
+    counting_allocator(const counting_allocator<U>& other) // NOLINT
+        : live(other.live) {}
+
+    T* allocate(size_t n) {
+        if (live)
+            *live += static_cast<long>(n);
+        return std::allocator<T>::allocate(n);
+    }
+
+    void deallocate(T* p, size_t n) {
+        if (live)
+            *live -= static_cast<long>(n);
+        std::allocator<T>::deallocate(p, n);
+    }
+
+    template <typename U>
+    bool operator==(const counting_allocator<U>& other) const {
+        return live == other.live;
+    }
+    template <typename U>
+    bool operator!=(const counting_allocator<U>& other) const {
+        return live != other.live;
+    }
+};
+
 /******************************************************************************/
 // Simple Tests
 
@@ -346,6 +392,605 @@ struct SimpleTest {
         }
     }
 
+    static void test_tree_find_ranks_10000() {
+        using BTree = reservoir::BTree<int, int, key_of_value<int, int>,
+                                       std::less<>, traits_nodebug<int>, true>;
+        BTree tr;
+        std::vector<size_t> ranks;
+        std::vector<typename BTree::const_iterator> its;
+        srand(5);
+        for (size_t n : { 0, 1, 10, 100, 1000, 10000 }) {
+            while (tr.size() < n)
+                tr.insert(rand() % 1000);
+            const BTree& ctr = tr;
+            // batches of sorted ranks, with duplicates and ranks past the end
+            for (size_t batch : { 0, 1, 2, 16, 64, 1000 }) {
+                ranks.clear();
+                for (size_t i = 0; i < batch; ++i)
+                    ranks.push_back(static_cast<size_t>(rand()) % (n + 10));
+                std::sort(ranks.begin(), ranks.end());
+                its.assign(batch, typename BTree::const_iterator());
+                auto out = ctr.find_ranks(ranks.begin(), ranks.end(),
+                                          its.begin());
+                die_unless(out == its.end());
+                for (size_t i = 0; i < batch; ++i)
+                    die_unless(its[i] == ctr.find_rank(ranks[i]));
+            }
+        }
+        // all ranks at once
+        ranks.resize(tr.size());
+        std::iota(ranks.begin(), ranks.end(), 0);
+        std::vector<typename BTree::iterator> all(ranks.size());
+        tr.find_ranks(ranks.begin(), ranks.end(), all.begin());
+        auto it = tr.begin();
+        for (size_t i = 0; i < all.size(); ++i, ++it)
+            die_unless(all[i] == it);
+    }
+
+    static void test_tree_rank_modify_10000() {
+        using BTree = reservoir::BTree<int, int, key_of_value<int, int>,
+                                       std::less<>, traits_nodebug<int>, true>;
+        // check the ranks of some keys, which are computed from the child
+        // counts of the inner nodes, against a std::multiset
+        auto check = [](const BTree& tree, const std::multiset<int>& set) {
+            tree.verify();
+            die_unless(tree.size() == set.size());
+            for (int key = -1; key < 1001; key += 37) {
+                size_t rank = static_cast<size_t>(
+                    std::distance(set.begin(), set.lower_bound(key)));
+                die_unless(tree.rank_of_lower_bound(key).first == rank);
+                rank = static_cast<size_t>(
+                    std::distance(set.begin(), set.upper_bound(key)));
+                die_unless(tree.rank_of_upper_bound(key).first == rank);
+            }
+            size_t i = 0;
+            for (auto sit = set.begin(); sit != set.end(); ++sit, ++i) {
+                if (i % 97 == 0)
+                    die_unless(*tree.find_rank(i) == *sit);
+            }
+        };
+
+        BTree tr;
+        std::multiset<int> set;
+        srand(3);
+        for (size_t i = 0; i < 10000; ++i) {
+            int key = rand() % 1000;
+            tr.insert(key);
+            set.insert(key);
+        }
+        check(tr, set);
+
+        // erase with merges and shifts of the nodes
+        for (size_t i = 0; i < 7000; ++i) {
+            int key = rand() % 1000;
+            if (tr.erase_one(key))
+                set.erase(set.find(key));
+        }
+        check(tr, set);
+
+        // split and re-join
+        for (size_t split : {size_t{1}, set.size() / 2, set.size() - 1}) {
+            BTree left, right;
+            tr.splitAt(left, split, right);
+            die_unless(left.size() == split);
+            left.verify();
+            right.verify();
+            left.join(right);
+            tr.swap(left);
+            check(tr, set);
+        }
+
+        // bulk load and insert again
+        std::vector<int> keys(set.begin(), set.end());
+        BTree loaded;
+        loaded.bulk_load(keys.begin(), keys.end());
+        check(loaded, set);
+        for (size_t i = 0; i < 5000; ++i) {
+            int key = rand() % 1000;
+            loaded.insert(key);
+            set.insert(key);
+        }
+        check(loaded, set);
+    }
+
+    static void test_double_search_10000() {
+        // double keys with std::less use the vectorized node search, in the
+        // leaves of the multiset and in the inner nodes of both trees
+        using set_type = reservoir::btree_multiset<double, std::less<>,
+                                                   traits_nodebug<double>>;
+        using map_type =
+            reservoir::btree_multimap<double, int, std::less<double>,
+                                      traits_nodebug<double>>;
+        set_type bs;
+        map_type bm;
+        std::multiset<double> set;
+        srand(4);
+        for (int i = 0; i < 10000; ++i) {
+            double key = (rand() % 2000) / 4.0;
+            bs.insert(key);
+            bm.insert2(key, i);
+            set.insert(key);
+        }
+        bs.verify();
+        bm.verify();
+
+        for (double key = -1.0; key < 501.0; key += 0.625) {
+            size_t lower = static_cast<size_t>(
+                std::distance(set.begin(), set.lower_bound(key)));
+            size_t upper = static_cast<size_t>(
+                std::distance(set.begin(), set.upper_bound(key)));
+            die_unless(bs.rank_of_lower_bound(key).first == lower);
+            die_unless(bs.rank_of_upper_bound(key).first == upper);
+            die_unless(bm.rank_of_lower_bound(key).first == lower);
+            die_unless(bm.rank_of_upper_bound(key).first == upper);
+            die_unless(bs.count(key) == upper - lower);
+            die_unless(bm.count(key) == upper - lower);
+        }
+    }
+
+    template <typename KeyType>
+    struct traits_split : traits_nodebug<KeyType> {
+        static const bool split_leaves = true;
+    };
+
+    static void test_multimap_split_leaves_10000() {
+        using btree_type =
+            reservoir::btree_multimap<double, int, std::less<>,
+                                      traits_split<double>>;
+        static_assert(btree_type::btree_impl::split_leaves);
+        btree_type bt;
+        std::multimap<double, int> map;
+        srand(5);
+        for (int i = 0; i < 10000; ++i) {
+            double key = (rand() % 1000) / 4.0;
+            bt.insert2(key, i);
+            map.emplace(key, i);
+        }
+        // erase all items with some keys, erase_one() may pick any of them
+        for (int i = 0; i < 300; ++i) {
+            double key = (rand() % 1000) / 4.0;
+            die_unless(bt.erase(key) == map.erase(key));
+        }
+        bt.verify();
+        die_unless(bt.size() == map.size());
+
+        // the data must stay with its key, compare the multisets of data of
+        // every key with the reference
+        auto check = [&map](const btree_type& tree) {
+            die_unless(tree.size() == map.size());
+            std::vector<std::pair<double, int>> a, b(map.begin(), map.end());
+            for (auto it = tree.begin(); it != tree.end(); ++it)
+                a.emplace_back(it->first, it->second);
+            std::sort(a.begin(), a.end());
+            std::sort(b.begin(), b.end());
+            die_unless(a == b);
+        };
+        check(bt);
+
+        // modify the data through the iterators
+        for (auto it = bt.begin(); it != bt.end(); ++it)
+            it->second *= 2;
+        for (auto& [key, data] : map)
+            data *= 2;
+        check(bt);
+
+        const size_t size = bt.size();
+        for (size_t split : {size_t{1}, size / 3, size - 1}) {
+            btree_type left, right;
+            bt.splitAt(left, split, right);
+            die_unless(left.size() == split);
+            left.verify();
+            right.verify();
+            left.join(right);
+            bt = std::move(left);
+            check(bt);
+        }
+
+        btree_type copy(bt);
+        die_unless(copy == bt);
+
+        bt.transform_keys([](double key) { return 2 * key; });
+        bt.verify();
+        die_unless(!(copy == bt));
+
+        std::vector<std::pair<double, int>> sorted(map.begin(), map.end());
+        btree_type loaded;
+        loaded.bulk_load(sorted.begin(), sorted.end());
+        loaded.verify();
+        check(loaded);
+    }
+
+    static void test_multimap_split_leaves_move_only_10000() {
+        using btree_type =
+            reservoir::btree_multimap<int, std::unique_ptr<int>, std::less<>,
+                                      traits_split<int>>;
+        btree_type bt;
+        srand(6);
+        for (int i = 0; i < 10000; ++i) {
+            int key = rand() % 1000;
+            bt.insert2(key, std::make_unique<int>(key));
+        }
+        for (int key = 0; key < 1000; key += 3) {
+            while (bt.erase_one(key)) {
+            }
+        }
+        bt.verify();
+
+        const size_t size = bt.size();
+        for (size_t split : {size_t{1}, size / 2, size - 1}) {
+            btree_type left, right;
+            bt.splitAt(left, split, right);
+            die_unless(left.size() == split);
+            left.join(right);
+            bt = std::move(left);
+            for (auto it = bt.begin(); it != bt.end(); ++it)
+                die_unless(it->second && *it->second == it->first);
+        }
+        die_unless(bt.size() == size);
+    }
+
+    static void test_bulk_load_parallel_10000() {
+        using btree_type =
+            reservoir::btree_multimap<int, int, std::less<>,
+                                      traits_nodebug<int>>;
+        using value_type = std::pair<int, int>;
+        using iterator = typename std::vector<value_type>::const_iterator;
+        srand(13);
+        for (size_t n : { 0, 1, 2, Slots, Slots + 1, 10 * Slots, 10000 }) {
+            std::vector<value_type> items;
+            for (size_t i = 0; i < n; ++i)
+                items.emplace_back(rand() % 100, static_cast<int>(i));
+            std::sort(items.begin(), items.end());
+
+            for (size_t threads : { 1, 3, 8 }) {
+                btree_type bt;
+                bt.bulk_load_parallel(items.begin(), items.end(), threads);
+                bt.verify();
+                die_unless(bt.size() == n);
+                die_unless(std::equal(bt.begin(), bt.end(), items.begin()));
+
+                // distribute the items over k runs, the value encodes the
+                // run so that equal keys are ordered by run in the merge
+                for (size_t k : { 1, 2, 7, 32 }) {
+                    std::vector<std::vector<value_type> > runs(k);
+                    for (const value_type& item : items) {
+                        size_t r = static_cast<size_t>(rand()) % k;
+                        runs[r].emplace_back(
+                            item.first, static_cast<int>(r * n) + item.second);
+                    }
+                    std::vector<value_type> expected;
+                    std::vector<std::pair<iterator, iterator> > ranges;
+                    for (const auto& run : runs) {
+                        expected.insert(expected.end(), run.begin(), run.end());
+                        ranges.emplace_back(run.begin(), run.end());
+                    }
+                    std::sort(expected.begin(), expected.end());
+
+                    btree_type merged;
+                    merged.bulk_load_runs(ranges, threads);
+                    merged.verify();
+                    die_unless(merged.size() == n);
+                    die_unless(std::equal(merged.begin(), merged.end(),
+                                          expected.begin()));
+                    auto it = merged.end();
+                    for (size_t i = n; i > 0; --i)
+                        die_unless(*--it == expected[i - 1]);
+                }
+            }
+        }
+    }
+
+    static void test_range_10000() {
+        using btree_type =
+            reservoir::btree_multimap<int, int, std::less<>,
+                                      traits_nodebug<int>>;
+        btree_type bt;
+        std::multimap<int, int> map;
+        srand(17);
+        for (int i = 0; i < 10000; ++i) {
+            int key = rand() % 1000;
+            bt.insert2(key, i);
+            map.emplace(key, i);
+        }
+
+        for (int i = 0; i < 1000; ++i) {
+            int lo = rand() % 1100 - 50, hi = lo + rand() % 300 - 10;
+            size_t expected = 0;
+            if (lo < hi) {
+                expected = static_cast<size_t>(std::distance(
+                    map.lower_bound(lo), map.lower_bound(hi)));
+            }
+            die_unless(bt.count_range(lo, hi) == expected);
+        }
+
+        // erase ranges until the tree is empty, the last ones truncate
+        typename btree_type::detached_subtrees detached;
+        while (!map.empty()) {
+            int lo = rand() % 1000, hi = lo + rand() % 100;
+            if (map.size() < 2000)
+                hi = 1000;
+            size_t expected = 0;
+            if (lo < hi) {
+                auto first = map.lower_bound(lo), last = map.lower_bound(hi);
+                expected = static_cast<size_t>(std::distance(first, last));
+                map.erase(first, last);
+            }
+            die_unless(bt.erase_range(lo, hi, detached) == expected);
+            bt.verify();
+            die_unless(bt.size() == map.size());
+            // splitAt may reorder equal keys, so compare sorted contents
+            std::vector<std::pair<int, int> > items(bt.begin(), bt.end()),
+                expected_items(map.begin(), map.end());
+            std::sort(items.begin(), items.end());
+            std::sort(expected_items.begin(), expected_items.end());
+            die_unless(items == expected_items);
+            if (map.size() < 200) {
+                die_unless(bt.erase_from(-1) == map.size());
+                map.clear();
+                die_unless(bt.empty());
+            }
+        }
+    }
+
+    static void test_concurrent_insert_10000() {
+        using concurrent_type =
+            reservoir::concurrent_btree_multimap<int, int, std::less<>,
+                                                 traits_nodebug<int>>;
+        using btree_type =
+            reservoir::btree_multimap<int, int, std::less<>,
+                                      traits_nodebug<int>>;
+        concurrent_type ct;
+        btree_type bt;
+        std::vector<std::pair<int, int> > expected;
+        srand(19);
+        for (int i = 0; i < 1000; ++i) {
+            int key = rand() % 1000;
+            bt.insert2(key, -i);
+            expected.emplace_back(key, -i);
+        }
+
+        // every thread inserts its own keys, the data identifies the item
+        const int num_threads = 8, per_thread = 10000 / num_threads;
+        std::vector<std::vector<int> > keys(num_threads);
+        for (int t = 0; t < num_threads; ++t) {
+            for (int i = 0; i < per_thread; ++i) {
+                keys[t].push_back(rand() % 1000);
+                expected.emplace_back(keys[t].back(), t * per_thread + i);
+            }
+        }
+        std::vector<std::thread> threads;
+        for (int t = 0; t < num_threads; ++t) {
+            threads.emplace_back([&, t] {
+                for (int i = 0; i < per_thread; ++i)
+                    ct.insert2(keys[t][i], t * per_thread + i);
+            });
+        }
+        for (std::thread& thread : threads)
+            thread.join();
+
+        ct.verify();
+        die_unless(ct.size() == 10000);
+        ct.merge_into(bt, 3);
+        die_unless(ct.empty());
+        bt.verify();
+        die_unless(bt.size() == expected.size());
+
+        std::vector<std::pair<int, int> > items(bt.begin(), bt.end());
+        std::sort(items.begin(), items.end());
+        std::sort(expected.begin(), expected.end());
+        die_unless(items == expected);
+        for (size_t i = 0; i < expected.size(); i += 97)
+            die_unless(bt.find_rank(i)->first == expected[i].first);
+    }
+
+    static void test_truncate_10000() {
+        using btree_type =
+            reservoir::btree_multimap<int, std::unique_ptr<int>, std::less<>,
+                                      traits_nodebug<int>>;
+        btree_type bt;
+        std::multiset<int> set;
+        srand(7);
+        for (int i = 0; i < 10000; ++i) {
+            int key = rand() % 1000;
+            bt.insert2(key, std::make_unique<int>(key));
+            set.insert(key);
+        }
+        std::vector<int> keys(set.begin(), set.end());
+
+        // collect the detached subtrees of all truncations and free them at
+        // the end, the remaining trees must not depend on them
+        typename btree_type::detached_subtrees detached;
+        std::vector<size_t> sizes;
+        for (size_t k = 0; k <= 3 * Slots; ++k)
+            sizes.push_back(k);
+        for (size_t k = 3 * Slots + 1; k < keys.size(); k += 397)
+            sizes.push_back(k);
+        sizes.push_back(keys.size() - 1);
+        sizes.push_back(keys.size());
+        for (size_t k : sizes) {
+            std::vector<std::pair<int, std::unique_ptr<int>>> items;
+            for (int key : keys)
+                items.emplace_back(key, std::make_unique<int>(key));
+            btree_type tr;
+            tr.bulk_load(std::make_move_iterator(items.begin()),
+                         std::make_move_iterator(items.end()));
+            tr.truncate(k, detached);
+            tr.verify();
+            die_unless(tr.size() == k);
+            size_t i = 0;
+            for (auto it = tr.begin(); it != tr.end(); ++it, ++i) {
+                die_unless(it->first == keys[i]);
+                die_unless(*it->second == keys[i]);
+            }
+            die_unless(i == k);
+            for (auto it = tr.end(); it != tr.begin(); --i)
+                die_unless((--it)->first == keys[i - 1]);
+
+            // the truncated tree must remain fully usable
+            for (int j = 0; j < 10; ++j) {
+                int key = rand() % 1000;
+                tr.insert2(key, std::make_unique<int>(key));
+            }
+            die_unless(tr.size() == k + 10);
+        }
+        die_unless(!detached.empty());
+        detached.clear();
+        die_unless(detached.empty());
+
+        // truncate the same tree repeatedly, freeing right away
+        for (size_t k = bt.size(); k > 0; k = k * 3 / 4) {
+            auto cut = bt.truncate(k);
+            bt.verify();
+            die_unless(bt.size() == k);
+            die_unless(std::prev(bt.end())->first == keys[k - 1]);
+        }
+    }
+
+    static void test_truncate_reclaim_10000() {
+        using btree_type =
+            reservoir::btree_multimap<int, std::unique_ptr<int>, std::less<>,
+                                      traits_nodebug<int>>;
+        using detached_type = typename btree_type::detached_subtrees;
+        for (auto mode : { reservoir::reclaim_mode::immediate,
+                           reservoir::reclaim_mode::deferred,
+                           reservoir::reclaim_mode::background }) {
+            reservoir::reclaimer<detached_type> reclaim(mode);
+            detached_type detached;
+            btree_type bt;
+            srand(11);
+            // alternate growing and truncating, as the reservoir does
+            for (int round = 0; round < 20; ++round) {
+                for (int i = 0; i < 1000; ++i) {
+                    int key = rand() % 1000;
+                    bt.insert2(key, std::make_unique<int>(key));
+                }
+                bt.truncate(500, detached);
+                reclaim.retire(detached);
+                die_unless(detached.empty());
+                if (round % 3 == 0)
+                    reclaim.drain();
+                bt.verify();
+                die_unless(bt.size() == 500);
+                for (auto it = bt.begin(); it != bt.end(); ++it)
+                    die_unless(*it->second == it->first);
+            }
+            // whatever is still pending is freed by the destructor
+        }
+    }
+
+    static void test_truncate_splice_allocator_10000() {
+        using alloc_type = counting_allocator<std::pair<int, int>>;
+        using btree_type =
+            reservoir::btree_multimap<int, int, std::less<>,
+                                      traits_nodebug<int>, alloc_type>;
+        using detached_type = typename btree_type::detached_subtrees;
+        auto live = std::make_shared<long>(0);
+        {
+            btree_type bt{alloc_type(live)};
+            srand(12);
+            for (int i = 0; i < 10000; ++i) {
+                bt.insert2(rand() % 1000, i);
+            }
+            const long full = *live;
+
+            // the subtrees move to an object that never saw the tree, and
+            // through a reclaimer, and are freed by the tree's allocator
+            detached_type detached, spliced;
+            bt.truncate(100, detached);
+            die_unless(!detached.empty());
+            spliced.splice(detached);
+            die_unless(detached.empty() && !spliced.empty());
+            spliced.clear();
+            die_unless(*live < full);
+            bt.verify();
+
+            reservoir::reclaimer<detached_type> reclaim(
+                reservoir::reclaim_mode::deferred);
+            bt.truncate(10, detached);
+            reclaim.retire(detached);
+            reclaim.drain();
+            bt.verify();
+            die_unless(bt.size() == 10);
+        }
+        die_unless(*live == 0);
+    }
+
+    static void test_multimap_transform_keys_10000() {
+        using btree_type =
+            reservoir::btree_multimap<double, int, std::less<>,
+                                      traits_nodebug<double>>;
+        btree_type bt;
+        std::multiset<double> set;
+        srand(1);
+        for (int i = 0; i < 10000; ++i) {
+            double key = (rand() % 1000) / 7.0;
+            bt.insert2(key, i);
+            set.insert(key);
+        }
+
+        // multiplying by a positive factor preserves the order
+        const double factor = 1.0 / 3.0;
+        bt.transform_keys([factor](double key) { return key * factor; });
+        die_unless(bt.size() == set.size());
+
+        auto sit = set.begin();
+        for (auto it = bt.begin(); it != bt.end(); ++it, ++sit) {
+            die_unless(it->first == *sit * factor);
+        }
+        for (double key : {0.0, 10.0, 40.0, 142.7}) {
+            double scaled = key * factor;
+            die_unless(bt.rank_of_lower_bound(scaled).first ==
+                       static_cast<size_t>(std::distance(
+                           set.begin(), set.lower_bound(key))));
+            die_unless(bt.count(scaled) == set.count(key));
+        }
+    }
+
+    static void test_multimap_move_only_10000() {
+        using btree_type =
+            reservoir::btree_multimap<int, std::unique_ptr<int>, std::less<>,
+                                      traits_nodebug<int>>;
+        btree_type bt;
+        srand(2);
+        for (int i = 0; i < 10000; ++i) {
+            int key = rand() % 1000;
+            // the payload is the key, so that we can check that the payloads
+            // move along with their keys
+            auto ptr = std::make_unique<int>(key);
+            bt.insert2(key, std::move(ptr));
+            die_unless(!ptr);
+        }
+        for (int key = 0; key < 1000; key += 3) {
+            while (bt.erase_one(key)) {
+            }
+        }
+        bt.verify();
+
+        auto check = [](const btree_type& tree) {
+            for (auto it = tree.begin(); it != tree.end(); ++it) {
+                die_unless(it->second && *it->second == it->first);
+                die_unless(it->first % 3 != 0);
+            }
+        };
+        check(bt);
+
+        const size_t size = bt.size();
+        for (size_t split : {size_t{0}, size_t{1}, size / 3, size - 1, size}) {
+            btree_type left, right;
+            bt.splitAt(left, split, right);
+            die_unless(left.size() == split);
+            die_unless(right.size() == size - split);
+            left.verify();
+            right.verify();
+            check(left);
+            check(right);
+            left.join(right);
+            bt = std::move(left);
+        }
+        die_unless(bt.size() == size);
+        check(bt);
+    }
+
     SimpleTest() {
         test_empty();
         test_set_insert_erase_3200();
@@ -357,6 +1002,19 @@ struct SimpleTest {
         test_multiset_100000_uint32();
         test_multiset_split_10000();
         test_tree_rank_10000();
+        test_tree_find_ranks_10000();
+        test_tree_rank_modify_10000();
+        test_double_search_10000();
+        test_bulk_load_parallel_10000();
+        test_range_10000();
+        test_concurrent_insert_10000();
+        test_truncate_10000();
+        test_truncate_reclaim_10000();
+        test_truncate_splice_allocator_10000();
+        test_multimap_transform_keys_10000();
+        test_multimap_split_leaves_10000();
+        test_multimap_split_leaves_move_only_10000();
+        test_multimap_move_only_10000();
     }
 };
 
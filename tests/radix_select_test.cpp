@@ -0,0 +1,139 @@
+/*******************************************************************************
+ * tests/radix_select_test.cpp
+ *
+ * Tests of the sequential radix selection against sorting
+ *
+ * Copyright (C) 2019 Lorenz Hübschle-Schneider <lorenz@4z2.de>
+ *
+ * All rights reserved. Published under the GNU General Public License 3
+ ******************************************************************************/
+
+#include <reservoir/radix_select.hpp>
+
+#include <tlx/die.hpp>
+
+#include <algorithm>
+#include <memory>
+#include <random>
+#include <utility>
+#include <vector>
+
+//! Move-only item with a payload that identifies the original item.  Moving
+//! from an item invalidates its key, so self-moves break it.
+struct item {
+    double key = -1.0;
+    std::unique_ptr<size_t> id;
+
+    item() = default;
+    item(double k, size_t i) : key(k), id(std::make_unique<size_t>(i)) {}
+    item(item &&other) noexcept : key(other.key), id(std::move(other.id)) {
+        other.key = -1.0;
+    }
+    item &operator=(item &&other) noexcept {
+        key = other.key;
+        id = std::move(other.id);
+        other.key = -1.0;
+        return *this;
+    }
+};
+
+std::vector<item> make_items(const std::vector<double> &keys) {
+    std::vector<item> items;
+    for (size_t i = 0; i < keys.size(); i++) {
+        items.emplace_back(keys[i], i);
+    }
+    return items;
+}
+
+//! Run radix_select on items with the given keys and compare the result to
+//! the k smallest keys
+template <int radix_bits>
+void check_select(const std::vector<double> &keys, size_t k,
+                  std::vector<item> &tmp) {
+    std::vector<item> items = make_items(keys);
+    reservoir::radix_select<radix_bits>(
+        items, k, tmp,
+        [](const item &x) { return reservoir::double_bits(x.key); });
+
+    const size_t expected = std::min(k, keys.size());
+    die_unless(items.size() == expected);
+
+    // every item is intact, is one of the input items, and occurs once
+    std::vector<size_t> ids;
+    std::vector<double> result;
+    for (const item &x : items) {
+        die_unless(x.id != nullptr);
+        die_unless(keys[*x.id] == x.key);
+        ids.push_back(*x.id);
+        result.push_back(x.key);
+    }
+    std::sort(ids.begin(), ids.end());
+    die_unless(std::adjacent_find(ids.begin(), ids.end()) == ids.end());
+
+    // the keys are the k smallest, and the largest of them comes last
+    std::vector<double> sorted = keys;
+    std::sort(sorted.begin(), sorted.end());
+    sorted.resize(expected);
+    if (expected > 0) {
+        die_unless(result.back() == sorted.back());
+    }
+    std::sort(result.begin(), result.end());
+    die_unless(result == sorted);
+}
+
+template <int radix_bits>
+void test_random() {
+    std::mt19937_64 rng(42);
+    std::vector<item> tmp;
+    const std::vector<size_t> sizes = {0, 1, 2, 63, 64, 65, 200, 1000, 5000};
+    for (size_t n : sizes) {
+        // distinct keys, many duplicates, and few distinct keys
+        for (size_t range : {size_t{0}, n / 4 + 1, size_t{3}}) {
+            std::vector<double> keys(n);
+            for (double &key : keys) {
+                key = range == 0
+                          ? std::exponential_distribution<double>(1.0)(rng)
+                          : static_cast<double>(rng() % range);
+            }
+            for (size_t k : {size_t{0}, size_t{1}, n / 3, n / 2, n - 1, n,
+                             n + 1, 2 * n + 5}) {
+                if (k > 2 * n + 5)
+                    continue; // n - 1 for n = 0
+                check_select<radix_bits>(keys, k, tmp);
+            }
+        }
+    }
+}
+
+void test_equal_keys() {
+    std::vector<item> tmp;
+    std::vector<double> keys(1000, 1.5);
+    for (size_t k : {1, 64, 500, 999, 1000}) {
+        check_select<8>(keys, k, tmp);
+    }
+}
+
+void test_bucket_boundaries() {
+    // consecutive integers in the lowest bits: the target rank often ends
+    // exactly at a bucket boundary, where the whole bucket is selected
+    std::vector<item> tmp;
+    std::vector<double> keys;
+    for (size_t i = 0; i < 4096; i++) {
+        keys.push_back(static_cast<double>((i * 2654435761u) % 4096));
+    }
+    for (size_t k : {256, 512, 1024, 2048, 3072, 4095}) {
+        check_select<8>(keys, k, tmp);
+        check_select<4>(keys, k, tmp);
+    }
+}
+
+int main() {
+    test_random<8>();
+    test_random<5>(); // doesn't divide the number of key bits
+    test_random<11>();
+    test_equal_keys();
+    test_bucket_boundaries();
+    return 0;
+}
+
+/******************************************************************************/
@@ -0,0 +1,553 @@
+/*******************************************************************************
+ * tests/reservoir_test.cpp
+ *
+ * Tests of the distributed reservoirs, for any number of PEs
+ *
+ * Copyright (C) 2019 Lorenz Hübschle-Schneider <lorenz@4z2.de>
+ *
+ * All rights reserved. Published under the GNU General Public License 3
+ ******************************************************************************/
+
+#include <reservoir/ams_select.hpp>
+#include <reservoir/generators/select.hpp>
+#include <reservoir/mmap_input.hpp>
+#include <reservoir/reservoir.hpp>
+#include <reservoir/reservoir_forward_decay.hpp>
+#include <reservoir/reservoir_gather.hpp>
+#include <reservoir/reservoir_replacement.hpp>
+#include <reservoir/reservoir_window.hpp>
+
+#include <tlx/die.hpp>
+
+#include <boost/mpi.hpp>
+#include <boost/serialization/utility.hpp>
+#include <boost/serialization/vector.hpp>
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace mpi = boost::mpi;
+
+//! Item id that can be moved but not copied
+struct move_only_id {
+    std::unique_ptr<int> value;
+
+    move_only_id() = default;
+    explicit move_only_id(int v) : value(std::make_unique<int>(v)) {}
+
+    template <typename Archive>
+    void serialize(Archive &ar, const unsigned int /* version */) {
+        int v = value ? *value : -1;
+        ar &v;
+        if (Archive::is_loading::value)
+            value = std::make_unique<int>(v);
+    }
+
+    friend std::ostream &operator<<(std::ostream &os, const move_only_id &id) {
+        return os << (id.value ? *id.value : -1);
+    }
+};
+
+using item_type = std::pair<double, move_only_id>;
+
+template <typename T>
+using ams = reservoir::ams_select<T>;
+
+//! Id of the i-th item of a batch, unique over all batches and PEs
+int item_id(mpi::communicator &comm, size_t batch, size_t i) {
+    return static_cast<int>((batch * static_cast<size_t>(comm.size()) +
+                             static_cast<size_t>(comm.rank())) *
+                                100000 +
+                            i);
+}
+
+//! Batch of `count` items, the ids of which are consecutive and unique over
+//! all batches and PEs
+std::vector<item_type> make_batch(mpi::communicator &comm, size_t batch,
+                                  size_t count) {
+    std::vector<item_type> items;
+    for (size_t i = 0; i < count; ++i) {
+        items.emplace_back(1.0 + static_cast<double>(i % 7),
+                           move_only_id(item_id(comm, batch, i)));
+    }
+    return items;
+}
+
+//! Check that the ids of the local sample are valid and distinct, and that
+//! the global sample has the expected size
+template <typename Reservoir>
+void check_sample(mpi::communicator &comm, const Reservoir &res,
+                  size_t expected) {
+    std::vector<int> ids;
+    res.sample([&ids](const auto &item) {
+        die_unless(item.second.value != nullptr);
+        ids.push_back(*item.second.value);
+    });
+    std::sort(ids.begin(), ids.end());
+    die_unless(std::adjacent_find(ids.begin(), ids.end()) == ids.end());
+    size_t total = ids.size();
+    mpi::all_reduce(comm, mpi::inplace(total), std::plus<>());
+    die_unless(total == expected);
+}
+
+template <bool use_arena>
+void test_move_only_reservoir(mpi::communicator &comm) {
+    const size_t size = 100;
+    // the arena can't be combined with rebalancing
+    const double rebalance_factor = use_arena ? 0.0 : 1.2;
+    reservoir::reservoir<move_only_id, ams, reservoir::generators::select_t,
+                         use_arena>
+        res(comm, size, 42, rebalance_factor);
+
+    for (size_t batch = 0; batch < 5; ++batch) {
+        // uneven batch sizes, so that the rebalancer has to move items
+        const size_t count = comm.rank() == 0 ? 2000 : 200;
+        std::vector<item_type> items = make_batch(comm, batch, count);
+        res.insert(std::make_move_iterator(items.begin()),
+                   std::make_move_iterator(items.end()));
+        check_sample(comm, res, size);
+    }
+
+    size_t consumed = 0;
+    res.consume_sample([&consumed](item_type &&item) {
+        die_unless(item.second.value != nullptr);
+        ++consumed;
+    });
+    mpi::all_reduce(comm, mpi::inplace(consumed), std::plus<>());
+    die_unless(consumed == size);
+}
+
+void test_move_only_window(mpi::communicator &comm) {
+    const size_t size = 100;
+    reservoir::reservoir_window<move_only_id, ams,
+                                reservoir::generators::select_t>
+        res(comm, size, 3, 42);
+
+    for (size_t batch = 0; batch < 5; ++batch) {
+        std::vector<item_type> items = make_batch(comm, batch, 500);
+        res.insert(std::make_move_iterator(items.begin()),
+                   std::make_move_iterator(items.end()));
+        check_sample(comm, res, size);
+    }
+}
+
+//! The (key, id) pairs of the global sample, sorted
+template <typename Reservoir>
+std::vector<std::pair<double, int>> gather_sample(mpi::communicator &comm,
+                                                  const Reservoir &res) {
+    std::vector<std::pair<double, int>> local, global;
+    res.sample([&local](const auto &item) { local.push_back(item); });
+    std::vector<std::vector<std::pair<double, int>>> parts;
+    mpi::all_gather(comm, local, parts);
+    for (const auto &part : parts) {
+        global.insert(global.end(), part.begin(), part.end());
+    }
+    std::sort(global.begin(), global.end());
+    return global;
+}
+
+//! The window sample consists of the `size` smallest keys of the items in the
+//! window, for time stamps with uneven gaps and batches smaller than the
+//! sample.  The reference is a window shorter than the gaps between the time
+//! stamps, i.e., of a single batch, with the same seed.  It draws the same
+//! keys, and its sample holds the `size` smallest keys of each batch, among
+//! which are all keys of the window sample.
+void test_window_sample(mpi::communicator &comm) {
+    const size_t size = 100;
+    const double window = 3.0;
+    using res_type =
+        reservoir::reservoir_window<int, ams, reservoir::generators::select_t>;
+    res_type res(comm, size, window, 42), single(comm, size, 0.01, 42);
+
+    const std::vector<double> stamps = {0.0, 1.0, 1.5, 4.0, 4.2,
+                                        4.9, 5.0, 8.0, 12.0, 12.5};
+    // time stamps and reference samples of the batches in the window
+    std::vector<std::pair<double, std::vector<std::pair<double, int>>>> recent;
+    for (size_t batch = 0; batch < stamps.size(); ++batch) {
+        const double stamp = stamps[batch];
+        const size_t count =
+            batch % 4 == 2 ? 10 : 200 * static_cast<size_t>(comm.rank() + 1);
+        std::vector<std::pair<double, int>> items;
+        for (size_t i = 0; i < count; ++i) {
+            items.emplace_back(1.0 + static_cast<double>(i % 7),
+                               item_id(comm, batch, i));
+        }
+        res.insert(items.begin(), items.end(), stamp);
+        single.insert(items.begin(), items.end(), stamp);
+
+        recent.emplace_back(stamp, gather_sample(comm, single));
+        while (recent.front().first <= stamp - window) {
+            recent.erase(recent.begin());
+        }
+        std::vector<std::pair<double, int>> expected;
+        for (const auto &entry : recent) {
+            expected.insert(expected.end(), entry.second.begin(),
+                            entry.second.end());
+        }
+        std::sort(expected.begin(), expected.end());
+        expected.resize(std::min(expected.size(), size));
+
+        const std::vector<std::pair<double, int>> sample =
+            gather_sample(comm, res);
+        die_unless(sample == expected);
+        die_unless(res.threshold() ==
+                   (sample.empty() ? 0.0 : sample.back().first));
+
+        // no item of an expired batch
+        for (const auto &item : sample) {
+            const size_t item_batch = static_cast<size_t>(item.second) /
+                                      100000 /
+                                      static_cast<size_t>(comm.size());
+            die_unless(stamps[item_batch] > stamp - window);
+        }
+    }
+}
+
+//! Forward decay selects the same sample as inserting the batches into a
+//! reservoir with the weight scales exp(decay_rate * time), even though it
+//! moves the landmark several times.  After a time jump that would overflow
+//! the keys, the sample consists of the new items only.
+void test_forward_decay(mpi::communicator &comm) {
+    const size_t size = 100;
+    const double decay_rate = 1.0;
+    using select_t = reservoir::generators::select_t;
+    reservoir::reservoir_forward_decay<int, ams, select_t> decay(
+        comm, size, decay_rate, 42);
+    reservoir::reservoir<int, ams, select_t> reference(comm, size, 42);
+
+    auto make_items = [&comm](size_t batch, size_t count) {
+        std::vector<std::pair<double, int>> items;
+        for (size_t i = 0; i < count; ++i) {
+            items.emplace_back(1.0 + static_cast<double>(i % 7),
+                               item_id(comm, batch, i));
+        }
+        return items;
+    };
+    auto sample_ids = [](const auto &res) {
+        std::vector<int> ids;
+        res.sample([&ids](const auto &item) {
+            die_unless(std::isfinite(item.first));
+            ids.push_back(item.second);
+        });
+        std::sort(ids.begin(), ids.end());
+        return ids;
+    };
+
+    size_t batch = 0;
+    for (; batch < 10; ++batch) {
+        const double time = 30.0 * static_cast<double>(batch);
+        std::vector<std::pair<double, int>> items = make_items(batch, 500);
+        decay.insert(items.begin(), items.end(), time);
+        reference.insert(items.begin(), items.end(),
+                         std::exp(decay_rate * time));
+        die_unless(sample_ids(decay) == sample_ids(reference));
+    }
+    die_unless(decay.renormalizations() >= 3);
+
+    // The decay factor of the old items underflows, and their keys would
+    // overflow if they were rescaled.  The first batch after the jump is
+    // smaller than the sample, so all of it is sampled, and nothing else.
+    const size_t renormalizations = decay.renormalizations();
+    const size_t first_new = batch;
+    for (auto [count, time] : {std::make_pair(size_t{10}, 1e6),
+                               std::make_pair(size_t{500}, 1e6 + 1.0)}) {
+        std::vector<std::pair<double, int>> items = make_items(batch, count);
+        decay.insert(items.begin(), items.end(), time);
+        die_unless(decay.landmark() == 1e6);
+        ++batch;
+
+        const std::vector<int> ids = sample_ids(decay);
+        for (int id : ids) {
+            die_unless(id >= item_id(comm, first_new, 0));
+        }
+        size_t total = ids.size();
+        mpi::all_reduce(comm, mpi::inplace(total), std::plus<>());
+        die_unless(total ==
+                   std::min(size, count * static_cast<size_t>(comm.size())));
+    }
+    die_unless(decay.renormalizations() == renormalizations + 1);
+}
+
+//! Every slot of sampling with replacement holds an item with probability
+//! proportional to its weight.  Items of PE r have the weights (r + 1) * c
+//! for c in 1..4, and every (PE, c) group should fill a share of the slots
+//! proportional to its total weight, within five standard deviations.
+void test_replacement(mpi::communicator &comm) {
+    const size_t size = 20000, per_batch = 200, num_batches = 3;
+    reservoir::reservoir_replacement<int, reservoir::generators::select_t> res(
+        comm, size, 42);
+    const size_t nprocs = static_cast<size_t>(comm.size());
+    auto group_weight = [](size_t rank, size_t c) {
+        return static_cast<double>((rank + 1) * (c + 1));
+    };
+
+    for (size_t batch = 0; batch < num_batches; ++batch) {
+        std::vector<std::pair<double, int>> items;
+        for (size_t i = 0; i < per_batch; ++i) {
+            items.emplace_back(
+                group_weight(static_cast<size_t>(comm.rank()), i % 4),
+                item_id(comm, batch, i));
+        }
+        res.insert(items.begin(), items.end());
+    }
+
+    // number of slots of every group, and the total weight of every group
+    std::vector<size_t> counts(4 * nprocs, 0);
+    res.sample([&](const auto &item) {
+        const size_t id = static_cast<size_t>(item.second);
+        const size_t rank = id / 100000 % nprocs, i = id % 100000;
+        die_unless(i < per_batch);
+        ++counts[4 * rank + i % 4];
+    });
+    mpi::all_reduce(comm, mpi::inplace(counts.data()),
+                    static_cast<int>(counts.size()), std::plus<>());
+    std::vector<double> weights(4 * nprocs);
+    double total_weight = 0.0;
+    for (size_t g = 0; g < weights.size(); ++g) {
+        weights[g] = group_weight(g / 4, g % 4) *
+                     static_cast<double>(num_batches * per_batch / 4);
+        total_weight += weights[g];
+    }
+
+    size_t total = 0;
+    for (size_t g = 0; g < counts.size(); ++g) {
+        const double p = weights[g] / total_weight,
+                     expected = static_cast<double>(size) * p,
+                     stdev = std::sqrt(expected * (1 - p));
+        die_unless(std::abs(static_cast<double>(counts[g]) - expected) <=
+                   5 * stdev + 1);
+        total += counts[g];
+    }
+    die_unless(total == size);
+}
+
+//! A reader thread that holds a snapshot while insert() runs keeps seeing the
+//! sample of the batch before, and the next snapshot is the new sample
+void test_snapshot(mpi::communicator &comm) {
+    const size_t size = 100;
+    reservoir::reservoir<int, ams, reservoir::generators::select_t> res(
+        comm, size, 42);
+    res.publish_snapshots(true);
+    die_unless(res.snapshot() != nullptr && res.snapshot()->empty());
+
+    auto make_items = [&comm](size_t batch) {
+        std::vector<std::pair<double, int>> items;
+        for (size_t i = 0; i < 2000; ++i) {
+            items.emplace_back(1.0 + static_cast<double>(i % 7),
+                               item_id(comm, batch, i));
+        }
+        return items;
+    };
+    auto local_sample = [&res]() {
+        std::vector<std::pair<double, int>> items;
+        res.sample([&items](const auto &item) { items.push_back(item); });
+        return items;
+    };
+    auto contents = [](const auto &snapshot) {
+        return std::vector<std::pair<double, int>>(snapshot->begin(),
+                                                   snapshot->end());
+    };
+
+    for (size_t batch = 0; batch < 4; ++batch) {
+        std::vector<std::pair<double, int>> items = make_items(batch);
+        const std::vector<std::pair<double, int>> before = local_sample();
+
+        std::atomic<bool> holding(false), done(false);
+        std::thread reader([&]() {
+            auto held = res.snapshot();
+            holding = true;
+            // read the held snapshot over and over while the batch is inserted
+            do {
+                die_unless(contents(held) == before);
+            } while (!done);
+            die_unless(contents(held) == before);
+        });
+        while (!holding) {
+            std::this_thread::yield();
+        }
+        res.insert(items.begin(), items.end());
+        done = true;
+        reader.join();
+
+        die_unless(contents(res.snapshot()) == local_sample());
+    }
+}
+
+//! insert_balanced on a batch that is entirely at PE 0 selects the same
+//! sample as insert on the balanced batch, where PE r holds the r-th part
+void test_insert_balanced(mpi::communicator &comm) {
+    const size_t size = 100, part = 1000;
+    using res_type =
+        reservoir::reservoir<int, ams, reservoir::generators::select_t>;
+    res_type balanced(comm, size, 42), reference(comm, size, 42);
+
+    const size_t nprocs = static_cast<size_t>(comm.size()),
+                 rank = static_cast<size_t>(comm.rank());
+    for (size_t batch = 0; batch < 4; ++batch) {
+        std::vector<std::pair<double, int>> items;
+        for (size_t i = 0; i < nprocs * part; ++i) {
+            items.emplace_back(1.0 + static_cast<double>(i % 11),
+                               static_cast<int>(batch * 100000 + i));
+        }
+        // the last batch checks that the weight scale is passed on
+        const double weight_scale = batch == 3 ? 2.5 : 1.0;
+        if (rank == 0) {
+            balanced.insert_balanced(items.begin(), items.end(), weight_scale);
+        } else {
+            balanced.insert_balanced(items.end(), items.end(), weight_scale);
+        }
+        reference.insert(items.begin() + rank * part,
+                         items.begin() + (rank + 1) * part, weight_scale);
+
+        std::vector<std::pair<double, int>> sample, expected;
+        balanced.sample(
+            [&sample](const auto &item) { sample.push_back(item); });
+        reference.sample(
+            [&expected](const auto &item) { expected.push_back(item); });
+        die_unless(sample == expected);
+        size_t total = sample.size();
+        mpi::all_reduce(comm, mpi::inplace(total), std::plus<>());
+        die_unless(total == size);
+    }
+}
+
+//! Gathering the candidates up a binomial tree selects the same sample as
+//! gathering them at PE 0 directly, for batch sizes that differ between PEs
+void test_gather_tree(mpi::communicator &comm) {
+    const size_t size = 100;
+    using select_t = reservoir::generators::select_t;
+    reservoir::reservoir_gather<int, select_t, false> flat(comm, size, 42);
+    reservoir::reservoir_gather<int, select_t, true> tree(comm, size, 42);
+
+    for (size_t batch = 0; batch < 5; ++batch) {
+        std::vector<std::pair<double, int>> items;
+        const size_t count =
+            300 * static_cast<size_t>(comm.rank() + 1) + 37 * batch;
+        for (size_t i = 0; i < count; ++i) {
+            items.emplace_back(1.0 + static_cast<double>(i % 5),
+                               item_id(comm, batch, i));
+        }
+        flat.insert(items.begin(), items.end());
+        tree.insert(items.begin(), items.end());
+
+        // the sample is only stored at PE 0
+        std::vector<int> flat_ids, tree_ids;
+        flat.sample([&flat_ids](int id) { flat_ids.push_back(id); });
+        tree.sample([&tree_ids](int id) { tree_ids.push_back(id); });
+        std::sort(flat_ids.begin(), flat_ids.end());
+        std::sort(tree_ids.begin(), tree_ids.end());
+        die_unless(flat_ids == tree_ids);
+        die_unless(flat_ids.size() == (comm.rank() == 0 ? size : 0));
+    }
+}
+
+//! Write n items to a file in the records and in the columns format, map both
+//! on every PE, and check that they agree with each other and the input
+void test_mmap_input(mpi::communicator &comm) {
+    const size_t n = 10007, size = 100;
+    std::vector<std::pair<double, int>> items;
+    for (size_t i = 0; i < n; ++i) {
+        items.emplace_back(1.0 + static_cast<double>(i % 13),
+                           static_cast<int>(3 * i));
+    }
+
+    std::string base;
+    if (comm.rank() == 0) {
+        base = (std::filesystem::temp_directory_path() /
+                ("reservoir_test_" + std::to_string(getpid())))
+                   .string();
+        std::ofstream records(base + ".records", std::ios::binary);
+        records.write(reinterpret_cast<const char *>(items.data()),
+                      static_cast<std::streamsize>(n * sizeof(items[0])));
+        std::ofstream columns(base + ".columns", std::ios::binary);
+        for (const auto &item : items) {
+            columns.write(reinterpret_cast<const char *>(&item.first),
+                          sizeof(item.first));
+        }
+        for (const auto &item : items) {
+            columns.write(reinterpret_cast<const char *>(&item.second),
+                          sizeof(item.second));
+        }
+    }
+    mpi::broadcast(comm, base, 0);
+
+    {
+        reservoir::mmap_records<int> records(base + ".records", comm.rank(),
+                                             comm.size());
+        reservoir::mmap_columns<int> columns(base + ".columns", comm.rank(),
+                                             comm.size());
+        die_unless(records.total_size() == n && columns.total_size() == n);
+        die_unless(records.size() == columns.size());
+        size_t total = records.size();
+        mpi::all_reduce(comm, mpi::inplace(total), std::plus<>());
+        die_unless(total == n);
+
+        // the PEs' parts are consecutive
+        size_t first = 0;
+        mpi::scan(comm, records.size(), first, std::plus<>());
+        first -= records.size();
+        auto col = columns.begin();
+        for (auto rec = records.begin(); rec != records.end(); ++rec, ++col) {
+            const auto &expected = items[first + (rec - records.begin())];
+            die_unless(*rec == expected);
+            die_unless(col->first == expected.first);
+            die_unless((*col).second == expected.second);
+        }
+        die_unless(col == columns.end());
+
+        // inserting either one produces the same sample
+        using res_type = reservoir::reservoir<int, ams,
+                                              reservoir::generators::select_t>;
+        res_type from_records(comm, size, 42), from_columns(comm, size, 42);
+        from_records.insert(records.begin(), records.end());
+        from_columns.insert(columns.begin(), columns.end());
+        std::vector<std::pair<double, int>> sample_records, sample_columns;
+        from_records.sample(
+            [&](const auto &item) { sample_records.push_back(item); });
+        from_columns.sample(
+            [&](const auto &item) { sample_columns.push_back(item); });
+        die_unless(sample_records == sample_columns);
+        size_t sample_size = sample_records.size();
+        mpi::all_reduce(comm, mpi::inplace(sample_size), std::plus<>());
+        die_unless(sample_size == size);
+    }
+
+    comm.barrier();
+    if (comm.rank() == 0) {
+        std::remove((base + ".records").c_str());
+        std::remove((base + ".columns").c_str());
+    }
+}
+
+int main(int argc, char *argv[]) {
+    mpi::environment env(argc, argv);
+    mpi::communicator comm;
+
+    test_move_only_reservoir<false>(comm);
+    test_move_only_reservoir<true>(comm);
+    test_move_only_window(comm);
+    test_window_sample(comm);
+    test_forward_decay(comm);
+    test_replacement(comm);
+    test_snapshot(comm);
+    test_mmap_input(comm);
+    test_gather_tree(comm);
+    test_insert_balanced(comm);
+
+    return 0;
+}
+
+/******************************************************************************/
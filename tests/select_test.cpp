@@ -0,0 +1,224 @@
+/*******************************************************************************
+ * tests/select_test.cpp
+ *
+ * Tests of the distributed selection algorithms against sorting, for any
+ * number of PEs
+ *
+ * Copyright (C) 2019 Lorenz Hübschle-Schneider <lorenz@4z2.de>
+ *
+ * All rights reserved. Published under the GNU General Public License 3
+ ******************************************************************************/
+
+#include <reservoir/btree_multiset.hpp>
+#include <reservoir/fr_select.hpp>
+#include <reservoir/quantiles.hpp>
+#include <reservoir/sorted_range_seq.hpp>
+
+#include <tlx/die.hpp>
+
+#include <boost/mpi.hpp>
+#include <boost/serialization/vector.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <functional>
+#include <iterator>
+#include <random>
+#include <utility>
+#include <vector>
+
+namespace mpi = boost::mpi;
+
+using tree_type = reservoir::btree_multiset<double>;
+using vector_seq =
+    reservoir::sorted_range_seq<std::vector<double>::const_iterator>;
+
+//! Sorted keys of this PE: distinct keys (mode 0), keys from {1..50} (mode 1)
+//! or all-equal keys (mode 2).  With several PEs, the last one has none.
+std::vector<double> make_keys(mpi::communicator &comm, int mode, size_t n) {
+    std::vector<double> keys;
+    if (comm.size() > 1 && comm.rank() == comm.size() - 1)
+        return keys;
+
+    std::mt19937_64 rng(comm.rank() + 7);
+    for (size_t i = 0; i < n; ++i) {
+        if (mode == 0) {
+            keys.push_back(std::uniform_real_distribution<double>()(rng));
+        } else if (mode == 1) {
+            keys.push_back(static_cast<double>(1 + rng() % 50));
+        } else {
+            keys.push_back(1.0);
+        }
+    }
+    std::sort(keys.begin(), keys.end());
+    return keys;
+}
+
+//! The keys of all PEs, sorted
+std::vector<double> gather_sorted(mpi::communicator &comm,
+                                  const std::vector<double> &keys) {
+    std::vector<std::vector<double>> parts;
+    mpi::all_gather(comm, keys, parts);
+    std::vector<double> sorted;
+    for (const auto &part : parts) {
+        sorted.insert(sorted.end(), part.begin(), part.end());
+    }
+    std::sort(sorted.begin(), sorted.end());
+    return sorted;
+}
+
+//! Check that the local splits select exactly k elements globally, and that
+//! these are the k smallest ones
+template <typename Seq, typename Result>
+void check_split(mpi::communicator &comm, const Seq &seq, const Result &result,
+                 const std::vector<double> &sorted, size_t k) {
+    die_unless(result.second >= 0 &&
+               static_cast<size_t>(result.second) <= seq.size());
+    die_unless(std::distance(seq.begin(), result.first) == result.second);
+
+    size_t count = static_cast<size_t>(result.second);
+    mpi::all_reduce(comm, mpi::inplace(count), std::plus<>());
+    die_unless(count == k);
+    if (k == 0)
+        return;
+
+    const double kth = sorted[k - 1];
+    for (auto it = seq.begin(); it != result.first; ++it) {
+        die_unless(*it <= kth);
+    }
+    for (auto it = result.first; it != seq.end(); ++it) {
+        die_unless(*it >= kth);
+    }
+}
+
+//! Select k elements for several k, including the special case k = 1
+template <typename Selector, typename Seq>
+void test_selector(mpi::communicator &comm, const Seq &seq,
+                   const std::vector<double> &sorted) {
+    Selector select(comm, 42 + static_cast<size_t>(comm.rank()));
+    const size_t n = sorted.size();
+    for (size_t k : {size_t{1}, size_t{2}, size_t{100}, n / 3, n / 2, n - 1,
+                     n}) {
+        check_split(comm, seq, select(seq, k, k), sorted, k);
+    }
+}
+
+//! Select many ranks at once: unordered, repeated, 0, 1 and the global size
+template <typename Seq>
+void test_multi_select(mpi::communicator &comm, const Seq &seq,
+                       const std::vector<double> &sorted) {
+    // small enough for several sampling rounds
+    reservoir::multi_select<Seq, 1024> select(
+        comm, 42 + static_cast<size_t>(comm.rank()));
+    const size_t n = sorted.size();
+    const std::vector<size_t> ks = {n / 2, 1, n, 0, 100, n / 2, n - 1, 2};
+    auto results = select(seq, ks);
+    die_unless(results.size() == ks.size());
+    for (size_t i = 0; i < ks.size(); ++i) {
+        check_split(comm, seq, results[i], sorted, ks[i]);
+    }
+}
+
+//! Nearest-rank quantiles, including q = 0, q = 1 and repeated quantiles
+template <typename Seq>
+void test_quantiles(mpi::communicator &comm, const Seq &seq,
+                    const std::vector<double> &sorted) {
+    const std::vector<double> qs = {0.5, 0.0, 0.1, 0.5, 0.999, 1.0};
+    auto results = reservoir::distributed_quantiles(
+        seq, qs, comm, 42 + static_cast<size_t>(comm.rank()));
+    die_unless(results.size() == qs.size());
+    const double n = static_cast<double>(sorted.size());
+    for (size_t i = 0; i < qs.size(); ++i) {
+        const size_t rank =
+            std::max<size_t>(1, static_cast<size_t>(std::ceil(qs[i] * n)));
+        die_unless(results[i].rank == rank);
+        die_unless(results[i].key == sorted[rank - 1]);
+        check_split(comm, seq,
+                    std::make_pair(results[i].it, results[i].local_rank),
+                    sorted, rank);
+    }
+}
+
+//! The rank queries of sorted_range_seq, for present and missing keys
+void test_sorted_range_seq() {
+    const std::vector<double> keys = {1.0, 2.0, 2.0, 2.0, 5.0, 7.0};
+    const vector_seq seq = reservoir::make_sorted_range_seq(keys);
+    seq.verify();
+    die_unless(seq.size() == keys.size() && !seq.empty());
+
+    die_unless(seq.find_rank(0) == seq.begin());
+    die_unless(*seq.find_rank(4) == 5.0);
+    die_unless(seq.find_rank(seq.size()) == seq.end());
+    die_unless(seq.find_rank(seq.size() + 1) == seq.end());
+    die_unless(seq.rank_of(seq.find_rank(3)) == 3);
+
+    const std::vector<size_t> ranks = {0, 2, 5, 6};
+    std::vector<vector_seq::const_iterator> iters;
+    seq.find_ranks(ranks.begin(), ranks.end(), std::back_inserter(iters));
+    die_unless(iters.size() == ranks.size());
+    for (size_t i = 0; i < ranks.size(); ++i) {
+        die_unless(iters[i] == seq.find_rank(ranks[i]));
+    }
+
+    // present keys: the first occurrence
+    die_unless(seq.rank_of(2.0) ==
+               std::make_pair(size_t{1}, keys.cbegin() + 1));
+    die_unless(seq.rank_of(7.0).first == 5);
+    // missing keys, below, between and above the present ones
+    for (double key : {0.5, 3.0, 6.0, 8.0}) {
+        die_unless(seq.rank_of(key) == std::make_pair(seq.size(), seq.end()));
+    }
+
+    die_unless(seq.rank_of_lower_bound(2.0).first == 1);
+    die_unless(seq.rank_of_upper_bound(2.0).first == 4);
+    die_unless(seq.rank_of_lower_bound(3.0).first == 4);
+    die_unless(seq.rank_of_upper_bound(3.0).first == 4);
+    die_unless(seq.rank_of_lower_bound(0.5).first == 0);
+    die_unless(seq.rank_of_upper_bound(8.0) ==
+               std::make_pair(seq.size(), seq.end()));
+
+    // pairs are ordered by their first element
+    const std::vector<std::pair<double, int>> pairs = {{1.0, 3}, {4.0, 1}};
+    const auto pair_seq = reservoir::make_sorted_range_seq(pairs);
+    die_unless(pair_seq.rank_of(4.0).first == 1);
+    die_unless(pair_seq.rank_of(2.0).first == pair_seq.size());
+
+    const std::vector<double> none;
+    const vector_seq empty = reservoir::make_sorted_range_seq(none);
+    die_unless(empty.empty() && empty.find_rank(0) == empty.end());
+    die_unless(empty.rank_of(1.0).first == 0);
+}
+
+int main(int argc, char *argv[]) {
+    mpi::environment env(argc, argv);
+    mpi::communicator comm;
+
+    test_sorted_range_seq();
+
+    for (int mode = 0; mode < 3; ++mode) {
+        const std::vector<double> keys = make_keys(comm, mode, 20000);
+        const std::vector<double> sorted = gather_sorted(comm, keys);
+        tree_type tree;
+        tree.bulk_load(keys.begin(), keys.end());
+
+        // with the default sample size, and with one small enough that the
+        // selection takes several sampling rounds
+        test_selector<reservoir::fr_select<tree_type>>(comm, tree, sorted);
+        test_selector<reservoir::fr_select<tree_type, 256>>(comm, tree,
+                                                            sorted);
+        test_multi_select(comm, tree, sorted);
+        test_quantiles(comm, tree, sorted);
+
+        // the same on the sorted vector, through binary search
+        const vector_seq seq = reservoir::make_sorted_range_seq(keys);
+        test_selector<reservoir::fr_select<vector_seq>>(comm, seq, sorted);
+        test_selector<reservoir::fr_select<vector_seq, 256>>(comm, seq,
+                                                             sorted);
+        test_multi_select(comm, seq, sorted);
+        test_quantiles(comm, seq, sorted);
+    }
+
+    return 0;
+}
+
+/******************************************************************************/